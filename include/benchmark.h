@@ -4,6 +4,8 @@
 #ifdef CONFIG_BUILD_BENCHMARK
 
 int dict_benchmark_main(long count);
+int hash_benchmark_main();
+int sds_benchmark_main();
 
 #endif
 
@@ -1,29 +1,77 @@
 #ifndef CLIENT_H_INCLUDED
 #define CLIENT_H_INCLUDED
 
-#include <sys/select.h>
 #include "obj.h"
 #include "db.h"
 #include "sds.h"
 
-#define CLIENT_BUF_SIZE 512
-#define CLIENT_MAX_ARG  6
+#define CLIENT_MAX_ARG  64
+#define CLIENT_MAX_QUERY_BUF_LEN    (1024*1024*1024)    // Max size of client query buf. Client is closed beyond that
+#define CLIENT_MAX_INLINE_SIZE      (32*1024)   // Max size of a single inline command
+#define CLIENT_MAX_BULK_LEN         (CLIENT_MAX_QUERY_BUF_LEN - 1024)   // Max size of a RESP bulk argument
+#define CLIENT_REPLY_BUF_SIZE       (16*1024)   // Size of the fixed reply buf, the fast path for small replies
+#define CLIENT_REPLY_CHUNK_BYTES    (16*1024)   // Min size of a block in the reply list
+
+// Request types. A client request is either an inline command line or a RESP multibulk.
+#define CLIENT_REQ_UNKNOWN      0
+#define CLIENT_REQ_INLINE       1
+#define CLIENT_REQ_MULTIBULK    2
+
+// Client flags
+#define CLIENT_CLOSE_AFTER_REPLY    (1<<0)  // Close the connection once pending replies are written
+#define CLIENT_PENDING_WRITE        (1<<1)  // Client is in clients_pending_write of its shard
+#define CLIENT_PENDING_READ         (1<<2)  // Client is in clients_pending_read of its shard
+#define CLIENT_PENDING_COMMAND      (1<<3)  // A command is parsed by an io thread, to be executed
+#define CLIENT_CLOSE_ASAP           (1<<4)  // Connection is broken. Close it on the main thread
+#define CLIENT_BLOCKED              (1<<5)  // Command is being executed by another shard
+#define CLIENT_SEND_IN_FLIGHT       (1<<6)  // A send of replies is done by the event loop. See net.c
 
 struct command; // Forward declaration, DO NOT REMOVE
+struct arena_shard;
+
+// A block of reply in the client reply list. Used when replies don't fit in 'reply_buf'.
+typedef struct client_reply_block {
+    struct client_reply_block *next;
+    size_t size;    // capacity of 'buf'
+    size_t used;    // bytes used in 'buf'
+    char buf[];
+} client_reply_block;
 
 typedef struct client{
     // Socket fd
     int fd;
+    int flags;      // CLIENT_XXX flags
+    struct arena_shard *shard;  // shard that accepted the client
     // Command
     struct command *cmd;   // current command
     int argc;       // number of arguments to the current command
-    sds argv[CLIENT_MAX_ARG];      // TODO argument objects to the current command. 6 should be enough
-    // Recv buf
-    char recv_buf[CLIENT_BUF_SIZE];
-    size_t recv_size; // size of received commands in 'recv_buf'
-    // Reply buf
-    char reply_buf[CLIENT_BUF_SIZE];
+    // Arguments of the current command. RESP arguments are sds views into query_buf, made in
+    // place by the parser, so they are neither allocated nor freed. Inline arguments are owned.
+    // See command.c
+    sds argv[CLIENT_MAX_ARG];
+    size_t argv_pos[CLIENT_MAX_ARG];    // query_buf offsets of views parsed so far by an incomplete multibulk
+    // Multi-key commands with keys in several shards are executed by the shards in turn, each
+    // for its own keys. See cmd_mget()
+    int *key_shards;    // shard of each key argument, or NULL
+    sds *key_vals;      // values found so far, NULL if missing
+    // Query buf. Received data is appended to it until whole commands can be parsed out.
+    sds query_buf;
+    size_t qb_pos;      // start of the unparsed data in query_buf
+    size_t qb_scan_pos; // position in query_buf up to which the parser has scanned
+    int req_type;       // CLIENT_REQ_XXX of the request being parsed. Replies use the same protocol
+    long multibulk_len; // number of multibulk arguments left to parse
+    long bulk_len;      // length of the bulk argument being parsed, -1 if not known yet
+    // Reply buf. Replies are appended to 'reply_buf' until it's full. Then they go to the reply
+    // list, and keep going there until the list is written out, so that replies stay in order.
+    char reply_buf[CLIENT_REPLY_BUF_SIZE];
     size_t reply_size;  // current reply size in reply_buf.
+    client_reply_block *reply_head;
+    client_reply_block *reply_tail;
+    size_t reply_list_bytes;    // total bytes used in the reply list
+    size_t sent_len;    // bytes already sent of reply_buf, or of reply_head if reply_buf is empty
+    // I/O completed by the event loop while the client is blocked, taken in once unblocked
+    sds recv_buf;       // data received
+    long send_res;      // result of the send in flight, 0 if none
     // Database
     database *db;   // the database currently SELECTed
 } client;
@@ -31,8 +79,10 @@ typedef struct client{
 // Function declaration
 void client_init();
 client *client_lookup(int fd);
-void client_register(int fd);
+client *client_register(int fd);
 void client_unregister(int fd);
+int client_has_pending_replies(client *c);
+void client_list_remove(client **list, int *num, client *c);
 
 
 #endif // CLIENT_H_INCLUDED
@@ -7,17 +7,25 @@
 #define C_OK    0
 #define C_ERR   1
 
+// Command flags
+#define CMD_WRITE       (1<<0)  // may modify the keyspace. Keys are evicted before it if over maxmemory
+#define CMD_DENYOOM     (1<<1)  // may grow memory usage. Refused if still over maxmemory after eviction
+
 typedef void command_proc(client *c);
 
 typedef struct command {
     int id;                 // command id
     char *name;             // command name
     command_proc *proc;     // command's callback procedure. The arguments to the procedure are stored in c->argv.
-    int arity;              // number of argument needed // TODO some future command may have variadic number of argument
+    int arity;              // number of arguments needed. -N means N or more
+    int key_pos;            // position of the key in argv, used to route the command to its shard. 0 if no key
+    int flags;              // CMD_XXX flags
 } command;
 
 void command_dict_init();
-void command_parse_client_args(client *c);
+int command_parse_client_args(client *c);
+void command_free_client_args(client *c);
 void command_process(client *c);
+void command_execute_forwarded(client *c);
 
 #endif // COMMAND_H_INCLUDED
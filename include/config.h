@@ -24,15 +24,42 @@
 // CONFIG_BUILD_XXX can be commented out if its functionaty is not desired.
 #define CONFIG_BUILD_TEST
 #define CONFIG_BUILD_BENCHMARK
+// Define CONFIG_NO_SLAB to allocate dict entries and objects by zmalloc() instead of slabs. See slab.c
+//#define CONFIG_NO_SLAB
 
 // CONFIGs below are consant parameters that you'd better not moditfy them for perfomance issues
 #define CONFIG_MAX_DB_NUM       16
+// Extra fds reserved in the event loop besides clients, for listening socket, stdin, log file, etc.
+#define CONFIG_FDSET_INCR       128
+// Max microseconds server_cron() spends on rehashing databases each time it runs
+#define CONFIG_ACTIVE_REHASH_CYCLE_US 1000
+// Range of server.hz, the frequency server_cron() runs at
+#define CONFIG_MIN_HZ           1
+#define CONFIG_MAX_HZ           500
+// Max number of threads doing client I/O, including the main thread
+#define CONFIG_MAX_IO_THREADS   64
+// Max number of shards, each running in its own thread
+#define CONFIG_MAX_SHARDS       64
+// Values costing more than this to free are freed by the lazyfree thread on 'del'. See lazyfree.c
+#define CONFIG_LAZYFREE_THRESHOLD 64
 
 // CONFIG_PARAM_XXX are configurable parameters that you can adjust for customized building
 #define CONFIG_PARAM_DB_NUM     CONFIG_MAX_DB_NUM
+#define CONFIG_PARAM_MAX_CLIENTS 10000
+#define CONFIG_PARAM_HZ         10
+#define CONFIG_PARAM_IO_THREADS 1   // 1 means client I/O is done by the main thread only
+#define CONFIG_PARAM_SHARDS     1   // 1 means the whole server runs in the main thread
+#define CONFIG_PARAM_EVENT_BACKEND AE_BACKEND_EPOLL // or AE_BACKEND_IO_URING. See event.c
+#define CONFIG_PARAM_DB_DICT_ENGINE DICT_ENGINE_CHAINED // or DICT_ENGINE_SWISS. See dict.c
+#define CONFIG_PARAM_DB_HASH    DICT_HASH_SIPHASH   // or DICT_HASH_WYHASH, DICT_HASH_CRC32C. See hash.c
+#define CONFIG_PARAM_DB_EMBED_KEY_LEN 30 // Keys up to this long share an allocation with their entry. See dict.c
+#define CONFIG_PARAM_MAXMEMORY  0   // bytes, 0 means no limit. Accepts kb, mb and gb as a parameter
+#define CONFIG_PARAM_MAXMEMORY_POLICY EVICT_NOEVICTION // or EVICT_ALLKEYS_LRU, EVICT_ALLKEYS_RANDOM. See evict.c
+#define CONFIG_PARAM_MAXMEMORY_SAMPLES 5
 
 
 
 
 // Function declarations
 void config_init();
+int config_load_params(int argc, char *argv[]);
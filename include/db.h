@@ -2,14 +2,25 @@
 #define DB_H_INCLUDED
 
 #include "dict.h"
+#include "sds.h"
 
 typedef struct database{
     dict *d;        // key-value space. key is always of type string
     int id;
 } database;
 
+// How db_delete() frees the value of the deleted key
+#define DB_FREE_SYNC    0   // right away
+#define DB_FREE_LAZY    1   // by the lazyfree thread if it's costly, see lazyfree_get_effort()
+#define DB_FREE_ASYNC   2   // by the lazyfree thread
+
 // Function declarations
 void db_init();
+dict_entry *db_find(database *db, sds key);
+size_t db_find_batch(database *db, sds *keys, size_t n, dict_entry **out);
+int db_add(database *db, sds key, void *val);
+int db_delete(database *db, sds key, int free_mode);
+void db_empty(database *db, int async);
 
 extern dict_type db_dict_type;
 extern database *db;
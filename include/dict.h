@@ -7,6 +7,20 @@
 #define DICT_OK 0
 #define DICT_ERR 1
 
+// Engines storing dict entries. See dict.c
+#define DICT_ENGINE_CHAINED 0   // Slots chain malloc()ed entries
+#define DICT_ENGINE_SWISS   1   // Entries stored inline, open addressing probed by groups
+
+// Control bytes of slots in DICT_ENGINE_SWISS tables. A full slot has the 7 low bits of its hash.
+#define DICT_CTRL_EMPTY     ((int8_t)-128)
+#define DICT_CTRL_DELETED   ((int8_t)-2)
+// Slots of DICT_ENGINE_SWISS tables are probed by groups of this many control bytes
+#if defined(__AVX2__)
+#define DICT_GROUP_WIDTH    32
+#else
+#define DICT_GROUP_WIDTH    16
+#endif
+
 // Dict entry that holds a key-value pair
 typedef struct dict_entry
 {
@@ -17,7 +31,10 @@ typedef struct dict_entry
         int64_t s64;
         double d;
     } v;
-    struct dict_entry *next;
+    union {
+        struct dict_entry *next;    // DICT_ENGINE_CHAINED: next entry in the slot
+        uint64_t hash;              // DICT_ENGINE_SWISS: hash of the key
+    };
 } dict_entry;
 
 // Dict type with methods for various dict operations
@@ -29,6 +46,12 @@ typedef struct dict_type
     int (*key_compare_func)(const void *key1, const void *key2);
     void (*key_destructor_func)(void *key);
     void (*val_destructor_func)(void *val);
+    int engine;     // DICT_ENGINE_XXX. Chained if not set
+    int store_hash; // Keep hash of the key with each entry of DICT_ENGINE_CHAINED, so that rehashing
+                    // doesn't hash keys again and lookups compare hashes before keys. It costs
+                    // 8 bytes per entry. DICT_ENGINE_SWISS always does so for free
+    int embed_key_len;  // DICT_ENGINE_CHAINED only. Keys (sds) up to this long are copied into the
+                        // entry on add, so they share one allocation. 0 disables it. See dict.c
 } dict_type;
 
 //  Dict hash table that holds meta data about dict entry table.
@@ -38,6 +61,10 @@ typedef struct dict_ht
     unsigned long size;         // num of slots in the table, always power of 2
     unsigned long size_mask;    // size - 1
     unsigned long keys;         // num of dict entries(keys) used in the table
+    // DICT_ENGINE_SWISS only. 'table' is not used
+    int8_t *ctrl;               // control byte of each slot
+    dict_entry *slots;          // entries stored inline
+    unsigned long deleted;      // num of DICT_CTRL_DELETED slots (tombstones)
 } dict_ht;
 
 // Dict structure. Every dict has two dict_ht for rehashing.
@@ -45,7 +72,7 @@ typedef struct dict
 {
     dict_type *type;
     dict_ht ht[2];
-    long rehash_idx;
+    long rehash_idx;            // slot index, or group index for DICT_ENGINE_SWISS
     unsigned long num_safe_iterators;
 } dict;
 
@@ -62,8 +89,23 @@ typedef struct dict_iterator
     long long fingerprint; // Fingerprint for unsafe iterator
 } dict_iterator;
 
+// Called by dict_scan() with each entry scanned
+typedef void dict_scan_proc(void *privdata, const dict_entry *de);
+
+// Hash functions of sds keys that dict types can choose. See dict_sample_hash_func()
+#define DICT_HASH_SIPHASH   0   // Resists hash flooding. For untrusted clients
+#define DICT_HASH_WYHASH    1
+#define DICT_HASH_CRC32C    2
+
 // Initial size of every dict hash table
 #define DICT_HT_INITIAL_SIZE 4
+// Hash tables filled less than this, in percent, are shrunk. See dict_shrink_if_needed()
+#define DICT_HT_MIN_FILL    10
+// Max 'embed_key_len' of dict_type, so that embedded keys need sds_hdr_5 or sds_hdr_8 only
+#define DICT_EMBED_KEY_MAX  255
+// Entries of DICT_ENGINE_CHAINED with an embedded key have this bit set in 'next'. Entries are
+// allocated aligned, so the bit is clear otherwise. Use dict_get_next() to follow chains
+#define DICT_ENTRY_KEY_EMBEDDED ((uintptr_t)1)
 // Macros
 #define dict_set_val(d, entry, _val_) do {\
     if ((d)->type->val_dup_func) \
@@ -101,14 +143,29 @@ typedef struct dict_iterator
 #define dict_get_signed_integer_val(de)         ((de)->v.s64)
 #define dict_get_unsigned_integer_val(de)       ((de)->v.u64)
 #define dict_get_double_val(de)                 ((de)->v.d)
+#define dict_get_next(de)                       ((dict_entry *)((uintptr_t)(de)->next & ~DICT_ENTRY_KEY_EMBEDDED))
 #define dict_size(d)                            ((d)->ht[0].size + (d)->ht[1].size)
 #define dict_keys(d)                            ((d)->ht[0].keys + (d)->ht[1].keys)
 #define dict_is_rehashing(d)                    ((d)->rehash_idx != -1)
 
+// Declare the dict API variants specialized for the hash and compare functions of a dict type.
+// See DICT_DEFINE_SPECIALIZED() in dict.c
+#define DICT_DECLARE_SPECIALIZED(prefix) \
+    dict_entry *prefix##_find(dict *d, const void *key); \
+    void *prefix##_fetch_value(dict *d, const void *key); \
+    size_t prefix##_find_batch(dict *d, void * const *keys, size_t n, dict_entry **out); \
+    int prefix##_add_entry(dict *d, void *key, void *val); \
+    int prefix##_delete(dict *d, const void *key); \
+    dict_entry *prefix##_unlink(dict *d, const void *key);
+
 // Function declarations
 dict *dict_create(dict_type *type);
+void dict_release(dict *d);
 int dict_resize_to(dict *d, unsigned long new_size);
+int dict_shrink_if_needed(dict *d);
 int dict_rehash(dict *d, int n);
+int dict_rehash_microseconds(dict *d, long long us);
+int dict_rehash_milliseconds(dict *d, int ms);
 dict_entry *dict_accommodate_key(dict *d, void *key, dict_entry **existing_entry);
 int dict_add_entry(dict *d, void *key, void *val);
 int dict_add_or_replace_entry(dict *d, void *key, void *val);
@@ -117,10 +174,15 @@ dict_entry *dict_unlink(dict *d, const void *key);
 int dict_free_unlinked_entry(dict *d, dict_entry *de);
 void *dict_fetch_value(dict *d, const void *key);
 dict_entry *dict_find(dict *d, const void *key);
+size_t dict_find_batch(dict *d, void * const *keys, size_t n, dict_entry **out);
 dict_iterator *dict_get_iterator(dict *d);
 dict_iterator *dict_get_safe_iterator(dict *d);
 dict_entry *dict_next(dict_iterator *iter);
 int dict_free_iterator(dict_iterator *iter);
+unsigned long dict_scan(dict *d, unsigned long cursor, dict_scan_proc *fn, void *privdata);
+dict_entry *dict_get_random_key(dict *d);
+dict_entry *dict_get_fair_random_key(dict *d);
+unsigned int dict_get_some_keys(dict *d, dict_entry **des, unsigned int count);
 void dict_enable_resize();
 void dict_disable_resize();
 void dict_get_stats(char *buf, size_t buf_size, dict *d);
@@ -128,16 +190,29 @@ void dict_hash_seed_init();
 // Some sample functions for building dict_type
 uint64_t dict_sample_hash(const void *key);
 uint64_t dict_sample_case_hash(const void *key);
+uint64_t dict_sample_wyhash(const void *key);
+uint64_t dict_sample_crc32c_hash(const void *key);
+uint64_t (*dict_sample_hash_func(int hash))(const void *key);
 int dict_sample_compare_sds_key(const void *key1, const void *key2);
 int dict_sample_compare_sds_key_case(const void *key1, const void *key2);
 void dict_sample_free_sds(void *val);
 void dict_sample_free_obj(void *o);
 
+// Variants specialized for sds keys hashed by dict_sample_hash(), dict_sample_wyhash() and
+// dict_sample_crc32c_hash(), and for the command table
+DICT_DECLARE_SPECIALIZED(dict_sds_siphash)
+DICT_DECLARE_SPECIALIZED(dict_sds_wyhash)
+DICT_DECLARE_SPECIALIZED(dict_sds_crc32c)
+DICT_DECLARE_SPECIALIZED(dict_cmd)
+
 
 extern dict_type sample_dict_type;
 extern uint8_t dict_hash_seed[17];
 extern uint64_t siphash(const uint8_t *in, const size_t inlen, const uint8_t *k);
 extern uint64_t siphash_nocase(const uint8_t *in, const size_t inlen, const uint8_t *k);
+extern uint64_t wyhash(const uint8_t *in, const size_t inlen, const uint8_t *k);
+extern uint64_t crc32c_hash(const uint8_t *in, const size_t inlen, const uint8_t *k);
+extern uint32_t crc32c(uint32_t crc, const uint8_t *buf, size_t len);
 
 
 #endif // DICT_H_INCLUDED
@@ -1,6 +1,8 @@
 #ifndef EVENT_H_INCLUDED
 #define EVENT_H_INCLUDED
 
+#include <stddef.h>
+
 // Execution codes
 #define AE_OK   0
 #define AE_ERR  1
@@ -10,25 +12,70 @@
 #define AE_STATE_READABLE   1
 #define AE_STATE_WRITABLE   2
 
-// Event types
+// Event types. Also used as flags for ae_process_events() to select which events to process.
 #define AE_EVENT_FILE       1
 #define AE_EVENT_TIME       2
+#define AE_DONT_WAIT        4   // Flag for ae_process_events(). Poll without blocking.
+#define AE_ALL_EVENTS       (AE_EVENT_FILE | AE_EVENT_TIME)
+
+// Polling backends of the event loop
+#define AE_BACKEND_EPOLL    0
+#define AE_BACKEND_IO_URING 1
+
+// I/O operations the event loop can complete itself, if its backend supports it. See ae_get_io_ops()
+#define AE_IO_NONE      0
+#define AE_IO_ACCEPT    1   // Accept connections of a listening socket, over and over
+#define AE_IO_RECV      2   // Receive from a socket, over and over, into buffers of the loop
+#define AE_IO_SEND      4   // Send a buffer to a socket once
+
+// Returned by ae_time_proc if the time event should not be rescheduled.
+#define AE_NOMORE           -1
+// Id of a time event that is deleted and waiting to be freed.
+#define AE_DELETED_EVENT_ID -1
 
 struct ae_event_loop;//forward declaration for compilation
+struct ae_api;
 
 // Procedure prototypes
 typedef void ae_file_proc(struct ae_event_loop *event_loop, int fd, int state);
+// Return milliseconds after which the time event fires again, or AE_NOMORE to delete it.
+typedef int ae_time_proc(struct ae_event_loop *event_loop, long long id, void *client_data);
+typedef void ae_event_finalizer_proc(struct ae_event_loop *event_loop, void *client_data);
+typedef void ae_before_sleep_proc(struct ae_event_loop *event_loop);
+// Called when I/O operation 'op' on 'fd' completes. 'res' is the fd accepted, the number of bytes
+// received at 'buf' or sent, or -errno. 'buf' is reused once the procedure returns.
+typedef void ae_io_proc(struct ae_event_loop *event_loop, int fd, int op, const char *buf, long res,
+    void *client_data);
 
 // File event that can be registered to event loop and then monitored for the desired state to become ture.
 typedef struct ae_file_event {
     int state_mask;     // States that is being monitored. Can be AE_STATE_READBLE or AE_STATE_WRITABLE
     ae_file_proc *proc; // Callback function that is invoked when desired state in the mask becomes true.
+    int io_mask;        // AE_IO_XXX operations in progress
+    unsigned io_gen;    // Changed whenever accept or recv stops, so that their late completions are dropped
+    ae_io_proc *io_proc;    // Callback function invoked when an operation completes
+    void *io_data;          // Private data passed to 'io_proc'
 } ae_file_event;
 
-// When a file or time event happens, a fired event is generated and later processed.
+// Time event that fires once its 'when_ms' is reached. Time events are kept in an unsorted list.
+typedef struct ae_time_event {
+    long long id;                       // Time event identifier, or AE_DELETED_EVENT_ID
+    long long when_ms;                  // Monotonic time in milliseconds when the event fires
+    ae_time_proc *proc;                 // Callback function invoked when the event fires
+    ae_event_finalizer_proc *finalizer; // Called when the event is deleted, if not NULL
+    void *client_data;                  // Private data passed to 'proc' and 'finalizer'
+    struct ae_time_event *next;
+} ae_time_event;
+
+// When a file or time event happens, or an I/O operation completes, a fired event is generated
+// and later processed.
 typedef struct ae_fired_event {
     int fd;
-    int state;
+    int state;          // States that fired, if not an I/O completion
+    int io_op;          // AE_IO_XXX operation completed, or AE_IO_NONE
+    unsigned io_gen;    // 'io_gen' of the fd when the operation was started
+    long res;           // Result of the operation. See ae_io_proc
+    const char *buf;    // Bytes received
 } ae_fired_event;
 
 // Event loop structure that holds all info about the loop.
@@ -37,14 +84,36 @@ typedef struct ae_event_loop {
     int set_size;           // Size of the file event set
     ae_file_event *events;  // Registered file events
     ae_fired_event *fired;  // Fired events
+    ae_time_event *time_event_head; // List of time events
+    long long time_event_next_id;   // Id for the next time event created
+    int stop;               // Set to 1 by ae_stop() to break out of ae_main()
+    ae_before_sleep_proc *before_sleep; // Called before waiting for events in each iteration
+    const struct ae_api *api;   // Polling backend. See event.c
     void *api_data;         // API data for select, kquene or epoll, etc.
 } ae_event_loop;
 
 
 typedef struct ae_event_loop ae_event_loop;
 
-
-
+// Function declarations
+ae_event_loop *ae_create_event_loop(int set_size, int backend);
+const char *ae_get_api_name(ae_event_loop *el);
+void ae_delete_event_loop(ae_event_loop *el);
+int ae_create_file_event(ae_event_loop *el, int fd, int mask, ae_file_proc *proc);
+void ae_delete_file_event(ae_event_loop *el, int fd, int mask);
+int ae_get_file_events(ae_event_loop *el, int fd);
+long long ae_create_time_event(ae_event_loop *el, long long milliseconds, ae_time_proc *proc,
+    void *client_data, ae_event_finalizer_proc *finalizer);
+int ae_delete_time_event(ae_event_loop *el, long long id);
+int ae_process_events(ae_event_loop *el, int flags);
+void ae_main(ae_event_loop *el);
+void ae_set_before_sleep_proc(ae_event_loop *el, ae_before_sleep_proc *before_sleep);
+void ae_stop(ae_event_loop *el);
+int ae_get_io_ops(ae_event_loop *el);
+int ae_create_io_event(ae_event_loop *el, int fd, int op, ae_io_proc *proc, void *client_data);
+void ae_delete_io_event(ae_event_loop *el, int fd, int op);
+int ae_register_buffer(ae_event_loop *el, int fd, void *buf, size_t len);
+int ae_send(ae_event_loop *el, int fd, const void *buf, size_t len);
 
 
 #endif // EVENT_H_INCLUDED
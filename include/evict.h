@@ -0,0 +1,36 @@
+#ifndef EVICT_H_INCLUDED
+#define EVICT_H_INCLUDED
+
+#include "obj.h"
+#include "sds.h"
+
+// Policies to keep used memory under server.maxmemory
+#define EVICT_NOEVICTION        0   // evict nothing. Commands that add data fail instead
+#define EVICT_ALLKEYS_LRU       1   // evict keys least recently used, approximated by sampling
+#define EVICT_ALLKEYS_RANDOM    2   // evict random keys
+
+// LRU clock, in the 24 bits of arobj.lru. It wraps around every 194 days
+#define EVICT_LRU_CLOCK_MAX         ((1 << 24) - 1)
+#define EVICT_LRU_CLOCK_RESOLUTION  1000    // ms per tick
+
+// Best candidates for eviction sampled so far, kept across commands
+#define EVICT_POOL_SIZE         16
+// Max keys sampled from each database at a time
+#define EVICT_MAX_SAMPLES       64
+// Max keys evicted before a command. The next commands go on if memory is still above the limit
+#define EVICT_MAX_KEYS_PER_CALL 64
+
+typedef struct evict_pool_entry {
+    unsigned long long idle;    // estimated idle time in ms
+    sds key;                    // copy of the key, NULL if the entry is empty
+    int dbid;                   // database of the key
+} evict_pool_entry;
+
+// Function declarations
+void evict_init();
+unsigned int evict_get_lru_clock();
+unsigned long long evict_get_idle_ms(const arobj *o);
+int evict_perform();
+const char *evict_get_policy_name(int policy);
+
+#endif // EVICT_H_INCLUDED
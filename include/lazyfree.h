@@ -0,0 +1,25 @@
+#ifndef LAZYFREE_H_INCLUDED
+#define LAZYFREE_H_INCLUDED
+
+#include "dict.h"
+#include "obj.h"
+
+// Job types
+#define LAZYFREE_JOB_OBJ    0   // release an object
+#define LAZYFREE_JOB_DICT   1   // release a dict with all its entries
+
+// A job queued to the lazyfree thread
+typedef struct lazyfree_job {
+    int type;           // LAZYFREE_JOB_XXX
+    void *ptr;          // object or dict to free
+    struct lazyfree_job *next;
+} lazyfree_job;
+
+// Function declarations
+void lazyfree_init();
+size_t lazyfree_get_effort(const arobj *o);
+void lazyfree_free_obj(arobj *o);
+void lazyfree_free_dict(dict *d);
+unsigned long lazyfree_get_pending();
+
+#endif // LAZYFREE_H_INCLUDED
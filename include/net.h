@@ -8,9 +8,19 @@
 // Function delarations
 void net_init();
 void net_loop();
-void net_client_reply_flush(client *c);
+void net_client_block(client *c);
+void net_client_unblock(client *c);
 void net_client_reply_append_sds(client *c, sds val);
 void net_client_reply_append_cstr(client *c, const char *cstr);
 void net_client_reply_append_fmt(client *c, const char *fmt, ...);
+void net_client_reply_ok(client *c);
+void net_client_reply_status(client *c, const char *status);
+void net_client_reply_error(client *c, const char *fmt, ...);
+void net_client_reply_integer(client *c, long long val);
+void net_client_reply_null(client *c);
+void net_client_reply_bulk_cbuf(client *c, const char *p, size_t len);
+void net_client_reply_bulk_obj(client *c, arobj *o);
+void net_client_reply_array_len(client *c, long len);
+void net_client_reply_array_next(client *c);
 
 #endif // NET_H_INCLUDED
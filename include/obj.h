@@ -25,7 +25,7 @@
 typedef struct {
     unsigned int type: 4;
     unsigned int encoding: 4;
-    unsigned int lru: 24;
+    unsigned int lru: 24;    // LRU clock of the last access, see evict.c
     int ref_count;
     void *ptr;
 } arobj;
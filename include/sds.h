@@ -6,24 +6,25 @@
 #include <stdarg.h>
 #include <assert.h>
 #include "config.h"
+#include "zmalloc.h"
 
-// You can define customized sds allocator in place of defualt libc allocator
-#define s_malloc  malloc
-#define s_realloc realloc
-#define s_free    free
+// You can define customized sds allocator in place of defualt zmalloc allocator
+#define s_malloc  zmalloc
+#define s_realloc zrealloc
+#define s_free    zfree
 
 #define SDS_MAX_PREALLOC (1024*1024)        // affect how much space to prealloc in sds_make_room_for
-const char *SDS_NOINIT;
+extern const char *SDS_NOINIT;
 
 typedef char *sds;
 
-// for strings with lenth 0 ~ 64
-typedef struct __attribute__ ((__packed__)) sds_hdr_6
+// for strings with lenth 0 ~ 31
+typedef struct __attribute__ ((__packed__)) sds_hdr_5
 {
-    unsigned char flag;     // 2 lsb for type, and 5 msb for length
+    unsigned char flag;     // 3 lsb for type, and 5 msb for length
     char buf[];
-} sds_hdr_6;
-// for strings with lenth  65 ~ 256
+} sds_hdr_5;
+// for strings with lenth  32 ~ 255
 typedef struct __attribute__ ((__packed__)) sds_hdr_8
 {
     uint8_t len;            // buf used
@@ -31,7 +32,7 @@ typedef struct __attribute__ ((__packed__)) sds_hdr_8
     unsigned char flag;
     char buf[];
 } sds_hdr_8;
-// for strings with length 257 ~ 65536 (max possible lenth)
+// for strings with length 256 ~ 65535
 typedef struct __attribute__ ((__packed__)) sds_hdr_16
 {
     uint16_t len;           // buf used
@@ -39,14 +40,32 @@ typedef struct __attribute__ ((__packed__)) sds_hdr_16
     unsigned char flag;
     char buf[];
 } sds_hdr_16;
+// for strings with length 64K ~ 4G - 1
+typedef struct __attribute__ ((__packed__)) sds_hdr_32
+{
+    uint32_t len;           // buf used
+    uint32_t alloc;         // buf length, excluding null terminator
+    unsigned char flag;
+    char buf[];
+} sds_hdr_32;
+// for strings with length 4G and more
+typedef struct __attribute__ ((__packed__)) sds_hdr_64
+{
+    uint64_t len;           // buf used
+    uint64_t alloc;         // buf length, excluding null terminator
+    unsigned char flag;
+    char buf[];
+} sds_hdr_64;
 
 
-#define SDS_TYPE_6  0
+#define SDS_TYPE_5  0
 #define SDS_TYPE_8  1
 #define SDS_TYPE_16 2
+#define SDS_TYPE_32 3
+#define SDS_TYPE_64 4
 
-#define SDS_TYPE_MASK    3
-#define SDS_TYPE_BITS    2
+#define SDS_TYPE_MASK    7
+#define SDS_TYPE_BITS    3
 
 #define SDS_HDR(T, s)       ((sds_hdr_##T *)((s) - (sizeof(sds_hdr_##T))))
 #define SDS_HDR_VAR(T, s)   sds_hdr_##T *sh = (sds_hdr_##T *)((s) - (sizeof(sds_hdr_##T)));
@@ -58,12 +77,16 @@ static inline size_t sds_len(const sds s)
     unsigned char flag = s[-1];
     switch(flag & SDS_TYPE_MASK)
     {
-        case SDS_TYPE_6:
+        case SDS_TYPE_5:
             return flag >> SDS_TYPE_BITS;
         case SDS_TYPE_8:
             return SDS_HDR(8, s)->len;
         case SDS_TYPE_16:
             return SDS_HDR(16, s)->len;
+        case SDS_TYPE_32:
+            return SDS_HDR(32, s)->len;
+        case SDS_TYPE_64:
+            return SDS_HDR(64, s)->len;
     }
     return 0;
 }
@@ -74,7 +97,7 @@ static inline size_t sds_avail(const sds s)
     unsigned char flag = s[-1];
     switch(flag & SDS_TYPE_MASK)
     {
-        case SDS_TYPE_6:
+        case SDS_TYPE_5:
             return 0;
         case SDS_TYPE_8: {
             SDS_HDR_VAR(8, s);
@@ -84,6 +107,14 @@ static inline size_t sds_avail(const sds s)
             SDS_HDR_VAR(16, s);
             return sh->alloc - sh->len;
         }
+        case SDS_TYPE_32: {
+            SDS_HDR_VAR(32, s);
+            return sh->alloc - sh->len;
+        }
+        case SDS_TYPE_64: {
+            SDS_HDR_VAR(64, s);
+            return sh->alloc - sh->len;
+        }
     }
     return 0;
 }
@@ -92,9 +123,9 @@ static inline size_t sds_avail(const sds s)
 static inline void sds_incr_len(sds s, size_t incr)
 {
     unsigned char type = s[-1] & SDS_TYPE_MASK;
-    size_t len;
-    // 's' cannot be SDS_TYPE_6 because before sds_incr_len, the 's' must haved changed to SDS_TYPE_8
-    assert(type != SDS_TYPE_6);
+    size_t len = 0;
+    // 's' cannot be SDS_TYPE_5 because before sds_incr_len, the 's' must haved changed to SDS_TYPE_8
+    assert(type != SDS_TYPE_5);
 
     switch(type)
     {
@@ -110,6 +141,18 @@ static inline void sds_incr_len(sds s, size_t incr)
             len = (sh->len += incr);
             break;
         }
+        case SDS_TYPE_32: {
+            SDS_HDR_VAR(32, s);
+            assert((incr > 0 && sh->alloc - sh->len >= incr));
+            len = (sh->len += incr);
+            break;
+        }
+        case SDS_TYPE_64: {
+            SDS_HDR_VAR(64, s);
+            assert((incr > 0 && sh->alloc - sh->len >= incr));
+            len = (sh->len += incr);
+            break;
+        }
     }
     s[len] = '\0';
 }
@@ -117,6 +160,7 @@ static inline void sds_incr_len(sds s, size_t incr)
 
 // function declarations
 sds sds_new_len(const void *init, size_t init_len);
+sds sds_new_in_place(char *p, size_t room, size_t len);
 sds sds_new(const char *init);
 sds sds_new_empty();
 sds sds_dup(const sds s);
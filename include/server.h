@@ -2,12 +2,55 @@
 #define SERVER_H_INCLUDED
 
 #include <sys/types.h>
-#include <sys/select.h>
+#include <pthread.h>
 #include "config.h"
 
 #include "client.h"
 #include "dict.h"
 #include "db.h"
+#include "event.h"
+
+// Number of samples kept for instantaneous metrics, like ops/sec
+#define STATS_METRIC_SAMPLES 16
+
+// A shard of the server. Each shard runs its own event loop in its own thread, with its own
+// listening socket, clients and a private part of every database, so shards share nothing and
+// never lock. A key belongs to exactly one shard. See shard.c
+typedef struct arena_shard{
+    int id;
+    pthread_t thread;   // thread running the shard's event loop. Shard 0 runs in the main thread
+    // users
+    client **clients;   // clients indexed by fd
+    int num_clients;
+    client **clients_pending_write; // clients with replies to write before the next poll
+    int num_pending_write;
+    client **clients_pending_read;  // clients whose reads are handed to io threads
+    int num_pending_read;
+    // net
+    int socket_fd;      // listening socket, bound to the same port by all shards with SO_REUSEPORT
+    ae_event_loop *el;  // event loop that drives accept, read and write on all fds of the shard
+    int io_completion;  // Does the event loop do client I/O itself? See net_io_handler()
+    // messages from other shards
+    struct shard_msg *_Atomic mailbox;  // lock-free stack of messages pushed by other shards
+    int wakeup_fd;      // eventfd that wakes up the event loop when a message is pushed
+    // databases
+    database *db;       // the shard's part of every database
+    // cron
+    long long cronloops;    // number of times server_cron() has run
+    int rehash_db;          // database that active rehashing goes on with. See server_databases_cron()
+    // eviction
+    unsigned int lru_clock;     // cached LRU clock that accessed objects are stamped with. See evict.c
+    struct evict_pool_entry *evict_pool;    // best candidates for eviction sampled so far
+    int evict_db;               // database that allkeys-random eviction goes on with
+    // stats
+    long long stat_numcommands;     // number of commands processed
+    long long stat_numconnections;  // number of connections accepted
+    long long stat_evictedkeys;     // number of keys evicted for maxmemory
+    long long stat_ops_sec_last_sample_time;    // time of last ops/sec sample in ms
+    long long stat_ops_sec_last_sample_ops;     // stat_numcommands at last sample
+    long long stat_ops_sec_samples[STATS_METRIC_SAMPLES];
+    int stat_ops_sec_idx;
+} arena_shard;
 
 // ArenaDb server
 typedef struct arena_server{
@@ -16,30 +59,44 @@ typedef struct arena_server{
     // commands
     dict *commands;     // dict for command look up
     // users
-    client **clients;
-    int num_clients;
+    int max_clients;    // max number of simultaneous clients
     // net
     int port;
     char *ip;
 
     char *stdin_buf;    // Buf that holds input from local 'stdin'.
-    // fds for select().
-    int stdin_fd;
-    int socket_fd;
-    fd_set active_fds;
+    int stdin_fd;       // monitored by shard 0
+    int event_backend;  // AE_BACKEND_XXX polling the event loops
+    // threaded I/O. See net.c
+    int io_threads_num;     // number of threads doing client I/O, including the main thread
+    int io_threads_active;  // are io threads currently running?
+    // shards
+    arena_shard *shards;
+    int num_shards;
 
     // log
     char* log_file;
     int log_verbosity;
 
     // databases
-    database *db;   //server can have 16 databases
     int num_db;
+    int db_dict_engine;     // DICT_ENGINE_XXX storing keys of databases
+    int db_hash;            // DICT_HASH_XXX hashing keys of databases
+    int db_embed_key_len;   // keys of databases up to this long are embedded in their entries
+    // memory
+    unsigned long long maxmemory;   // max bytes used by the server, 0 for no limit. See evict.c
+    int maxmemory_policy;   // EVICT_XXX once the limit is reached
+    int maxmemory_samples;  // keys sampled from each database per eviction
+    // cron
+    int hz;                 // server_cron() calls per second
     // others
 } arena_server;
 
 extern arena_server server; // single global server instance
+extern __thread arena_shard *this_shard;  // shard of the calling thread, NULL for io threads
 
 // Function declarations
 void server_init();
+int server_cron(ae_event_loop *el, long long id, void *client_data);
+long long server_get_instantaneous_ops();
 #endif // SERVER_H_INCLUDED
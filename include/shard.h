@@ -0,0 +1,26 @@
+#ifndef SHARD_H_INCLUDED
+#define SHARD_H_INCLUDED
+
+#include "client.h"
+#include "sds.h"
+
+// Message types
+#define SHARD_MSG_EXEC  0   // Execute the command of a client of another shard
+#define SHARD_MSG_DONE  1   // The command forwarded by SHARD_MSG_EXEC is executed
+#define SHARD_MSG_STOP  2   // Stop the shard's event loop
+
+// A message sent from one shard to another through the receiver's mailbox.
+typedef struct shard_msg {
+    int type;           // SHARD_MSG_XXX
+    client *c;          // client whose command is forwarded, if any
+    struct shard_msg *next;
+} shard_msg;
+
+// Function declarations
+void shard_init();
+void shard_run();
+void shard_stop_all();
+int shard_of_key(sds key);
+void shard_forward_command(client *c, int target);
+
+#endif // SHARD_H_INCLUDED
@@ -0,0 +1,28 @@
+#ifndef SLAB_H_INCLUDED
+#define SLAB_H_INCLUDED
+
+#include <stddef.h>
+
+// Chunks are carved from blocks of this size, aligned to it
+#define SLAB_BLOCK_SIZE     (64 * 1024)
+// Sizes up to SLAB_MAX_SIZE are served by size classes SLAB_SIZE_STEP bytes apart. Larger ones by zmalloc()
+#define SLAB_SIZE_STEP      8
+#define SLAB_MAX_SIZE       64
+#define SLAB_NUM_CLASSES    (SLAB_MAX_SIZE / SLAB_SIZE_STEP)
+
+// Occupancy of a size class of the calling thread
+typedef struct slab_class_stats {
+    size_t chunk_size;
+    unsigned long num_blocks;   // blocks carved into chunks of this class
+    unsigned long num_chunks;   // chunks in the blocks
+    unsigned long num_used;     // chunks allocated and not freed
+} slab_class_stats;
+
+// Function declarations
+void *slab_alloc(size_t size);
+void slab_free(void *p, size_t size);
+unsigned long slab_reclaim();
+void slab_get_class_stats(int class_idx, slab_class_stats *stats);
+size_t slab_get_stats(char *buf, size_t buf_size);
+
+#endif // SLAB_H_INCLUDED
@@ -12,9 +12,14 @@ void util_get_random_hex_chars(char *p, size_t len);
 
 // time
 long long util_get_time_in_millisecond();
+long long util_get_time_in_microsecond();
 
 // conversion
 #define LEN_LL_TO_STR 21
 int util_convert_ll_to_str(char *buf, long long val);
+int util_convert_str_to_ll(const char *buf, size_t len, long long *val);
+
+// string
+int util_string_match(const char *pattern, size_t plen, const char *str, size_t slen, int nocase);
 
 #endif // UTIL_H_INCLUDED
@@ -0,0 +1,17 @@
+#ifndef ZMALLOC_H_INCLUDED
+#define ZMALLOC_H_INCLUDED
+
+#include <stddef.h>
+
+// Function declarations
+void *zmalloc(size_t size);
+void *zcalloc(size_t num, size_t size);
+void *zrealloc(void *p, size_t size);
+void *zaligned_alloc(size_t alignment, size_t size);
+void zfree(void *p);
+size_t zmalloc_used_memory();
+size_t zmalloc_get_rss();
+double zmalloc_get_fragmentation_ratio(size_t rss);
+const char *zmalloc_lib();
+
+#endif // ZMALLOC_H_INCLUDED
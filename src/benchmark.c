@@ -10,11 +10,14 @@
 
 #ifdef CONFIG_BUILD_BENCHMARK
 #include <stdio.h>
+#include <string.h>
 #include <assert.h>
 #include "dict.h"
 #include "sds.h"
 #include "util.h"
 #include "debug.h"
+#include "slab.h"
+#include "zmalloc.h"
 
 /*----------------------------------DICT BENCHMARK-------------------------------------------*/
 int dict_benchmark_main(long count)
@@ -31,91 +34,294 @@ int dict_benchmark_main(long count)
         printf(msg": %ld items in %lld ms \n", bm_count, bm_elapsed); \
     } while(0)
 
+    #define BM_STR_(x) #x
+    #define BM_STR(x) BM_STR_(x)
+
     bm_count = count;
-    printf("Dict benchmark with %ld entries \n", bm_count);
+    config_init();  // for logging
     dict_hash_seed_init();
 
+    // Same benchmark for each engine, and for chained entries storing hashes
+    struct {
+        int engine;
+        int store_hash;
+        const char *name;
+    } configs[] = {
+        {DICT_ENGINE_CHAINED, 0, "chained"},
+        {DICT_ENGINE_CHAINED, 1, "chained, stored hash"},
+        {DICT_ENGINE_SWISS, 0, "swiss"},
+    };
+    for (int c = 0; c < sizeof(configs) / sizeof(configs[0]); c ++) {
+        dict_type type = sample_dict_type;
+        type.engine = configs[c].engine;
+        type.store_hash = configs[c].store_hash;
+        printf("Dict benchmark with %ld entries (%s) \n", bm_count, configs[c].name);
 
-    dict *d = dict_create(&sample_dict_type);
-
+        size_t mem_before = zmalloc_used_memory();
+        dict *d = dict_create(&type);
 
-    start_benchmark();
-    for(long i = 0; i < bm_count; i ++) {
-        int ret_val = dict_add_entry(d, sds_from_longlong(i), (void*) i);
-        assert(ret_val == DICT_OK);
-    }
-    end_benchmark("Inserting");
+        start_benchmark();
+        for(long i = 0; i < bm_count; i ++) {
+            int ret_val = dict_add_entry(d, sds_from_longlong(i), (void*) i);
+            assert(ret_val == DICT_OK);
+        }
+        end_benchmark("Inserting");
+        // Heap used by the dict, its entries and keys
+        printf("Memory per key: %.02f bytes \n", (double)(zmalloc_used_memory() - mem_before) / bm_count);
 
-    start_benchmark();
-    while(dict_is_rehashing(d)) {
-        dict_rehash(d, 100);
-    }
-    end_benchmark("Waiting while rehashing in progress");
+        start_benchmark();
+        while(dict_is_rehashing(d)) {
+            dict_rehash(d, 100);
+        }
+        end_benchmark("Waiting while rehashing in progress");
 
-    start_benchmark();
-    for(long i = 0; i < bm_count; i ++) {
-        sds key = sds_from_longlong(i);
-        dict_entry *de = dict_find(d, key);
-        sds_free(key);
+        start_benchmark();
+        for(long i = 0; i < bm_count; i ++) {
+            sds key = sds_from_longlong(i);
+            dict_entry *de = dict_find(d, key);
+            sds_free(key);
 
-        assert(de != NULL);
-        //assert(dict_get_signed_integer_val(de) == i); // This should PASS!
-    }
-    end_benchmark("Linear access of existing entries");
+            assert(de != NULL);
+            //assert(dict_get_signed_integer_val(de) == i); // This should PASS!
+        }
+        end_benchmark("Linear access of existing entries");
 
-    start_benchmark();
-    for(long i = 0; i < bm_count; i ++) {
-        sds key = sds_from_longlong(i);
-        dict_entry *de = dict_find(d, key);
-        sds_free(key);
+        start_benchmark();
+        for(long i = 0; i < bm_count; i ++) {
+            sds key = sds_from_longlong(i);
+            dict_entry *de = dict_find(d, key);
+            sds_free(key);
 
-        assert(de != NULL);
-    }
-    end_benchmark("Linear access of existing entries");
+            assert(de != NULL);
+        }
+        end_benchmark("Linear access of existing entries");
 
-    start_benchmark();
-    for(long i = 0; i < bm_count; i ++) {
-        sds key = sds_from_longlong(rand() % bm_count);
-        dict_entry *de = dict_find(d, key);
-        sds_free(key);
+        start_benchmark();
+        for(long i = 0; i < bm_count; i ++) {
+            sds key = sds_from_longlong(rand() % bm_count);
+            dict_entry *de = dict_find(d, key);
+            sds_free(key);
 
-        assert(de != NULL);
-    }
-    end_benchmark("Random access of existing entries");
-
-    start_benchmark();
-    for(long i = 0; i < bm_count; i ++) {
-        sds key = sds_from_longlong(rand() % bm_count);
-        key[0] = 'X';
-        dict_entry *de = dict_find(d, key);
-
-        if (de != NULL)
-        {
-            printf("BUG KEY: %s \n", key);
-            printf("entry val: %ld \n", dict_get_signed_integer_val(de));
             assert(de != NULL);
         }
+        end_benchmark("Random access of existing entries");
+
+        // Same random keys looked up one by one, then in batches as MGET does. Keys are made
+        // beforehand so that only lookups are timed
+        #define BM_BATCH    16
+        sds *keys = zmalloc(sizeof(sds) * bm_count);
+        dict_entry **found = zmalloc(sizeof(dict_entry *) * bm_count);
+        for (long i = 0; i < bm_count; i ++) keys[i] = sds_from_longlong(rand() % bm_count);
+
+        start_benchmark();
+        for (long i = 0; i < bm_count; i ++) found[i] = dict_find(d, keys[i]);
+        end_benchmark("Random access, scalar dict_find()");
+        for (long i = 0; i < bm_count; i ++) assert(found[i] != NULL);
+
+        start_benchmark();
+        for (long i = 0; i < bm_count; i += BM_BATCH) {
+            size_t n = (bm_count - i < BM_BATCH) ? bm_count - i : BM_BATCH;
+            dict_find_batch(d, (void **)keys + i, n, found + i);
+        }
+        end_benchmark("Random access, dict_find_batch() of "BM_STR(BM_BATCH));
+        for (long i = 0; i < bm_count; i ++) assert(found[i] != NULL && sds_cmp(found[i]->key, keys[i]) == 0);
+
+        // Same again with the variants specialized for sample_dict_type's hash and compare
+        start_benchmark();
+        for (long i = 0; i < bm_count; i ++) found[i] = dict_sds_siphash_find(d, keys[i]);
+        end_benchmark("Random access, specialized dict_find()");
+        for (long i = 0; i < bm_count; i ++) assert(found[i] != NULL);
+
+        start_benchmark();
+        for (long i = 0; i < bm_count; i += BM_BATCH) {
+            size_t n = (bm_count - i < BM_BATCH) ? bm_count - i : BM_BATCH;
+            dict_sds_siphash_find_batch(d, (void **)keys + i, n, found + i);
+        }
+        end_benchmark("Random access, specialized dict_find_batch() of "BM_STR(BM_BATCH));
+        for (long i = 0; i < bm_count; i ++) assert(found[i] != NULL && sds_cmp(found[i]->key, keys[i]) == 0);
+
+        for (long i = 0; i < bm_count; i ++) sds_free(keys[i]);
+        zfree(keys);
+        zfree(found);
+
+        // Cost per sampled key, as eviction samples them
+        #define BM_SAMPLES  1000000
+        #define BM_SOME_KEYS 16
+        long long sample_start = util_get_time_in_microsecond();
+        for (long i = 0; i < BM_SAMPLES; i ++) assert(dict_get_random_key(d) != NULL);
+        printf("dict_get_random_key(): %.02f ns per sample \n",
+            (util_get_time_in_microsecond() - sample_start) * 1000.0 / BM_SAMPLES);
+        sample_start = util_get_time_in_microsecond();
+        for (long i = 0; i < BM_SAMPLES; i ++) assert(dict_get_fair_random_key(d) != NULL);
+        printf("dict_get_fair_random_key(): %.02f ns per sample \n",
+            (util_get_time_in_microsecond() - sample_start) * 1000.0 / BM_SAMPLES);
+        dict_entry *samples[BM_SOME_KEYS];
+        long num_samples = 0;
+        sample_start = util_get_time_in_microsecond();
+        for (long i = 0; i < BM_SAMPLES / BM_SOME_KEYS; i ++) num_samples += dict_get_some_keys(d, samples, BM_SOME_KEYS);
+        printf("dict_get_some_keys() of "BM_STR(BM_SOME_KEYS)": %.02f ns per sample \n",
+            (util_get_time_in_microsecond() - sample_start) * 1000.0 / num_samples);
+
+        start_benchmark();
+        for(long i = 0; i < bm_count; i ++) {
+            sds key = sds_from_longlong(rand() % bm_count);
+            key[0] = 'X';
+            dict_entry *de = dict_find(d, key);
+
+            if (de != NULL)
+            {
+                printf("BUG KEY: %s \n", key);
+                printf("entry val: %ld \n", dict_get_signed_integer_val(de));
+                assert(de != NULL);
+            }
+
+            sds_free(key);
+
+        }
+        end_benchmark("Access missing");
+
+        start_benchmark();
+        for(long i = 0; i < bm_count; i ++) {
+            sds key = sds_from_longlong(i);
+            int ret = dict_delete(d, key);
+            assert(ret == DICT_OK);
+            // Change first number to letter
+            key[0] += 17;
+            ret = dict_add_entry(d, key, (void*)i);
+            assert(ret == DICT_OK);
+        }
+        end_benchmark("Removing and adding");
+
+        #define BUF_SIZE  4096
+        char *buf = zmalloc(BUF_SIZE);
+        server_debug_dict_get_stats(buf, BUF_SIZE, d);
+        printf("%s", buf);
+        slab_get_stats(buf, BUF_SIZE);
+        printf("%s", buf);
+        zfree(buf);
+
+        // Mass deletion. The table shrinks, so memory follows the keys left
+        size_t mem_full = zmalloc_used_memory();
+        unsigned long slots_full = dict_size(d);
+        start_benchmark();
+        for (long i = 0; i < bm_count - bm_count / 100; i ++) {
+            sds key = sds_from_longlong(i);
+            key[0] += 17;
+            int ret = dict_delete(d, key);
+            assert(ret == DICT_OK);
+            sds_free(key);
+        }
+        while (dict_rehash(d, 100) || dict_shrink_if_needed(d) == DICT_OK);
+        end_benchmark("Deleting 99%% and shrinking");
+        printf("Slots: %lu -> %lu, heap: %.02f -> %.02f MB \n", slots_full, dict_size(d),
+            (mem_full - mem_before) / 1048576.0, (zmalloc_used_memory() - mem_before) / 1048576.0);
+        dict_release(d);
+    }
 
-        sds_free(key);
+    // 16 byte keys kept apart from entries, then embedded in them as the databases do
+    for (int embed_key_len = 0; embed_key_len <= CONFIG_PARAM_DB_EMBED_KEY_LEN; embed_key_len += CONFIG_PARAM_DB_EMBED_KEY_LEN) {
+        dict_type type = sample_dict_type;
+        type.store_hash = 1;
+        type.embed_key_len = embed_key_len;
+        printf("Dict benchmark with %ld entries of 16 byte keys (chained, stored hash, embed_key_len %d) \n",
+            bm_count, embed_key_len);
 
+        size_t mem_before = zmalloc_used_memory();
+        dict *d = dict_create(&type);
+        start_benchmark();
+        for (long i = 0; i < bm_count; i ++) {
+            int ret_val = dict_add_entry(d, sds_cat_printf(sds_new_empty(), "key:%012ld", i), (void*) i);
+            assert(ret_val == DICT_OK);
+        }
+        while (dict_rehash(d, 100));
+        end_benchmark("Inserting");
+        printf("Memory per key: %.02f bytes \n", (double)(zmalloc_used_memory() - mem_before) / bm_count);
+
+        sds *keys = zmalloc(sizeof(sds) * bm_count);
+        for (long i = 0; i < bm_count; i ++) keys[i] = sds_cat_printf(sds_new_empty(), "key:%012ld", rand() % bm_count);
+        start_benchmark();
+        for (long i = 0; i < bm_count; i ++) assert(dict_sds_siphash_find(d, keys[i]) != NULL);
+        end_benchmark("Random access, specialized dict_find()");
+        for (long i = 0; i < bm_count; i ++) sds_free(keys[i]);
+        zfree(keys);
+        dict_release(d);
     }
-    end_benchmark("Access missing");
-
-    start_benchmark();
-    for(long i = 0; i < bm_count; i ++) {
-        sds key = sds_from_longlong(i);
-        int ret = dict_delete(d, key);
-        assert(ret == DICT_OK);
-        // Change first number to letter
-        key[0] += 17;
-        ret = dict_add_entry(d, key, (void*)i);
-        assert(ret == DICT_OK);
+    return 0;
+}
+
+/*----------------------------------HASH BENCHMARK-------------------------------------------*/
+int hash_benchmark_main()
+{
+    // Hash about the same number of bytes for each key length
+    #define HASH_BM_BYTES (64 * 1024 * 1024)
+    size_t lens[] = {4, 8, 16, 32, 64, 128, 256, 1024, 4096};
+    struct {
+        const char *name;
+        uint64_t (*func)(const uint8_t *in, const size_t inlen, const uint8_t *k);
+    } funcs[] = {
+        {"siphash", siphash},
+        {"wyhash", wyhash},
+        {"crc32c", crc32c_hash},
+    };
+    uint8_t *buf = zmalloc(4096 + 64);
+    uint64_t sink = 0;  // so that hashing is not optimized away
+
+    config_init();  // for logging
+    dict_hash_seed_init();
+    util_get_random_bytes(buf, 4096 + 64);
+
+    printf("Hash benchmark, %d MB per key length. ns/hash (MB/s) \n", HASH_BM_BYTES / 1024 / 1024);
+    printf("%8s", "key len");
+    for (int f = 0; f < sizeof(funcs) / sizeof(funcs[0]); f ++) printf(" %20s", funcs[f].name);
+    printf("\n");
+    for (int l = 0; l < sizeof(lens) / sizeof(lens[0]); l ++) {
+        long count = HASH_BM_BYTES / lens[l];
+        printf("%8zu", lens[l]);
+        for (int f = 0; f < sizeof(funcs) / sizeof(funcs[0]); f ++) {
+            long long start = util_get_time_in_microsecond();
+            for (long i = 0; i < count; i ++) {
+                // Vary the key a bit, like the keys of a dict
+                sink += funcs[f].func(buf + (i & 63), lens[l], dict_hash_seed);
+            }
+            long long us = util_get_time_in_microsecond() - start;
+            printf(" %10.2f (%7.0f)", us * 1000.0 / count, (us > 0) ? (double)HASH_BM_BYTES / us : 0);
+        }
+        printf("\n");
     }
-    end_benchmark("Removing and adding");
+    zfree(buf);
+    return sink == 0;
+}
+
+/*----------------------------------SDS BENCHMARK--------------------------------------------*/
+int sds_benchmark_main()
+{
+    // Grow a string by appends of 1 KB up to 100 MB. sds_make_room_for() doubles the alloc below
+    // SDS_MAX_PREALLOC and adds SDS_MAX_PREALLOC above it. Reported at each tenfold size
+    #define SDS_BM_APPEND   1024
+    #define SDS_BM_MAX_LEN  (100 * 1024 * 1024)
+    char *chunk = zmalloc(SDS_BM_APPEND);
+    memset(chunk, 'x', SDS_BM_APPEND);
+    config_init();  // for logging
 
-    #define BUF_SIZE  4096
-    char *buf = malloc(BUF_SIZE);
-    server_debug_dict_get_stats(buf, BUF_SIZE, d);
+    printf("Sds benchmark, appends of %d bytes, SDS_MAX_PREALLOC %d bytes \n", SDS_BM_APPEND, SDS_MAX_PREALLOC);
+    printf("%12s %12s %12s %12s %10s\n", "length", "appends", "reallocs", "unused", "ms");
+    sds s = sds_new_empty();
+    long appends = 0, reallocs = 0;
+    size_t report_len = 10 * SDS_BM_APPEND;
+    long long start = util_get_time_in_microsecond();
+    while (sds_len(s) < SDS_BM_MAX_LEN) {
+        if (sds_avail(s) < SDS_BM_APPEND) reallocs ++;
+        s = sds_cat_len(s, chunk, SDS_BM_APPEND);
+        assert(s != NULL);
+        appends ++;
+        if (sds_len(s) >= report_len) {
+            printf("%12zu %12ld %12ld %11.1f%% %10.2f\n", sds_len(s), appends, reallocs,
+                sds_avail(s) * 100.0 / (sds_len(s) + sds_avail(s)), (util_get_time_in_microsecond() - start) / 1000.0);
+            report_len *= 10;
+        }
+    }
+    sds_free(s);
+    zfree(chunk);
     return 0;
 }
 #endif // CONFIG_BUILD_BENCHMARK
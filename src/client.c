@@ -2,49 +2,130 @@
     ArenaDB Client Implementation. 5.5
 */
 
+#include <unistd.h>
+#include <sys/socket.h>
 #include "server.h"
 #include "client.h"
+#include "event.h"
 #include "sds.h"
+#include "command.h"
 #include "debug.h"
+#include "zmalloc.h"
 
-// TODO currently we use select, so we're able to support maximum FD_SETSIZE clients
-// Note that since we use fd to index 'clients' array, we don't use first 3 clients
-// because the corresponding fds are 0, 1, 2, 3, which are reserved for stdin, stdout,
-// stderr, and server listensing socket_fd.
+// Remove client 'c' from the client 'list' of '*num' clients, by moving the last client into its slot.
+void client_list_remove(client **list, int *num, client *c)
+{
+    for (int i = 0; i < *num; i ++) {
+        if (list[i] == c) {
+            list[i] = list[-- *num];
+            return;
+        }
+    }
+}
+
+// Clients are indexed by fd, so the 'clients' array has as many slots as the event loop
+// can monitor, i.e. server.max_clients plus CONFIG_FDSET_INCR reserved fds. Note that the
+// first few slots are never used since the corresponding fds are reserved for stdin, stdout,
+// stderr, the server listening socket_fd and the event loop itself.
 void client_init()
 {
-    server.clients = malloc(sizeof(client*) * FD_SETSIZE);
-    for(int i = 0; i < FD_SETSIZE; i ++) {
-        server.clients[i] = NULL;
+    int set_size = server.max_clients + CONFIG_FDSET_INCR;
+    this_shard->clients = zmalloc(sizeof(client*) * set_size);
+    for(int i = 0; i < set_size; i ++) {
+        this_shard->clients[i] = NULL;
     }
-    server.num_clients = 0;
+    this_shard->num_clients = 0;
+    // A client is in a pending list at most once, so it needs no more slots than 'clients'
+    this_shard->clients_pending_write = zmalloc(sizeof(client*) * set_size);
+    this_shard->num_pending_write = 0;
+    this_shard->clients_pending_read = zmalloc(sizeof(client*) * set_size);
+    this_shard->num_pending_read = 0;
 }
 
-// Lookup a client connection by 'fd'. Used after select() returns. See net.c
+// Lookup a client connection by 'fd'. Used when an event of the fd fires. See net.c
 client *client_lookup(int fd)
 {
-    server_assert(fd >= 4 && fd < FD_SETSIZE);
-    return server.clients[fd];
+    server_assert(fd >= 4 && fd < this_shard->el->set_size);
+    return this_shard->clients[fd];
 }
 
-// Resiger the client to the system.
-void client_register(int fd)
+// Resiger the client to the system. Return NULL if the fd is beyond what the event loop can monitor.
+client *client_register(int fd)
 {
-    client *c = malloc(sizeof(client));
-    c->fd = fd;
-    c->db = &server.db[0];
-    server.clients[fd] = c;
-    server.num_clients ++;
+    if (fd >= this_shard->el->set_size) return NULL;
 
+    client *c = zmalloc(sizeof(client));
+    c->fd = fd;
+    c->flags = 0;
+    c->shard = this_shard;
+    c->cmd = NULL;
+    c->argc = 0;
+    c->key_shards = NULL;
+    c->key_vals = NULL;
+    c->query_buf = sds_new_empty();
+    c->qb_pos = 0;
+    c->qb_scan_pos = 0;
+    c->req_type = CLIENT_REQ_UNKNOWN;
+    c->multibulk_len = 0;
+    c->bulk_len = -1;
+    c->reply_size = 0;
+    c->reply_head = NULL;
+    c->reply_tail = NULL;
+    c->reply_list_bytes = 0;
+    c->sent_len = 0;
+    c->recv_buf = sds_new_empty();
+    c->send_res = 0;
+    c->db = &this_shard->db[0];
+    this_shard->clients[fd] = c;
+    this_shard->num_clients ++;
+    return c;
 }
 
-// Unregister the client from the system.
+// Unregister the client from the system. Its fd is removed from the event loop and closed.
 void client_unregister(int fd)
 {
-    client *c = server.clients[fd];
+    client *c = this_shard->clients[fd];
     server_assert(c != NULL);
-    for (int i = 0; i < c->argc; i ++) {
-        sds_free(c->argv[i]);
+    // The replies being sent by the event loop must stay until the send completes. Shut the
+    // connection down so that it completes soon, and unregister the client then. See net.c
+    if (c->flags & CLIENT_SEND_IN_FLIGHT) {
+        if (c->flags & CLIENT_CLOSE_ASAP) return;
+        shutdown(fd, SHUT_RDWR);
+        ae_delete_io_event(this_shard->el, fd, AE_IO_RECV);
+        if (c->flags & CLIENT_PENDING_WRITE) {
+            client_list_remove(this_shard->clients_pending_write, &this_shard->num_pending_write, c);
+            c->flags &= ~CLIENT_PENDING_WRITE;
+        }
+        c->flags |= CLIENT_CLOSE_ASAP;
+        return;
+    }
+    command_free_client_args(c);
+    sds_free(c->query_buf);
+    sds_free(c->recv_buf);
+    client_reply_block *block = c->reply_head, *next;
+    while (block) {
+        next = block->next;
+        zfree(block);
+        block = next;
     }
-    server.clients --;
+    if (c->flags & CLIENT_PENDING_WRITE) {
+        client_list_remove(this_shard->clients_pending_write, &this_shard->num_pending_write, c);
+    }
+    if (c->flags & CLIENT_PENDING_READ) {
+        client_list_remove(this_shard->clients_pending_read, &this_shard->num_pending_read, c);
+    }
+    ae_delete_file_event(this_shard->el, fd, AE_STATE_READABLE | AE_STATE_WRITABLE);
+    ae_delete_io_event(this_shard->el, fd, AE_IO_RECV);
+    ae_register_buffer(this_shard->el, fd, NULL, 0);
+    close(fd);
+
+    this_shard->clients[fd] = NULL;
+    this_shard->num_clients --;
+    zfree(c);
+}
+
+// Return 1 if client 'c' has replies not yet written to its socket, otherwise 0.
+int client_has_pending_replies(client *c)
+{
+    return c->reply_size > 0 || c->reply_head != NULL;
 }
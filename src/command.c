@@ -9,40 +9,63 @@
 */
 
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
+#include <strings.h>
 #include <ctype.h>
 #include <time.h>
-#include <sys/select.h>
+#include <limits.h>
 #include "server.h"
 #include "obj.h"
 #include "net.h"
 #include "debug.h"
 #include "util.h"
 #include "log.h"
+#include "shard.h"
+#include "zmalloc.h"
+#include "evict.h"
 
 static command *command_lookup(sds cmd_name);
+static void _command_execute(client *c);
+static void _command_reset_client(client *c);
+static int _command_check_memory(client *c);
 //static command *command_lookup_cstring(const char* cmd_cname);
 
 static void cmd_get(client *c);
+static void cmd_mget(client *c);
 static void cmd_set(client *c);
 static void cmd_del(client *c);
+static void cmd_unlink(client *c);
 static void cmd_exist(client *c);
+static void cmd_scan(client *c);
+static void cmd_flushdb(client *c);
+static void cmd_flushall(client *c);
 //static void cmd_hset(client *c);
+static void cmd_ping(client *c);
+static void cmd_info(client *c);
 static void cmd_time(client *c);
 static void cmd_exit(client *c);
 
 static command cmd_table[] = {
     // string commands
-    {0, "get", cmd_get, 2},
-    {0, "set", cmd_set, 3},
-    {0, "del", cmd_del, 2},
-    {0, "exist", cmd_exist, 2},
+    {0, "get", cmd_get, 2, 1, 0},
+    {0, "mget", cmd_mget, -2, 0, 0},   // executed by the shards of its keys in turn
+    {0, "set", cmd_set, 3, 1, CMD_WRITE | CMD_DENYOOM},
+    {0, "del", cmd_del, 2, 1, CMD_WRITE},
+    {0, "unlink", cmd_unlink, 2, 1, CMD_WRITE},
+    {0, "exist", cmd_exist, 2, 1, 0},
+    // keyspace commands
+    {0, "scan", cmd_scan, -2, 0, 0},   // routed to shards by its cursor
+    {0, "flushdb", cmd_flushdb, -1, 0, CMD_WRITE},     // executed by all shards in turn
+    {0, "flushall", cmd_flushall, -1, 0, CMD_WRITE},   // executed by all shards in turn
     // hash commands
     //{0, "hset", cmd_hset, 4}, ZIPLIST needed
 
     // miscellaneous commands
-    {0, "exit", cmd_exit, 1},
-    {0, "time", cmd_time, 1}   // TODO remove 'time' command. It's only for testing
+    {0, "ping", cmd_ping, 1, 0, 0},
+    {0, "info", cmd_info, -1, 0, 0},
+    {0, "exit", cmd_exit, 1, 0, 0},
+    {0, "time", cmd_time, 1, 0, 0}   // TODO remove 'time' command. It's only for testing
 };
 // Dict type for command dict
 dict_type cmd_dict_type = {
@@ -69,12 +92,15 @@ void command_dict_init()
         int ret = dict_add_entry(cmd_dict, sds_new(cmd->name), cmd);
         server_assert(ret == DICT_OK);
     }
+    // Lookups rehash too. Finish now, since shards look up commands concurrently and the dict
+    // is never modified again
+    while (dict_rehash_milliseconds(cmd_dict, 1));
 }
 
 // Lookup command with sds key 'cmd_name' in cmd_dict. Return the command if found.
 static command *command_lookup(sds cmd_name)
 {
-    return dict_fetch_value(cmd_dict, cmd_name);
+    return dict_cmd_fetch_value(cmd_dict, cmd_name);
 }
 // Lookup command with C string 'name' in cmd_dict. Return the command if found.
 /*
@@ -86,56 +112,239 @@ static command *command_lookup_cstring(const char* cmd_cname)
     return cmd;
 }*/
 
-// Parse client command buf in client's recv buf
-void command_parse_client_args(client *c)
+// Return 1 if argument 'arg' of client 'c' is an sds view into its query buf, 0 if it's owned.
+#define _command_arg_is_view(c, arg) \
+    ((arg) >= (c)->query_buf && (arg) < (c)->query_buf + sds_len((c)->query_buf))
+
+// Return argument 'i' of client 'c' as an sds string owned by the caller, for commands that
+// keep the bytes, e.g. 'set'. A view is copied, an owned argument is taken from argv.
+static sds _command_take_arg(client *c, int i)
+{
+    sds arg = c->argv[i];
+    if (_command_arg_is_view(c, arg)) return sds_dup(arg);
+    c->argv[i] = NULL;  // must set NULL! So that it's not freed with the other arguments
+    return arg;
+}
+
+// Reply a protocol error to client 'c' and flag it to be closed after the reply.
+static void _command_protocol_error(client *c, const char *msg)
+{
+    server_log(LL_VERBOSE, "Protocol error: %s from client fd: %d", msg, c->fd);
+    net_client_reply_error(c, "protocol error, %s", msg);
+    c->flags |= CLIENT_CLOSE_AFTER_REPLY;
+}
+
+// Parse one inline command at 'qb_pos'. Inline commands are lines of arguments separated
+// by spaces, ended by '\n' (or "\r\n").
+//
+// The parser remembers in 'qb_scan_pos' how far it has searched for the line end, so bytes
+// of a partial command are only scanned once no matter how many reads it takes to arrive.
+static int _command_parse_inline(client *c)
 {
-    size_t cur = 0, end = c->recv_size;
+    size_t end = sds_len(c->query_buf);
+    char *buf = c->query_buf;
+
+    // Search for the line end from where we stopped last time
+    char *newline = memchr(buf + c->qb_scan_pos, '\n', end - c->qb_scan_pos);
+    if (newline == NULL) {
+        c->qb_scan_pos = end;
+        if (end - c->qb_pos > CLIENT_MAX_INLINE_SIZE) {
+            _command_protocol_error(c, "too big inline request");
+        }
+        return C_ERR;
+    }
+
+    size_t cur = c->qb_pos, line_end = newline - buf;
     size_t arg_s = 0, arg_e = 0;
+    if (line_end > cur && buf[line_end - 1] == '\r') line_end --;
 
     int idx = 0;
 
     while (1) {
-        while (cur < end && isspace(c->recv_buf[cur])) cur ++; // skip space before
-        if (cur >= end) {
+        while (cur < line_end && isspace(buf[cur])) cur ++; // skip space before
+        if (cur >= line_end) {
             break;
         } else {
             arg_s = cur;
         }
 
-        while (cur < end && !isspace(c->recv_buf[cur])) cur ++; // skip arg content
+        while (cur < line_end && !isspace(buf[cur])) cur ++; // skip arg content
 
         arg_e = cur;
-        server_assert(idx < CLIENT_MAX_ARG);
-        sds arg = sds_new_len(c->recv_buf + arg_s, arg_e - arg_s);
+        if (idx == CLIENT_MAX_ARG) {
+            c->argc = idx;
+            command_free_client_args(c);
+            _command_protocol_error(c, "too many arguments");
+            return C_ERR;
+        }
+        sds arg = sds_new_len(buf + arg_s, arg_e - arg_s);
         c->argv[idx] = arg;
         idx ++;
     }
 
     c->argc = idx;
+    // Move past the parsed line
+    c->qb_pos = newline - buf + 1;
+    c->qb_scan_pos = c->qb_pos;
+    return C_OK;
+}
+
+// Parse the number in a RESP header line like "*3\r\n" or "$5\r\n" at 'qb_pos', where 'prefix'
+// is the first char of the line. Store it in 'val' and move 'qb_pos' past the line.
+// Return C_OK if parsed, or C_ERR if the line is not complete yet or on a protocol error.
+static int _command_parse_resp_header(client *c, char prefix, long long *val)
+{
+    size_t end = sds_len(c->query_buf);
+    char *buf = c->query_buf, *p = buf + c->qb_pos;
+
+    // Header lines are short, so looking for '\r' doesn't scan much
+    char *newline = memchr(p, '\r', end - c->qb_pos);
+    if (newline == NULL || newline + 1 >= buf + end) {
+        if (end - c->qb_pos > CLIENT_MAX_INLINE_SIZE) {
+            _command_protocol_error(c, "too big header line");
+        }
+        return C_ERR;
+    }
+
+    if (*p != prefix) {
+        _command_protocol_error(c, (prefix == '$') ? "expected '$'" : "expected '*'");
+        return C_ERR;
+    }
+    if (!util_convert_str_to_ll(p + 1, newline - (p + 1), val)) {
+        _command_protocol_error(c, (prefix == '$') ? "invalid bulk length" : "invalid multibulk length");
+        return C_ERR;
+    }
+    c->qb_pos = newline - buf + 2; // skip "\r\n"
+    return C_OK;
+}
 
-    printf("command_parse_client_args() argc: %d \n", idx);
-    for(int i = 0; i < idx; i ++) {
-        printf("arg %d: %s \n", i, c->argv[i]);
+// Return the min length of the "$<len>\r\n" header line before a bulk of 'len' bytes.
+static size_t _command_bulk_header_len(long len)
+{
+    size_t n = 3;   // '$' and "\r\n"
+    do {
+        n ++;
+        len /= 10;
+    } while (len);
+    return n;
+}
+
+// Parse one RESP multibulk command at 'qb_pos', e.g. "*2\r\n$3\r\nget\r\n$3\r\nkey\r\n".
+// Bulk arguments are located with their length prefix, so their content is never scanned.
+// Parsing state (arguments parsed so far, 'multibulk_len' and 'bulk_len') is kept in the
+// client, so a command can arrive over any number of reads.
+//
+// Arguments are not copied. Each bulk is made an sds view in place: its sds header is written
+// over the "$<len>\r\n" line before it and its null terminator over the trailing '\r'. Only
+// the positions of views are kept until the whole command arrives, since query_buf may be
+// reallocated by the next read. Then they are turned into pointers in argv.
+static int _command_parse_multibulk(client *c)
+{
+    long long ll;
+
+    if (c->multibulk_len == 0) {
+        if (_command_parse_resp_header(c, '*', &ll) != C_OK) return C_ERR;
+        if (ll > CLIENT_MAX_ARG) {
+            _command_protocol_error(c, "too many arguments");
+            return C_ERR;
+        }
+        c->argc = 0;
+        if (ll <= 0) return C_OK;  // Empty multibulk. Nothing to execute
+        c->multibulk_len = ll;
+    }
+
+    while (c->multibulk_len) {
+        if (c->bulk_len == -1) {
+            if (_command_parse_resp_header(c, '$', &ll) != C_OK) break;
+            if (ll < 0 || ll > CLIENT_MAX_BULK_LEN) {
+                _command_protocol_error(c, "invalid bulk length");
+                break;
+            }
+            c->bulk_len = ll;
+        }
+        // Wait for the whole bulk and its trailing "\r\n"
+        if (sds_len(c->query_buf) - c->qb_pos < (size_t)c->bulk_len + 2) break;
+
+        char *p = c->query_buf + c->qb_pos;
+        if (sds_new_in_place(p, _command_bulk_header_len(c->bulk_len), c->bulk_len)) {
+            c->argv[c->argc] = NULL;
+            c->argv_pos[c->argc] = c->qb_pos;
+        } else {    // No room for the header. Copy it
+            c->argv[c->argc] = sds_new_len(p, c->bulk_len);
+        }
+        c->argc ++;
+        c->qb_pos += c->bulk_len + 2;
+        c->bulk_len = -1;
+        c->multibulk_len --;
+    }
+    c->qb_scan_pos = c->qb_pos;
+    if (c->multibulk_len) return C_ERR;
+
+    for (int i = 0; i < c->argc; i ++) {
+        if (c->argv[i] == NULL) c->argv[i] = c->query_buf + c->argv_pos[i];
+    }
+    return C_OK;
+}
+
+// Parse one command in client's query buf, starting at 'qb_pos'. The protocol is chosen by the
+// first byte of the request: '*' starts a RESP multibulk, anything else is an inline command.
+//
+// Return C_OK if a whole command is parsed into c->argv. Return C_ERR if the command is
+// not complete yet or if there is a protocol error, in which case the client is flagged
+// to be closed after the error reply.
+int command_parse_client_args(client *c)
+{
+    if (c->req_type == CLIENT_REQ_UNKNOWN) {
+        c->req_type = (c->query_buf[c->qb_pos] == '*') ? CLIENT_REQ_MULTIBULK : CLIENT_REQ_INLINE;
+    }
+
+    int ret = (c->req_type == CLIENT_REQ_MULTIBULK) ?
+        _command_parse_multibulk(c) : _command_parse_inline(c);
+    if (ret != C_OK) return C_ERR;
+
+    server_log(LL_DEBUG, "command_parse_client_args() argc: %d", c->argc);
+    for(int i = 0; i < c->argc; i ++) {
+        server_log(LL_DEBUG, "arg %d: %s", i, c->argv[i]);
     }
+    return C_OK;
 }
 
+// Free arguments of client 'c'. Views into the query buf are simply dropped. State of a multi-key
+// command, if any, goes with them.
 void command_free_client_args(client *c)
 {
+    if (c->key_vals) {
+        for (int i = 0; i < c->argc - 1; i ++) sds_free(c->key_vals[i]);
+        zfree(c->key_vals);
+        c->key_vals = NULL;
+    }
+    zfree(c->key_shards);
+    c->key_shards = NULL;
+
     for(int i = 0; i < c->argc; i ++) {
-        sds_free(c->argv[i]);
+        if (!_command_arg_is_view(c, c->argv[i])) sds_free(c->argv[i]);
     }
     c->argc = 0;
 }
 
-// This function gets called when there command in client's recv_buf to process.
-void command_process(client *c)
+// Reset client 'c' to parse the next request.
+static void _command_reset_client(client *c)
+{
+    command_free_client_args(c);
+    c->cmd = NULL;
+    c->req_type = CLIENT_REQ_UNKNOWN;
+    c->multibulk_len = 0;
+    c->bulk_len = -1;
+}
+
+// Execute the command parsed in c->argv.
+static void _command_execute(client *c)
 {
-    // Parse recv_buf to get arguments
-    command_parse_client_args(c);
-    // Reply if not command
-    if (c->argv[0] == NULL) {
-        net_client_reply_append_cstr(c, "(error) no command.");
-        net_client_reply_flush(c);
+    // Reply if not command. An empty multibulk is silently ignored
+    if (c->argc == 0) {
+        if (c->req_type == CLIENT_REQ_INLINE) {
+            net_client_reply_error(c, "no command");
+        }
         return;
     }
 
@@ -143,97 +352,433 @@ void command_process(client *c)
     c->cmd = command_lookup(c->argv[0]);
     // Reply if unknown command
     if (!c->cmd) {
-        net_client_reply_append_fmt(c, "(error) unknown command <'%s', %lu>.", c->argv[0], sds_len(c->argv[0]));
-        net_client_reply_flush(c);
+        net_client_reply_error(c, "unknown command '%s'", c->argv[0]);
         return;
 
     } // Reply if wrong number of argument provided
-    else if (c->argc != c->cmd->arity) {
-        net_client_reply_append_fmt(c, "(error) wrong argument count %d, %d needed.", c->argc, c->cmd->arity);
-        net_client_reply_flush(c);
+    else if (c->cmd->arity > 0 && c->argc != c->cmd->arity) {
+        net_client_reply_error(c, "wrong argument count %d for '%s', %d needed",
+            c->argc, c->cmd->name, c->cmd->arity);
         return;
+    } else if (c->argc < -c->cmd->arity) {
+        net_client_reply_error(c, "wrong argument count %d for '%s', at least %d needed",
+            c->argc, c->cmd->name, -c->cmd->arity);
+        return;
+    }
+    // A key of another shard. Have that shard execute it
+    if (server.num_shards > 1 && c->cmd->key_pos) {
+        int target = shard_of_key(c->argv[c->cmd->key_pos]);
+        if (target != this_shard->id) {
+            shard_forward_command(c, target);
+            return;
+        }
     }
     // execute now.
+    if (_command_check_memory(c) != C_OK) return;
     c->cmd->proc(c);
+    this_shard->stat_numcommands ++;
+}
 
-    // Free parsed arguments if any
-    command_free_client_args(c);
+// Execute the command of client 'c' forwarded by another shard, on the databases of this shard.
+// The command may forward the client on to another shard, so it's not touched after. Its shard
+// sets its databases back once the command is done. See shard.c
+void command_execute_forwarded(client *c)
+{
+    c->db = this_shard->db + c->db->id;
+    if (_command_check_memory(c) != C_OK) return;
+    this_shard->stat_numcommands ++;
+    c->cmd->proc(c);
+}
+
+// Evict keys of this shard before a write command if used memory is over maxmemory. Reply an error
+// and return C_ERR if the command may grow memory usage but nothing could be evicted.
+static int _command_check_memory(client *c)
+{
+    if (!server.maxmemory || !(c->cmd->flags & CMD_WRITE)) return C_OK;
+    if (evict_perform() == C_OK || !(c->cmd->flags & CMD_DENYOOM)) return C_OK;
+    net_client_reply_error(c, "OOM command not allowed when used memory > 'maxmemory'");
+    return C_ERR;
+}
+
+// This function gets called when new data arrives in client's query buf. Every complete
+// command in the buf is parsed and executed. Incomplete command is left for next time.
+void command_process(client *c)
+{
+    // Start of the command being parsed. A command left incomplete last time starts at 0,
+    // since the buf was trimmed to it
+    size_t cmd_start = 0;
+
+    // The command executed by another shard is done. Its arguments can be freed now
+    if (c->cmd) _command_reset_client(c);
+
+    // Execute the command already parsed by an io thread, if any
+    if (c->flags & CLIENT_PENDING_COMMAND) {
+        c->flags &= ~CLIENT_PENDING_COMMAND;
+        _command_execute(c);
+        if (c->flags & CLIENT_BLOCKED) return;
+        _command_reset_client(c);
+    }
+
+    while (c->qb_pos < sds_len(c->query_buf)) {
+        if (c->req_type == CLIENT_REQ_UNKNOWN) cmd_start = c->qb_pos;
+        // Stop processing once the client is going to be closed, e.g. by 'exit'
+        if (c->flags & CLIENT_CLOSE_AFTER_REPLY) break;
+        // Parse query_buf to get arguments
+        if (command_parse_client_args(c) != C_OK) break;
+
+        _command_execute(c);
+        // Wait for the shard executing the command. Its arguments are views into the query buf,
+        // so neither free them nor trim the buf. See net_client_unblock()
+        if (c->flags & CLIENT_BLOCKED) return;
+        // Free parsed arguments if any and get ready for next command
+        _command_reset_client(c);
+    }
+
+    // Remove processed commands from the query buf. Keep an incomplete command from its start,
+    // as its arguments parsed so far are views into the buf
+    size_t trim = (c->req_type == CLIENT_REQ_UNKNOWN) ? c->qb_pos : cmd_start;
+    if (trim > 0) {
+        sds_range(c->query_buf, trim, -1);
+        c->qb_pos -= trim;
+        c->qb_scan_pos -= trim;
+        for (int i = 0; i < c->argc; i ++) {
+            if (c->argv[i] == NULL) c->argv_pos[i] -= trim;
+        }
+    }
 }
 
 // 'Get' command: get key
 static void cmd_get(client *c)
 {
-
-    arobj *obj = dict_fetch_value(c->db->d, c->argv[1]);
+    dict_entry *de = db_find(c->db, c->argv[1]);
+    arobj *obj = de ? dict_get_val(de) : NULL;
 
     if (obj == NULL) {
-        net_client_reply_append_fmt(c, "(error) key '%s' not exists.", c->argv[1]);
-        net_client_reply_flush(c);
+        net_client_reply_null(c);
     } else if (obj->type != OBJ_TYPE_STRING) {
-        net_client_reply_append_cstr(c, "(error) wrong type, object not a string.");
-        net_client_reply_flush(c);
+        net_client_reply_error(c, "wrong type, object not a string");
     } else {
-        net_client_reply_append_sds(c, obj->ptr);
-        net_client_reply_flush(c);
+        net_client_reply_bulk_obj(c, obj);
+    }
+}
+
+// Reply the value of entry 'de' found by 'mget', or nil if not found or not a string.
+static void _command_reply_mget_entry(client *c, dict_entry *de)
+{
+    arobj *obj = de ? dict_get_val(de) : NULL;
+    if (obj == NULL || obj->type != OBJ_TYPE_STRING) {
+        net_client_reply_null(c);
+    } else {
+        net_client_reply_bulk_obj(c, obj);
+    }
+}
+
+// Return a copy of the value of entry 'de' found by 'mget', or NULL if not found or not a string.
+static sds _command_dup_mget_entry(dict_entry *de)
+{
+    arobj *obj = de ? dict_get_val(de) : NULL;
+    if (obj == NULL || obj->type != OBJ_TYPE_STRING) return NULL;
+    if (obj->encoding == OBJ_ENC_INT) return sds_from_longlong((long)obj->ptr);
+    return sds_dup(obj->ptr);
+}
+
+// 'Mget' command: mget key [key ...]. Reply the values of the keys, nil for a missing key.
+//
+// Keys are looked up together with dict_find_batch(). If they all belong to the shard of the
+// client, the values are replied right away. Otherwise the shards owning them execute the command
+// in turn, starting from the shard of the client, so that the command makes at most one hop per
+// shard. Each shard looks up its own keys and keeps copies of their values in the client, since
+// its objects may be gone by the end, and the last shard replies all values in order.
+static void cmd_mget(client *c)
+{
+    int num_keys = c->argc - 1, n = 0;
+    sds keys[CLIENT_MAX_ARG];
+    int idx[CLIENT_MAX_ARG];
+    dict_entry *found[CLIENT_MAX_ARG];
+
+    if (c->key_shards == NULL) {
+        int local = 1;
+        if (server.num_shards > 1) {
+            c->key_shards = zmalloc(sizeof(int) * num_keys);
+            for (int i = 0; i < num_keys; i ++) {
+                c->key_shards[i] = shard_of_key(c->argv[i + 1]);
+                if (c->key_shards[i] != this_shard->id) local = 0;
+            }
+        }
+        if (local) {
+            db_find_batch(c->db, c->argv + 1, num_keys, found);
+            net_client_reply_array_len(c, num_keys);
+            for (int i = 0; i < num_keys; i ++) {
+                net_client_reply_array_next(c);
+                _command_reply_mget_entry(c, found[i]);
+            }
+            return;
+        }
+        c->key_vals = zcalloc(num_keys, sizeof(sds));
+    }
+
+    // Look up the keys of this shard
+    for (int i = 0; i < num_keys; i ++) {
+        if (c->key_shards[i] != this_shard->id) continue;
+        keys[n] = c->argv[i + 1];
+        idx[n ++] = i;
+    }
+    db_find_batch(c->db, keys, n, found);
+    for (int i = 0; i < n; i ++) c->key_vals[idx[i]] = _command_dup_mget_entry(found[i]);
+
+    // Pass the command on to the next shard with keys. Shards are ordered by their distance
+    // from the shard of the client
+    int origin = c->shard->id, num_shards = server.num_shards;
+    int dist = (this_shard->id - origin + num_shards) % num_shards, next = 0;
+    for (int i = 0; i < num_keys; i ++) {
+        int d = (c->key_shards[i] - origin + num_shards) % num_shards;
+        if (d > dist && (next == 0 || d < next)) next = d;
+    }
+    if (next) {
+        shard_forward_command(c, (origin + next) % num_shards);
+        return;
+    }
+
+    net_client_reply_array_len(c, num_keys);
+    for (int i = 0; i < num_keys; i ++) {
+        net_client_reply_array_next(c);
+        if (c->key_vals[i]) {
+            net_client_reply_bulk_cbuf(c, c->key_vals[i], sds_len(c->key_vals[i]));
+        } else {
+            net_client_reply_null(c);
+        }
     }
 }
 
 // 'Set' command: set key value
 static void cmd_set(client *c)
 {
-    // Used already parsed args as key & val. Avoid sds_new().
-    sds key_str = c->argv[1];
-    sds val_str = c->argv[2];
-    c->argv[1] = NULL; // must set NULL!
-    c->argv[2] = NULL;
+    // The key & val are kept in the db, so they are taken out of argv.
+    sds key_str = _command_take_arg(c, 1);
+    sds val_str = _command_take_arg(c, 2);
 
     arobj *val_obj = obj_create(OBJ_TYPE_STRING, OBJ_ENC_SDS, val_str);
-    // add the entry !
-    if (dict_add_entry(c->db->d, key_str, val_obj) == DICT_ERR) {
-        server_log(LL_VERBOSE, "Server add new entry ('%s', '%s') failed. Already exists.", key_str, val_str);
-        net_client_reply_append_fmt(c, "(error) key '%s' already exists. ", key_str);
-        net_client_reply_flush(c);
+    server_log(LL_VERBOSE, "Server add new entry ('%s', '%s')", key_str, val_str);
+    // add the entry ! A short key is copied into the entry and freed, so don't touch it once added
+    if (db_add(c->db, key_str, val_obj) == DICT_ERR) {
+        server_log(LL_VERBOSE, "Server add new entry failed. Already exists.");
+        net_client_reply_error(c, "key '%s' already exists", key_str);
+        sds_free(key_str);
+        obj_dec_ref(val_obj);
     } else {
-        server_log(LL_VERBOSE, "Server add new entry ('%s', '%s') ok", key_str, val_str);
-        net_client_reply_append_cstr(c, "(ok)");
-        net_client_reply_flush(c);
+        server_log(LL_VERBOSE, "Server add new entry ok");
+        net_client_reply_ok(c);
     }
 }
 
-// 'Del' command: del key
-static void cmd_del(client *c)
+// Delete the key of 'del' or 'unlink', freeing its value by 'free_mode'. See db_delete()
+static void _command_generic_delete(client *c, int free_mode)
 {
     sds key_str = c->argv[1];
-    dict_entry *de = dict_unlink(c->db->d, key_str);
-    if (de == NULL) {
-        server_log(LL_VERBOSE, "Server delete entry with key '%s' failed. No such key.", key_str);
-        net_client_reply_append_fmt(c, "(error) key '%s' not exists.", key_str);
-        net_client_reply_flush(c);
+    if (db_delete(c->db, key_str, free_mode)) {
+        server_log(LL_VERBOSE, "Server delete entry ('%s', ...) ok", key_str);
+        net_client_reply_integer(c, 1);
     } else {
-        arobj* o = dict_get_val(de);
-        server_assert(o->ref_count == 1);
+        server_log(LL_VERBOSE, "Server delete entry with key '%s' failed. No such key.", key_str);
+        net_client_reply_integer(c, 0);
+    }
+}
 
-        dict_free_unlinked_entry(c->db->d, de);
+// 'Del' command: del key. Reply the number of keys deleted. A value costly to free is freed
+// in the background.
+static void cmd_del(client *c)
+{
+    _command_generic_delete(c, DB_FREE_LAZY);
+}
 
-        server_log(LL_VERBOSE, "Server delete entry ('%s', ...) ok", key_str);
-        net_client_reply_append_cstr(c, "(ok)");
-        net_client_reply_flush(c);
-    }
+// 'Unlink' command: unlink key. Like 'del', but the value is always freed in the background.
+static void cmd_unlink(client *c)
+{
+    _command_generic_delete(c, DB_FREE_ASYNC);
 }
 
-// 'Exist' command: exist key
+// 'Exist' command: exist key. Reply 1 if the key exists, 0 otherwise.
 static void cmd_exist(client *c)
 {
     sds key_str = c->argv[1];
-    if (dict_find(c->db->d, key_str) == NULL) {
+    if (db_find(c->db, key_str) == NULL) {
         server_log(LL_VERBOSE, "Server entry with key '%s' not exists.", key_str);
-        net_client_reply_append_cstr(c, "(no)");
-        net_client_reply_flush(c);
+        net_client_reply_integer(c, 0);
     } else {
         server_log(LL_VERBOSE, "Server entry with key '%s' exists.", key_str);
-        net_client_reply_append_cstr(c, "(yes)");
-        net_client_reply_flush(c);
+        net_client_reply_integer(c, 1);
+    }
+}
+
+// Keys collected by 'scan'
+typedef struct scan_keys {
+    sds *keys;
+    long num;
+    long cap;
+} scan_keys;
+
+// Collect the key of entry 'de' scanned by dict_scan()
+static void _command_scan_callback(void *privdata, const dict_entry *de)
+{
+    scan_keys *sk = privdata;
+    if (sk->num == sk->cap) {
+        sk->cap *= 2;
+        sk->keys = zrealloc(sk->keys, sizeof(sds) * sk->cap);
     }
+    sk->keys[sk->num ++] = dict_get_key(de);
+}
+
+// 'Scan' command: scan cursor [match pattern] [count n]. Reply the cursor to pass next time and
+// about 'n' keys (10 by default) matching 'pattern'. Scanning is done when cursor 0 is replied.
+//
+// The cursor walks the shards one by one. 'cursor % num_shards' is the shard to scan, which
+// executes the command, and 'cursor / num_shards' is the dict_scan() cursor of its keyspace.
+static void cmd_scan(client *c)
+{
+    long long cursor, count = 10;
+    sds pattern = NULL;
+
+    if (!util_convert_str_to_ll(c->argv[1], sds_len(c->argv[1]), &cursor) || cursor < 0) {
+        net_client_reply_error(c, "invalid cursor");
+        return;
+    }
+    for (int i = 2; i < c->argc; i += 2) {
+        if (i + 1 == c->argc) {
+            net_client_reply_error(c, "syntax error");
+            return;
+        } else if (strcasecmp(c->argv[i], "match") == 0) {
+            pattern = c->argv[i + 1];
+            // "*" matches all. Skip matching
+            if (sds_len(pattern) == 1 && pattern[0] == '*') pattern = NULL;
+        } else if (strcasecmp(c->argv[i], "count") == 0) {
+            if (!util_convert_str_to_ll(c->argv[i + 1], sds_len(c->argv[i + 1]), &count) || count < 1) {
+                net_client_reply_error(c, "invalid count");
+                return;
+            }
+        } else {
+            net_client_reply_error(c, "syntax error");
+            return;
+        }
+    }
+    // The keys are in another shard. Have it scan them
+    int shard = cursor % server.num_shards;
+    if (shard != this_shard->id) {
+        shard_forward_command(c, shard);
+        return;
+    }
+
+    // Scan buckets until enough keys are collected. Limit the buckets scanned, in case most are empty
+    scan_keys sk;
+    sk.cap = (count < 1024) ? count + 16 : 1024;
+    sk.keys = zmalloc(sizeof(sds) * sk.cap);
+    sk.num = 0;
+    unsigned long dict_cursor = cursor / server.num_shards;
+    long long max_buckets = (count < LLONG_MAX / 10) ? count * 10 : LLONG_MAX;
+    do {
+        dict_cursor = dict_scan(c->db->d, dict_cursor, _command_scan_callback, &sk);
+    } while (dict_cursor && -- max_buckets && sk.num < count);
+
+    // Filter keys by pattern
+    long num = 0;
+    for (long i = 0; i < sk.num; i ++) {
+        sds key = sk.keys[i];
+        if (pattern && !util_string_match(pattern, sds_len(pattern), key, sds_len(key), 0)) continue;
+        sk.keys[num ++] = key;
+    }
+
+    // Scan the next shard from its beginning once this one is done
+    if (dict_cursor) {
+        cursor = (long long)dict_cursor * server.num_shards + shard;
+    } else {
+        cursor = (shard + 1 < server.num_shards) ? shard + 1 : 0;
+    }
+    char buf[LEN_LL_TO_STR];
+    int len = util_convert_ll_to_str(buf, cursor);
+
+    net_client_reply_array_len(c, 2);
+    net_client_reply_array_next(c);
+    net_client_reply_bulk_cbuf(c, buf, len);
+    net_client_reply_array_next(c);
+    net_client_reply_array_len(c, num);
+    for (long i = 0; i < num; i ++) {
+        net_client_reply_array_next(c);
+        net_client_reply_bulk_cbuf(c, sk.keys[i], sds_len(sk.keys[i]));
+    }
+    zfree(sk.keys);
+}
+
+// Empty the database of client 'c', or all databases if 'all', for 'flushdb' and 'flushall'.
+// Each shard empties its own part, then passes the command on to the next shard, and the last
+// one replies. With "async", the dicts are released by the lazyfree thread.
+static void _command_generic_flush(client *c, int all)
+{
+    int async = 0;
+    if (c->argc > 2) {
+        net_client_reply_error(c, "syntax error");
+        return;
+    } else if (c->argc == 2) {
+        if (strcasecmp(c->argv[1], "async") == 0) {
+            async = 1;
+        } else if (strcasecmp(c->argv[1], "sync") != 0) {
+            net_client_reply_error(c, "syntax error");
+            return;
+        }
+    }
+
+    if (all) {
+        for (int i = 0; i < server.num_db; i ++) db_empty(this_shard->db + i, async);
+    } else {
+        db_empty(c->db, async);
+    }
+
+    int next = (this_shard->id + 1) % server.num_shards;
+    if (next != c->shard->id) {
+        shard_forward_command(c, next);
+        return;
+    }
+    net_client_reply_ok(c);
+}
+
+// 'Flushdb' command: flushdb [async|sync]. Remove all keys of the current database.
+static void cmd_flushdb(client *c)
+{
+    _command_generic_flush(c, 0);
+}
+
+// 'Flushall' command: flushall [async|sync]. Remove all keys of all databases.
+static void cmd_flushall(client *c)
+{
+    _command_generic_flush(c, 1);
+}
+
+// 'Ping' command: ping
+static void cmd_ping(client *c)
+{
+    net_client_reply_status(c, "PONG");
+}
+
+// 'Info' command: info [memory]. Only the memory section so far. Memory is of the whole process,
+// so any shard can reply. The evicted keys are of the replying shard.
+static void cmd_info(client *c)
+{
+    if (c->argc > 2 || (c->argc == 2 && strcasecmp(c->argv[1], "memory") != 0)) {
+        net_client_reply_error(c, "syntax error");
+        return;
+    }
+    size_t rss = zmalloc_get_rss();
+    sds info = sds_cat_printf(sds_new_empty(),
+        "# Memory\r\n"
+        "used_memory:%zu\r\n"
+        "used_memory_rss:%zu\r\n"
+        "mem_fragmentation_ratio:%.2f\r\n"
+        "mem_allocator:%s\r\n"
+        "maxmemory:%llu\r\n"
+        "maxmemory_policy:%s\r\n"
+        "evicted_keys:%lld\r\n",
+        zmalloc_used_memory(), rss, zmalloc_get_fragmentation_ratio(rss), zmalloc_lib(),
+        server.maxmemory, evict_get_policy_name(server.maxmemory_policy), this_shard->stat_evictedkeys);
+    net_client_reply_bulk_cbuf(c, info, sds_len(info));
+    sds_free(info);
 }
 
 // 'Hset' command: hset hash key value
@@ -249,7 +794,6 @@ static void cmd_hset(client *c)
         arobj *hash = dict_get_val(old_de);
         if (hash->type != OBJ_TYPE_HASH) {
             net_client_reply_append_cstr(c, "(error) wrong type, object not a hash.");
-            net_client_reply_flush(c);
             return;
         }
 
@@ -263,10 +807,8 @@ static void cmd_hset(client *c)
 // 'Exit' command: exit
 static void cmd_exit(client *c)
 {
-    int client_fd = c->fd;
-    server_log(LL_VERBOSE, "Client disconnected. Remove client fd: %d ok", client_fd);
-    FD_CLR(client_fd, &server.active_fds);
-    close(client_fd);
+    server_log(LL_VERBOSE, "Client disconnected. Remove client fd: %d ok", c->fd);
+    c->flags |= CLIENT_CLOSE_AFTER_REPLY;   // The client is closed by net.c once this command returns
 }
 
 // 'Time' command: time
@@ -275,8 +817,9 @@ static void cmd_time(client *c)
     time_t current_time = time(NULL);
     struct tm *local_time = localtime(&current_time);
 
-    net_client_reply_append_cstr(c, asctime(local_time));
-    net_client_reply_flush(c);
+    char *time_str = asctime(local_time);
+
+    net_client_reply_bulk_cbuf(c, time_str, strlen(time_str) - 1);  // Remove trailing '\n'
 }
 
 
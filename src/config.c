@@ -10,9 +10,21 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include <unistd.h>
+#include <string.h>
+#include <strings.h>
+#include <limits.h>
 #include "server.h"
 #include "config.h"
+#include "event.h"
+#include "dict.h"
 #include "log.h"
+#include "evict.h"
+#include "util.h"
+
+static void _config_check();
+static int _config_parse_int(const char *param, size_t name_len, const char *str, long long min, long long max,
+    int *val);
+static int _config_parse_memory(const char *str, unsigned long long *bytes);
 
 // Initialize server configurations
 void config_init()
@@ -23,13 +35,169 @@ void config_init()
     // net
     server.port = atol("8888");
     server.ip = "0.0.0.0";
+    server.max_clients = CONFIG_PARAM_MAX_CLIENTS;
+    server.io_threads_num = CONFIG_PARAM_IO_THREADS;
+    server.num_shards = CONFIG_PARAM_SHARDS;
+    server.event_backend = CONFIG_PARAM_EVENT_BACKEND;
 
     // databases
-    server.db = NULL;
     server.num_db = CONFIG_PARAM_DB_NUM;
+    server.db_dict_engine = CONFIG_PARAM_DB_DICT_ENGINE;
+    server.db_hash = CONFIG_PARAM_DB_HASH;
+    server.db_embed_key_len = CONFIG_PARAM_DB_EMBED_KEY_LEN;
+    // memory
+    server.maxmemory = CONFIG_PARAM_MAXMEMORY;
+    server.maxmemory_policy = CONFIG_PARAM_MAXMEMORY_POLICY;
+    server.maxmemory_samples = CONFIG_PARAM_MAXMEMORY_SAMPLES;
+    // cron
+    server.hz = CONFIG_PARAM_HZ;
 
 
     // Overwrite the default init by configs from config file
 
-    // Chech that server.num_db >= 0 && <= CONFIG_MAX_DB_NUM
+    _config_check();
+}
+
+// Overwrite configs by parameters given when the server starts up, in the form of
+// './ArenaDB -p name=value -p name=value ...'. See config.h
+// Return 0 if all parameters are loaded, or -1 if any of them is invalid.
+int config_load_params(int argc, char *argv[])
+{
+    for (int i = 1; i < argc; i ++) {
+        if (strcmp(argv[i], "-p") != 0 || i + 1 == argc) {
+            server_log(LL_WARNING, "Invalid parameter '%s'. Expected '-p name=value'", argv[i]);
+            return -1;
+        }
+        char *param = argv[++ i];
+        char *eq = strchr(param, '=');
+        if (eq == NULL || eq[1] == '\0') {
+            server_log(LL_WARNING, "Invalid parameter '%s'. Expected 'name=value'", param);
+            return -1;
+        }
+        size_t name_len = eq - param;
+        int ret = 0;
+
+        if (name_len == 4 && strncasecmp(param, "port", name_len) == 0) {
+            ret = _config_parse_int(param, name_len, eq + 1, 1, 65535, &server.port);
+        } else if (name_len == 6 && strncasecmp(param, "db_num", name_len) == 0) {
+            ret = _config_parse_int(param, name_len, eq + 1, 1, CONFIG_MAX_DB_NUM, &server.num_db);
+        } else if (name_len == 2 && strncasecmp(param, "hz", name_len) == 0) {
+            ret = _config_parse_int(param, name_len, eq + 1, CONFIG_MIN_HZ, CONFIG_MAX_HZ, &server.hz);
+        } else if (name_len == 11 && strncasecmp(param, "max_clients", name_len) == 0) {
+            ret = _config_parse_int(param, name_len, eq + 1, 1, INT_MAX, &server.max_clients);
+        } else if (name_len == 10 && strncasecmp(param, "io_threads", name_len) == 0) {
+            ret = _config_parse_int(param, name_len, eq + 1, 1, CONFIG_MAX_IO_THREADS, &server.io_threads_num);
+        } else if (name_len == 6 && strncasecmp(param, "shards", name_len) == 0) {
+            ret = _config_parse_int(param, name_len, eq + 1, 1, CONFIG_MAX_SHARDS, &server.num_shards);
+        } else if (name_len == 13 && strncasecmp(param, "event_backend", name_len) == 0) {
+            if (strcasecmp(eq + 1, "epoll") == 0) {
+                server.event_backend = AE_BACKEND_EPOLL;
+            } else if (strcasecmp(eq + 1, "io_uring") == 0) {
+                server.event_backend = AE_BACKEND_IO_URING;
+            } else {
+                server_log(LL_WARNING, "Invalid event_backend '%s'. Expected 'epoll' or 'io_uring'", eq + 1);
+                return -1;
+            }
+        } else if (name_len == 14 && strncasecmp(param, "db_dict_engine", name_len) == 0) {
+            if (strcasecmp(eq + 1, "chained") == 0) {
+                server.db_dict_engine = DICT_ENGINE_CHAINED;
+            } else if (strcasecmp(eq + 1, "swiss") == 0) {
+                server.db_dict_engine = DICT_ENGINE_SWISS;
+            } else {
+                server_log(LL_WARNING, "Invalid db_dict_engine '%s'. Expected 'chained' or 'swiss'", eq + 1);
+                return -1;
+            }
+        } else if (name_len == 7 && strncasecmp(param, "db_hash", name_len) == 0) {
+            if (strcasecmp(eq + 1, "siphash") == 0) {
+                server.db_hash = DICT_HASH_SIPHASH;
+            } else if (strcasecmp(eq + 1, "wyhash") == 0) {
+                server.db_hash = DICT_HASH_WYHASH;
+            } else if (strcasecmp(eq + 1, "crc32c") == 0) {
+                server.db_hash = DICT_HASH_CRC32C;
+            } else {
+                server_log(LL_WARNING, "Invalid db_hash '%s'. Expected 'siphash', 'wyhash' or 'crc32c'", eq + 1);
+                return -1;
+            }
+        } else if (name_len == 16 && strncasecmp(param, "db_embed_key_len", name_len) == 0) {
+            ret = _config_parse_int(param, name_len, eq + 1, 0, DICT_EMBED_KEY_MAX, &server.db_embed_key_len);
+        } else if (name_len == 9 && strncasecmp(param, "maxmemory", name_len) == 0) {
+            if (_config_parse_memory(eq + 1, &server.maxmemory) == -1) {
+                server_log(LL_WARNING, "Invalid maxmemory '%s'. Expected bytes, or with kb, mb or gb", eq + 1);
+                return -1;
+            }
+        } else if (name_len == 16 && strncasecmp(param, "maxmemory_policy", name_len) == 0) {
+            if (strcasecmp(eq + 1, "noeviction") == 0) {
+                server.maxmemory_policy = EVICT_NOEVICTION;
+            } else if (strcasecmp(eq + 1, "allkeys-lru") == 0) {
+                server.maxmemory_policy = EVICT_ALLKEYS_LRU;
+            } else if (strcasecmp(eq + 1, "allkeys-random") == 0) {
+                server.maxmemory_policy = EVICT_ALLKEYS_RANDOM;
+            } else {
+                server_log(LL_WARNING, "Invalid maxmemory_policy '%s'. Expected 'noeviction', 'allkeys-lru' "
+                    "or 'allkeys-random'", eq + 1);
+                return -1;
+            }
+        } else if (name_len == 17 && strncasecmp(param, "maxmemory_samples", name_len) == 0) {
+            ret = _config_parse_int(param, name_len, eq + 1, 1, EVICT_MAX_SAMPLES, &server.maxmemory_samples);
+        } else {
+            server_log(LL_WARNING, "Unknown parameter '%.*s'", (int)name_len, param);
+            return -1;
+        }
+        if (ret == -1) return -1;
+    }
+
+    _config_check();
+    return 0;
+}
+
+// Make sure configs work together. Each one is range checked as it's parsed
+static void _config_check()
+{
+    // Shards already use a thread each to do their own I/O
+    if (server.num_shards > 1 && server.io_threads_num > 1) {
+        server_log(LL_WARNING, "io_threads is ignored with shards > 1");
+        server.io_threads_num = 1;
+    }
+}
+
+// Parse integer parameter 'str' into 'val'. The whole of it must be a decimal integer in [min, max].
+// Return 0 if it is, or log a warning naming the parameter 'param' of 'name_len' and return -1.
+static int _config_parse_int(const char *param, size_t name_len, const char *str, long long min, long long max,
+    int *val)
+{
+    long long ll;
+    if (!util_convert_str_to_ll(str, strlen(str), &ll) || ll < min || ll > max) {
+        server_log(LL_WARNING, "Invalid %.*s '%s'. Expected an integer in [%lld, %lld]",
+            (int)name_len, param, str, min, max);
+        return -1;
+    }
+    *val = ll;
+    return 0;
+}
+
+// Parse memory size 'str', in bytes or with a kb, mb or gb suffix (case insensitive), e.g. '100mb'.
+// Return 0 with the size in 'bytes', or -1 if it is invalid.
+static int _config_parse_memory(const char *str, unsigned long long *bytes)
+{
+    const char *end = str;
+    unsigned long long val = 0, mul = 1;
+
+    // Digits only. strtoull() would take leading spaces and signs, and saturate on overflow
+    if (*end < '0' || *end > '9') return -1;
+    for (; *end >= '0' && *end <= '9'; end ++) {
+        if (val > (ULLONG_MAX - (unsigned)(*end - '0')) / 10) return -1;
+        val = val * 10 + (unsigned)(*end - '0');
+    }
+    if (strcasecmp(end, "kb") == 0) {
+        mul = 1024;
+    } else if (strcasecmp(end, "mb") == 0) {
+        mul = 1024 * 1024;
+    } else if (strcasecmp(end, "gb") == 0) {
+        mul = 1024 * 1024 * 1024;
+    } else if (*end != '\0') {
+        return -1;
+    }
+    if (val > ULLONG_MAX / mul) return -1;
+    *bytes = val * mul;
+    return 0;
 }
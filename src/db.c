@@ -11,31 +11,83 @@
 * When a user issues commond "get name", a look-up is perfomed on the db, and "apple" is returned as expected.
 */
 #include <stdio.h>
+#include <limits.h>
 #include "server.h"
 #include "dict.h"
 #include "obj.h"
 #include "db.h"
+#include "lazyfree.h"
 #include "debug.h"
+#include "zmalloc.h"
 
 // The dict type used for databases in ArenaDB server. Keys are sds string, val are also sds string
 // TODO val should support other data types, in additon to sds.
 dict_type db_dict_type = {
-    dict_sample_hash,               // hash
+    dict_sample_hash,               // hash, by server.db_hash. See db_init()
     NULL,                           // key dup
     NULL,                           // val dup
     dict_sample_compare_sds_key,    // key compare
     dict_sample_free_sds,           // key destruct
-    dict_sample_free_obj            // val destruct
+    dict_sample_free_obj,           // val destruct
+    DICT_ENGINE_CHAINED,            // engine, by server.db_dict_engine. See db_init()
+    1,                              // store hash
+    0                               // embed key len, by server.db_embed_key_len. See db_init()
 };
 
+// Init databases of the calling shard. Every shard has its own part of each database.
 void db_init()
 {
-    server.db = malloc(sizeof(database) * server.num_db);
+    db_dict_type.engine = server.db_dict_engine;
+    db_dict_type.hash_func = dict_sample_hash_func(server.db_hash);
+    db_dict_type.embed_key_len = server.db_embed_key_len;
+    this_shard->db = zmalloc(sizeof(database) * server.num_db);
     for(int i = 0; i < server.num_db; i ++) {
-        server.db[i].d = dict_create(&db_dict_type);
+        this_shard->db[i].d = dict_create(&db_dict_type);
+        this_shard->db[i].id = i;
     }
 }
 
+// Keys of databases are looked up with the dict variants specialized for their hash, so that
+// hashing and compares are not called through dict_type. See DICT_DEFINE_SPECIALIZED()
+#define _db_specialized(op, ...) \
+    ((server.db_hash == DICT_HASH_WYHASH) ? dict_sds_wyhash_##op(__VA_ARGS__) : \
+     (server.db_hash == DICT_HASH_CRC32C) ? dict_sds_crc32c_##op(__VA_ARGS__) : \
+                                            dict_sds_siphash_##op(__VA_ARGS__))
+
+// Stamp the value of entry 'de' with the LRU clock of the shard, as it's accessed. Shared objects
+// are left alone, since all shards may reach them. See evict.c
+static inline void _db_touch(dict_entry *de)
+{
+    arobj *o = dict_get_val(de);
+    if (o->ref_count != OBJ_SHARED_REFCOUNT) o->lru = this_shard->lru_clock;
+}
+
+// Find the entry of 'key' in 'db', or NULL if not found.
+dict_entry *db_find(database *db, sds key)
+{
+    dict_entry *de = _db_specialized(find, db->d, key);
+    if (de) _db_touch(de);
+    return de;
+}
+
+// Find the entries of 'n' keys in 'db' at once. See dict_find_batch()
+size_t db_find_batch(database *db, sds *keys, size_t n, dict_entry **out)
+{
+    size_t num_found = _db_specialized(find_batch, db->d, (void **)keys, n, out);
+    for (size_t i = 0; i < n; i ++) {
+        if (out[i]) _db_touch(out[i]);
+    }
+    return num_found;
+}
+
+// Add 'key' with 'val' to 'db'. Return DICT_ERR if it already exists.
+int db_add(database *db, sds key, void *val)
+{
+    arobj *o = val;
+    if (o->ref_count != OBJ_SHARED_REFCOUNT) o->lru = this_shard->lru_clock;
+    return _db_specialized(add_entry, db->d, key, val);
+}
+
 arobj *db_lookup_key(database *db, arobj *key)
 {
     dict_entry *de = dict_find(db->d, key);
@@ -47,5 +99,31 @@ arobj *db_lookup_key(database *db, arobj *key)
     }
 }
 
+// Delete 'key' from 'db'. Its value is freed according to 'free_mode', DB_FREE_XXX. The key and
+// the entry are always freed right away, as they are small. Return 1 if deleted, 0 if not found.
+int db_delete(database *db, sds key, int free_mode)
+{
+    dict_entry *de = _db_specialized(unlink, db->d, key);
+    if (de == NULL) return 0;
 
+    arobj *val = dict_get_val(de);
+    if (free_mode == DB_FREE_ASYNC ||
+        (free_mode == DB_FREE_LAZY && lazyfree_get_effort(val) > CONFIG_LAZYFREE_THRESHOLD)) {
+        lazyfree_free_obj(val);
+        dict_set_val(db->d, de, NULL);
+    }
+    dict_free_unlinked_entry(db->d, de);
+    return 1;
+}
 
+// Remove all keys from 'db'. If 'async', the old dict is swapped out for an empty one in O(1) and
+// released by the lazyfree thread.
+void db_empty(database *db, int async)
+{
+    if (async) {
+        lazyfree_free_dict(db->d);
+    } else {
+        dict_release(db->d);
+    }
+    db->d = dict_create(&db_dict_type);
+}
@@ -17,7 +17,9 @@
 #include "command.h"
 #include "log.h"
 
-static size_t _server_debug_dict_get_ht_stats(char *buf, size_t buf_size, dict_ht *ht, int table_id);
+static size_t _server_debug_dict_get_ht_stats(char *buf, size_t buf_size, dict *d, dict_ht *ht, int table_id);
+static size_t _server_debug_dict_get_swiss_ht_stats(char *buf, size_t buf_size, dict *d, dict_ht *ht, int table_id);
+static void _server_debug_dict_ht(dict_ht *ht, int table_id);
 static void server_debug_string(arobj *o);
 
 
@@ -124,38 +126,38 @@ void server_debug_dict(dict *d)
     server_log(LL_RAW, "server_debug_dict(): \n");
     server_log(LL_RAW, "rehash_idx: %ld \n", d->rehash_idx);
 
-    dict_ht *ht;
-    // print ht[0]
-    ht = &d->ht[0];
-    server_log(LL_RAW, "ht[0]: size=%lu, keys=%lu, table=%s \n", ht->size, ht->keys, (ht->table == NULL) ? "null" : "(below)");
-    if (ht->table != NULL) {
-        size_t size = ht->size;
-        for(int i = 0; i < size; i ++) {
-            server_log(LL_RAW, "slot %2d: ", i);
-            dict_entry *de = ht->table[i];
-            while(de) {
+    _server_debug_dict_ht(&d->ht[0], 0);
+    _server_debug_dict_ht(&d->ht[1], 1);
+    putchar('\n');
+}
+
+// Print entries of hash table 'ht', slot by slot.
+static void _server_debug_dict_ht(dict_ht *ht, int table_id)
+{
+    int has_table = (ht->table != NULL || ht->ctrl != NULL);
+    server_log(LL_RAW, "ht[%d]: size=%lu, keys=%lu, table=%s \n", table_id, ht->size, ht->keys, has_table ? "(below)" : "null");
+    if (!has_table) return;
+
+    size_t size = ht->size;
+    for(int i = 0; i < size; i ++) {
+        server_log(LL_RAW, "slot %2d: ", i);
+        if (ht->ctrl != NULL) {     // DICT_ENGINE_SWISS. Entries are inline
+            if (ht->ctrl[i] >= 0) {
+                dict_entry *de = &ht->slots[i];
                 server_log(LL_RAW, "%2s:%-2ld ", (char*)dict_get_key(de), dict_get_signed_integer_val(de));
-                de = de->next;
+            } else if (ht->ctrl[i] == DICT_CTRL_DELETED) {
+                server_log(LL_RAW, "(deleted)");
             }
             putchar('\n');
+            continue;
         }
-    }
-    // print ht[1]
-    ht = &d->ht[1];
-    server_log(LL_RAW, "ht[1]: size=%lu, keys=%lu, table=%s \n", ht->size, ht->keys, (ht->table == NULL) ? "null" : "(below)");
-    if (ht->table != NULL) {
-        size_t size = ht->size;
-        for(int i = 0; i < size; i ++) {
-            server_log(LL_RAW, "slot %2d: ", i);
-            dict_entry *de = ht->table[i];
-            while(de) {
-                server_log(LL_RAW, "%2s:%-2ld ", (char*)dict_get_key(de), dict_get_signed_integer_val(de));
-                de = de->next;
-            }
-            putchar('\n');
+        dict_entry *de = ht->table[i];
+        while(de) {
+            server_log(LL_RAW, "%2s:%-2ld ", (char*)dict_get_key(de), dict_get_signed_integer_val(de));
+            de = dict_get_next(de);
         }
+        putchar('\n');
     }
-    putchar('\n');
 }
 
 void server_debug_dict_get_stats(char *buf, size_t buf_size, dict *d)
@@ -163,20 +165,21 @@ void server_debug_dict_get_stats(char *buf, size_t buf_size, dict *d)
     char *orig_buf = buf;
     size_t orig_buf_size = buf_size;
 
-    size_t l = _server_debug_dict_get_ht_stats(buf, buf_size, &d->ht[0], 0);
+    size_t l = _server_debug_dict_get_ht_stats(buf, buf_size, d, &d->ht[0], 0);
     buf += l;
     buf_size -= l;
     if (dict_is_rehashing(d) && buf_size >= 0) {
-        _server_debug_dict_get_ht_stats(buf, buf_size, &d->ht[1], 1);
+        _server_debug_dict_get_ht_stats(buf, buf_size, d, &d->ht[1], 1);
     }
-    if (orig_buf_size) orig_buf[orig_buf_size] = '\0';
+    if (orig_buf_size) orig_buf[orig_buf_size - 1] = '\0';
 }
 
-static size_t _server_debug_dict_get_ht_stats(char *buf, size_t buf_size, dict_ht *ht, int table_id)
+static size_t _server_debug_dict_get_ht_stats(char *buf, size_t buf_size, dict *d, dict_ht *ht, int table_id)
 {
     if (ht->keys == 0) {
         return snprintf(buf, buf_size, "No stats available for empty hash table\n");
     }
+    if (ht->ctrl != NULL) return _server_debug_dict_get_swiss_ht_stats(buf, buf_size, d, ht, table_id);
 
     #define HISTO_LEN 50
     // Length histogram that displays the count of slot chain with increasing length.
@@ -200,7 +203,7 @@ static size_t _server_debug_dict_get_ht_stats(char *buf, size_t buf_size, dict_h
         num_entries = 0;
         while (de) {
             num_entries ++;
-            de = de->next;
+            de = dict_get_next(de);
         }
         // Update histogram info
         histogram[(num_entries < HISTO_LEN) ? num_entries : (HISTO_LEN - 1)] ++;
@@ -234,3 +237,52 @@ static size_t _server_debug_dict_get_ht_stats(char *buf, size_t buf_size, dict_h
     return strlen(buf);
 }
 
+// Stats of a DICT_ENGINE_SWISS hash table. Instead of chain lengths, it shows how many groups are
+// probed to find each key. 1 means the key is in the first group probed.
+static size_t _server_debug_dict_get_swiss_ht_stats(char *buf, size_t buf_size, dict *d, dict_ht *ht, int table_id)
+{
+    #define PROBE_HISTO_LEN 16
+    unsigned long histogram[PROBE_HISTO_LEN];
+    for(int i = 0; i < PROBE_HISTO_LEN; i ++) histogram[i] = 0;
+
+    unsigned long group_mask = ht->size / DICT_GROUP_WIDTH - 1;
+    unsigned long max_probes = 0, total_probes = 0;
+    for(unsigned long i = 0; i < ht->size; i ++) {
+        if (ht->ctrl[i] < 0) continue;
+        // Walk the probe sequence of the key until its group
+        uint64_t hash = dict_hash_key(d, ht->slots[i].key);
+        unsigned long g = (hash >> 7) & group_mask, probes = 1;
+        while (g != i / DICT_GROUP_WIDTH) {
+            g = (g + probes) & group_mask;
+            probes ++;
+        }
+        histogram[(probes < PROBE_HISTO_LEN) ? probes : (PROBE_HISTO_LEN - 1)] ++;
+        if (probes > max_probes) max_probes = probes;
+        total_probes += probes;
+    }
+
+    size_t l = 0;
+    l += snprintf(buf + l, buf_size - l,
+        "Hash table %d stats (%s, swiss): \n"
+        " table size: %lu \n"
+        " num of entries: %lu \n"
+        " num of tombstones: %lu \n"
+        " load factor: %.02f \n"
+        " max groups probed: %lu \n"
+        " avg groups probed: %.02f \n"
+        " Distribution of groups probed: \n",
+        table_id, (table_id == 0) ? "main hash table" : "rehashing table",
+        ht->size, ht->keys, ht->deleted, (float)ht->keys/ht->size,
+        max_probes, (float)total_probes/ht->keys);
+
+    for (int i = 1; i < PROBE_HISTO_LEN; i ++) {
+        if (l >= buf_size) break;
+        l += snprintf(buf + l, buf_size - l,
+            "  %s%d: %ld (%.02f%%) \n",
+            (i == PROBE_HISTO_LEN - 1) ? ">=" : "",
+            i, histogram[i], ((float)histogram[i]/ht->keys) * 100);
+    }
+
+    if (buf_size) buf[buf_size - 1] = '\0';
+    return strlen(buf);
+}
@@ -1,18 +1,86 @@
 /*
     ArenaDB dict implementation. 4-29 4-30
 */
+
+/*
+*   A dict stores its entries with one of two engines, picked by 'engine' of its dict_type:
+*    - DICT_ENGINE_CHAINED. Every slot of the hash table chains malloc()ed entries.
+*    - DICT_ENGINE_SWISS. Entries are stored inline in an open addressing table, probed by groups
+*      of control bytes with SIMD. See the SWISS ENGINE section below.
+*   Both engines share the dict API, the two hash tables, incremental rehashing and iterators.
+*
+*   Lookups, inserts and deletes hash and compare keys through the function pointers of dict_type,
+*   which the compiler can't inline. Their code is written once as always inline templates taking
+*   the hash and compare functions as parameters. The generic API passes dict_type's, while
+*   DICT_DEFINE_SPECIALIZED() stamps out variants calling known functions directly, so that key
+*   compares are inlined in probe loops. See the SPECIALIZED DICTS section below.
+*/
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <stdint.h>
 #include <unistd.h>
 #include <limits.h>
+#if defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
 #include "config.h"
 #include "dict.h"
 #include "sds.h"
 #include "util.h"
 #include "debug.h"
 #include "log.h"
+#include "slab.h"
+#include "zmalloc.h"
+
+// Entry of DICT_ENGINE_CHAINED for types with 'store_hash'. The hash follows the entry.
+typedef struct dict_hashed_entry {
+    dict_entry de;
+    uint64_t hash;
+} dict_hashed_entry;
+
+// Size of entries allocated one by one, that is, entries of DICT_ENGINE_CHAINED and unlinked entries
+#define _dict_entry_size(d) (((d)->type->store_hash && (d)->type->engine == DICT_ENGINE_CHAINED) ? \
+    sizeof(dict_hashed_entry) : sizeof(dict_entry))
+// Entries of DICT_ENGINE_CHAINED for types with 'embed_key_len' may hold their key right after the
+// entry (and its hash), as an sds string. See _dict_new_entry()
+#define _dict_embedded_key_hdr_size(len) ((len) < (1 << 5) ? sizeof(sds_hdr_5) : sizeof(sds_hdr_8))
+// Link entry 'de' to '_next_', keeping the DICT_ENTRY_KEY_EMBEDDED bit of 'de'
+#define _dict_set_next(de, _next_) ((de)->next = (dict_entry *)((uintptr_t)(_next_) | \
+    ((uintptr_t)(de)->next & DICT_ENTRY_KEY_EMBEDDED)))
+// Are hashes stored with entries? DICT_ENGINE_SWISS always stores them in the room of 'next'
+#define _dict_has_stored_hash(d) ((d)->type->store_hash || (d)->type->engine == DICT_ENGINE_SWISS)
+// Stored hash of entry 'de'
+#define _dict_entry_hash(d, de) (((d)->type->engine == DICT_ENGINE_SWISS) ? \
+    (de)->hash : ((dict_hashed_entry *)(de))->hash)
+// Hash of the key of entry 'de'. The stored hash is used if any
+#define _dict_entry_key_hash(d, de) (_dict_has_stored_hash(d) ? \
+    _dict_entry_hash(d, de) : dict_hash_key(d, (de)->key))
+// Does entry 'de' hold 'key' with 'hash'? Stored hashes are compared first to not touch keys.
+// Keys are compared by 'cmp', a _dict_compare_proc
+#define _dict_entry_match(d, de, _key_, hash, cmp) ((de)->key == (_key_) || \
+    ((!_dict_has_stored_hash(d) || _dict_entry_hash(d, de) == (hash)) && \
+    cmp(d, _key_, (de)->key)))
+
+// Templates are inlined into each caller, where their hash and compare functions are known
+#define _DICT_TEMPLATE static inline __attribute__((always_inline))
+
+// Hash and compare functions given to templates. They take the dict, so that the generic ones
+// can go through its dict_type. Specialized ones ignore it
+typedef uint64_t _dict_hash_proc(dict *d, const void *key);
+typedef int _dict_compare_proc(dict *d, const void *key1, const void *key2);
+
+static inline uint64_t _dict_type_hash(dict *d, const void *key)
+{
+    return dict_hash_key(d, key);
+}
+
+static inline int _dict_type_compare(dict *d, const void *key1, const void *key2)
+{
+    return dict_compare_key(d, key1, key2);
+}
 
 // Hash seed for dict hash function.
 // Initialized when server starts. Never modify it during server running.
@@ -38,9 +106,36 @@ static int dict_force_resize_ratio = 5;
 static void _dict_ht_reset(dict_ht *ht);
 static int _dict_ht_clear(dict *d, dict_ht *ht, void (callback)(void));
 static unsigned long _dict_next_power(unsigned long size);
+static int _dict_swiss_resize_to(dict *d, unsigned long new_size);
+static int _dict_swiss_rehash(dict *d, int n);
+_DICT_TEMPLATE dict_entry *_dict_accommodate_key(dict *d, void *key, dict_entry **existing_entry, int embed,
+    _dict_hash_proc *hash_fn, _dict_compare_proc *cmp);
+_DICT_TEMPLATE int _dict_add_entry(dict *d, void *key, void *val, _dict_hash_proc *hash_fn, _dict_compare_proc *cmp);
+_DICT_TEMPLATE dict_entry *_dict_find(dict *d, const void *key, _dict_hash_proc *hash_fn, _dict_compare_proc *cmp);
+_DICT_TEMPLATE size_t _dict_find_batch(dict *d, void * const *keys, size_t n, dict_entry **out,
+    _dict_hash_proc *hash_fn, _dict_compare_proc *cmp);
+_DICT_TEMPLATE int _dict_delete(dict *d, const void *key, _dict_hash_proc *hash_fn, _dict_compare_proc *cmp);
+_DICT_TEMPLATE dict_entry *_dict_unlink(dict *d, const void *key, _dict_hash_proc *hash_fn, _dict_compare_proc *cmp);
+_DICT_TEMPLATE long _dict_swiss_lookup(dict *d, dict_ht *ht, const void *key, uint64_t hash, _dict_compare_proc *cmp);
+_DICT_TEMPLATE dict_entry *_dict_swiss_accommodate_key(dict *d, void *key, dict_entry **existing_entry,
+    _dict_hash_proc *hash_fn, _dict_compare_proc *cmp);
+_DICT_TEMPLATE dict_entry *_dict_swiss_find(dict *d, const void *key, uint64_t hash, _dict_compare_proc *cmp);
+_DICT_TEMPLATE dict_entry *_dict_find_by_hash(dict *d, const void *key, uint64_t hash, _dict_compare_proc *cmp);
+static unsigned long _dict_swiss_home_group(dict_ht *ht, uint64_t hash);
+static dict_entry *_dict_swiss_candidate(dict_ht *ht, uint64_t hash);
+_DICT_TEMPLATE dict_entry *_dict_swiss_generic_delete(dict *d, const void *key, int do_free,
+    _dict_hash_proc *hash_fn, _dict_compare_proc *cmp);
+static void _dict_swiss_ht_clear(dict *d, dict_ht *ht, void (callback)(void));
+static dict_entry *_dict_swiss_next(dict_iterator *iter);
+static void _dict_swiss_scan_group(dict *d, dict_ht *ht, unsigned long g, dict_scan_proc *fn, void *privdata);
+static void _dict_iterator_start(dict_iterator *iter);
+static dict_entry *_dict_new_entry(dict *d, uint64_t hash, const void *key);
+static int _dict_key_is_embedded(dict *d, dict_entry *de);
+static void _dict_free_entry(dict *d, dict_entry *de);
 static void _dict_rehash_1_step(dict *d);
 static int _dict_expand_if_needed(dict *d);
-static dict_entry *dict_generic_delete(dict *d, const void *key, int do_free);
+_DICT_TEMPLATE dict_entry *_dict_generic_delete(dict *d, const void *key, int do_free,
+    _dict_hash_proc *hash_fn, _dict_compare_proc *cmp);
 static int _dict_ht_clear(dict *d, dict_ht *ht, void (callback)(void));
 
 // Reset a dict hast table 'ht'.
@@ -50,6 +145,9 @@ static void _dict_ht_reset(dict_ht *ht)
     ht->size = 0;
     ht->size_mask = 0;
     ht->keys = 0;
+    ht->ctrl = NULL;
+    ht->slots = NULL;
+    ht->deleted = 0;
 }
 
 // Return next power of 2 that is just greater than 'size'
@@ -69,7 +167,7 @@ dict *dict_create(dict_type *type)
 {
     server_assert(type != NULL);
 
-    dict *d = malloc(sizeof(dict)); // malloc alwasy succeed
+    dict *d = zmalloc(sizeof(dict)); // zmalloc never fails
     _dict_ht_reset(&d->ht[0]);
     _dict_ht_reset(&d->ht[1]);
     d->type = type;
@@ -85,6 +183,7 @@ int dict_resize_to(dict *d, unsigned long new_size)
     // Cannot resize if rehashing
     if (dict_is_rehashing(d)) // TODO 'd->ht[0].used >= new_size' is OK I think
         return DICT_ERR;
+    if (d->type->engine == DICT_ENGINE_SWISS) return _dict_swiss_resize_to(d, new_size);
 
     unsigned long ht_size = _dict_next_power(new_size);
     // No need to resize to the original size
@@ -92,10 +191,10 @@ int dict_resize_to(dict *d, unsigned long new_size)
 
     // Alloc new hash table
     dict_ht ht;
-    ht.table = calloc(ht_size, sizeof(dict_entry*)); // Calloc to set table entries to zero (NULL)
+    _dict_ht_reset(&ht);
+    ht.table = zcalloc(ht_size, sizeof(dict_entry*)); // Calloc to set table entries to zero (NULL)
     ht.size = ht_size;
     ht.size_mask = ht_size - 1;
-    ht.keys = 0;
     // If this is the first allocation, just set the first hast table
     if (d->ht[0].table == NULL) {
         d->ht[0] = ht;
@@ -121,6 +220,7 @@ static void _dict_rehash_1_step(dict *d)
 // Return 1 if there are still keys to remove(rehash), otherwise 0.
 int dict_rehash(dict *d, int n)
 {
+    if (d->type->engine == DICT_ENGINE_SWISS) return _dict_swiss_rehash(d, n);
     int max_empty_slot = n * 10; // Max allowable empty slot to visit
     if (!dict_is_rehashing(d)) return 0;
 
@@ -134,10 +234,10 @@ int dict_rehash(dict *d, int n)
         }
         // Now remove all keys in the slot from ht[0] to ht[1]
         while(de) {
-            de_next = de->next;
+            de_next = dict_get_next(de);
 
-            unsigned long idx = dict_hash_key(d, de->key) & d->ht[1].size_mask;
-            de->next = d->ht[1].table[idx];
+            unsigned long idx = _dict_entry_key_hash(d, de) & d->ht[1].size_mask;
+            _dict_set_next(de, d->ht[1].table[idx]);
             d->ht[1].table[idx] = de;
             de = de_next;
             // update metadata for both hash tables
@@ -149,7 +249,7 @@ int dict_rehash(dict *d, int n)
     }
     // Check whether all keys in ht[0] have been rehashed. If so, swap the two tables
     if (d->ht[0].keys == 0) {
-        free(d->ht[0].table);
+        zfree(d->ht[0].table);
         d->ht[0] = d->ht[1];
         _dict_ht_reset(&d->ht[1]);
         d->rehash_idx = -1; // rehashing ended
@@ -159,6 +259,74 @@ int dict_rehash(dict *d, int n)
     return 1;
 }
 
+// Rehash dict 'd' in steps of 100 for about 'us' microseconds. Return number of steps done.
+// Nothing is done if safe iterators are bound to the dict.
+int dict_rehash_microseconds(dict *d, long long us)
+{
+    if (d->num_safe_iterators > 0) return 0;
+
+    long long start = util_get_time_in_microsecond();
+    int steps = 0;
+    while (dict_rehash(d, 100)) {
+        steps += 100;
+        if (util_get_time_in_microsecond() - start >= us) break;
+    }
+    return steps;
+}
+
+// Rehash dict 'd' for about 'ms' milliseconds. Return number of steps done.
+int dict_rehash_milliseconds(dict *d, int ms)
+{
+    return dict_rehash_microseconds(d, (long long)ms * 1000);
+}
+
+// Alloc a new entry of DICT_ENGINE_CHAINED for a key with 'hash'.
+static dict_entry *_dict_new_entry(dict *d, uint64_t hash, const void *key)
+{
+    size_t size = _dict_entry_size(d), len = 0;
+    dict_entry *de;
+
+    // Embed 'key' if it is short enough, so the entry and the key take one allocation and lookups
+    // find the key on the cache line of the entry. The key is left NULL otherwise
+    if (key && d->type->embed_key_len && (len = sds_len((const sds)key)) <= (size_t)d->type->embed_key_len) {
+        size_t hdr_size = _dict_embedded_key_hdr_size(len);
+        de = slab_alloc(size + hdr_size + len + 1);
+        char *p = (char *)de + size + hdr_size;
+        memcpy(p, key, len);
+        de->key = sds_new_in_place(p, hdr_size, len);
+        de->next = (dict_entry *)DICT_ENTRY_KEY_EMBEDDED;
+    } else {
+        de = slab_alloc(size);
+        de->key = NULL;
+        de->next = NULL;
+    }
+    if (d->type->store_hash) ((dict_hashed_entry *)de)->hash = hash;
+    return de;
+}
+
+// Is the key of entry 'de' embedded in it? See _dict_new_entry()
+static int _dict_key_is_embedded(dict *d, dict_entry *de)
+{
+    if (d->type->engine != DICT_ENGINE_CHAINED) return 0; // 'next' is the hash otherwise
+
+    return ((uintptr_t)de->next & DICT_ENTRY_KEY_EMBEDDED) != 0;
+}
+
+// Free entry 'de' allocated one by one, with its key and value
+static void _dict_free_entry(dict *d, dict_entry *de)
+{
+    size_t size = _dict_entry_size(d);
+
+    if (_dict_key_is_embedded(d, de)) {
+        size_t len = sds_len(de->key);
+        size += _dict_embedded_key_hdr_size(len) + len + 1;
+    } else {
+        dict_free_key(d, de);
+    }
+    dict_free_val(d, de);
+    slab_free(de, size);
+}
+
 // Expand hash table if neeed.
 // Called before adding new entries to table.
 static int _dict_expand_if_needed(dict *d)
@@ -175,31 +343,55 @@ static int _dict_expand_if_needed(dict *d)
     return DICT_OK;
 }
 
+// Shrink the hash table of dict 'd' to fit its keys if they fill less than DICT_HT_MIN_FILL percent
+// of it, and begin incremental rehashing, so that memory and iteration follow the keys after mass
+// deletion. Called after deletes, and periodically by the server for dicts that were not shrunk
+// then, e.g. while resizing was disabled. Return DICT_OK if shrinking begins.
+int dict_shrink_if_needed(dict *d)
+{
+    unsigned long min_size = (d->type->engine == DICT_ENGINE_SWISS) ? DICT_GROUP_WIDTH : DICT_HT_INITIAL_SIZE;
+
+    if (!dict_can_resize || dict_is_rehashing(d)) return DICT_ERR;
+    if (d->ht[0].size <= min_size || d->ht[0].keys * 100 / d->ht[0].size >= DICT_HT_MIN_FILL) return DICT_ERR;
+    return dict_resize_to(d, d->ht[0].keys);
+}
+
 // Provide a dict_entry to accommdate 'key'.
 // If 'key' is not in the dict, the function return a new dict_entry to accommdate 'key'.
 // If 'key' is in the dict, the function returns NULL and the entry that holds 'key' is
 // returned through 'existing_entry'.
 dict_entry *dict_accommodate_key(dict *d, void *key, dict_entry **existing_entry)
 {
+    return _dict_accommodate_key(d, key, existing_entry, 0, _dict_type_hash, _dict_type_compare);
+}
+
+// Template of dict_accommodate_key(). If 'embed', 'key' may be copied into the new entry, which
+// is then returned with its key set. See _dict_new_entry()
+_DICT_TEMPLATE dict_entry *_dict_accommodate_key(dict *d, void *key, dict_entry **existing_entry, int embed,
+    _dict_hash_proc *hash_fn, _dict_compare_proc *cmp)
+{
+    if (d->type->engine == DICT_ENGINE_SWISS) {
+        return _dict_swiss_accommodate_key(d, key, existing_entry, hash_fn, cmp);
+    }
     if (dict_is_rehashing(d)) _dict_rehash_1_step(d);
 
     _dict_expand_if_needed(d);
 
     // Fist scan the slot in ht[0]
-    unsigned long hash = dict_hash_key(d, key);
+    unsigned long hash = hash_fn(d, key);
     unsigned long idx = hash & d->ht[0].size_mask;
 
     dict_entry *de = d->ht[0].table[idx];
     while(de) {
-        if (key == de->key || dict_compare_key(d, key, de->key)) { // If match, always return
+        if (_dict_entry_match(d, de, key, hash, cmp)) { // If match, always return
             if (existing_entry) *existing_entry = de;
             return NULL;
         }
-        de = de->next;
+        de = dict_get_next(de);
     }
     if (!dict_is_rehashing(d)) { // If not rehashing, create a new entry in ht[0] and return it
-        de = malloc(sizeof(dict_entry));
-        de->next = d->ht[0].table[idx];
+        de = _dict_new_entry(d, hash, embed ? key : NULL);
+        _dict_set_next(de, d->ht[0].table[idx]);
         d->ht[0].table[idx] = de;
         d->ht[0].keys ++;
         return de;
@@ -208,15 +400,15 @@ dict_entry *dict_accommodate_key(dict *d, void *key, dict_entry **existing_entry
     idx = hash & d->ht[1].size_mask;
     de = d->ht[1].table[idx];
     while(de) {
-        if (key == de->key || dict_compare_key(d, key, de->key)) {
+        if (_dict_entry_match(d, de, key, hash, cmp)) {
             if (existing_entry) *existing_entry = de;
             return NULL;
         }
-        de = de->next;
+        de = dict_get_next(de);
     }
     // If not found in ht[1], always create a new entry, insert it to ht[1] and return it.
-    de = malloc(sizeof(dict_entry));
-    de->next = d->ht[1].table[idx];
+    de = _dict_new_entry(d, hash, embed ? key : NULL);
+    _dict_set_next(de, d->ht[1].table[idx]);
     d->ht[1].table[idx] = de;
     d->ht[1].keys ++;
     return de;
@@ -225,11 +417,21 @@ dict_entry *dict_accommodate_key(dict *d, void *key, dict_entry **existing_entry
 // Add an entry to dict 'd'.
 int dict_add_entry(dict *d, void *key, void *val)
 {
-    dict_entry * new_entry = dict_accommodate_key(d, key, NULL);
+    return _dict_add_entry(d, key, val, _dict_type_hash, _dict_type_compare);
+}
+
+// Template of dict_add_entry()
+_DICT_TEMPLATE int _dict_add_entry(dict *d, void *key, void *val, _dict_hash_proc *hash_fn, _dict_compare_proc *cmp)
+{
+    dict_entry * new_entry = _dict_accommodate_key(d, key, NULL, 1, hash_fn, cmp);
 
     if (!new_entry) return DICT_ERR;
 
-    dict_set_key(d, new_entry, key);
+    if (!_dict_key_is_embedded(d, new_entry)) {
+        dict_set_key(d, new_entry, key);
+    } else if (!d->type->key_dup_func && d->type->key_destructor_func) {
+        d->type->key_destructor_func(key); // The entry has its own copy of the handed over key
+    }
     dict_set_val(d, new_entry, val);
 
     return DICT_OK;
@@ -265,38 +467,151 @@ void *dict_fetch_value(dict *d, const void *key)
 
 // Find the entry with 'key' in dict 'd'.
 dict_entry *dict_find(dict *d, const void *key)
+{
+    return _dict_find(d, key, _dict_type_hash, _dict_type_compare);
+}
+
+// Template of dict_find()
+_DICT_TEMPLATE dict_entry *_dict_find(dict *d, const void *key, _dict_hash_proc *hash_fn, _dict_compare_proc *cmp)
 {
     if (d->ht[0].keys + d->ht[1].keys == 0) return NULL;    // dict is empty
     if (dict_is_rehashing(d)) _dict_rehash_1_step(d);        // rehash if dict is rehashing and there are keys in dict
 
-    unsigned long idx, hash = dict_hash_key(d, key);
+    return _dict_find_by_hash(d, key, hash_fn(d, key), cmp);
+}
 
+// Find the entry with 'key' whose hash is 'hash' in dict 'd', without rehashing.
+_DICT_TEMPLATE dict_entry *_dict_find_by_hash(dict *d, const void *key, uint64_t hash, _dict_compare_proc *cmp)
+{
+    if (d->type->engine == DICT_ENGINE_SWISS) return _dict_swiss_find(d, key, hash, cmp);
+    unsigned long idx;
 
     for(int table = 0; table <= 1; table ++) {
         idx = hash & d->ht[table].size_mask;
         //printf("dict_find(): table:%d, hash:%lu, idx:%lu, key:%s \n", table, hash, idx, (char*)key); //TODO printf
         dict_entry *de = d->ht[table].table[idx];
         while (de) {
-            if (de->key == key || dict_compare_key(d, de->key, key)) {
+            if (_dict_entry_match(d, de, key, hash, cmp)) {
                 return de;
             }
-            de = de->next;
+            de = dict_get_next(de);
         }
         if (!dict_is_rehashing(d)) return NULL;
     }
     return NULL;
 }
 
+// Keys looked up together by dict_find_batch(). Enough to cover the memory latency, few enough
+// for their cache lines to stay in L1
+#define DICT_FIND_BATCH 16
+
+// Return the table of dict 'd' to prefetch for a key with 'hash'. While rehashing, a key whose
+// bucket in ht[0] is already rehashed is likely in ht[1].
+static dict_ht *_dict_batch_table(dict *d, uint64_t hash)
+{
+    if (!dict_is_rehashing(d)) return &d->ht[0];
+
+    unsigned long idx = (d->type->engine == DICT_ENGINE_SWISS) ?
+        _dict_swiss_home_group(&d->ht[0], hash) : hash & d->ht[0].size_mask;
+    return (idx < (unsigned long)d->rehash_idx) ? &d->ht[1] : &d->ht[0];
+}
+
+// Return the first entry of 'ht' that may hold a key with 'hash'. That is the head of its slot,
+// or the first slot of its home group with a matching h2 for DICT_ENGINE_SWISS.
+static dict_entry *_dict_batch_candidate(dict *d, dict_ht *ht, uint64_t hash)
+{
+    if (d->type->engine == DICT_ENGINE_SWISS) return _dict_swiss_candidate(ht, hash);
+    return ht->table[hash & ht->size_mask];
+}
+
+// Find the entries of 'n' keys in dict 'd' at once. Store the entry of keys[i] in out[i], or
+// NULL if not found. Return the number of keys found.
+//
+// A lookup of dict_find() waits for cache misses one after another: the bucket, the entry, then
+// the key. Here keys go through these steps in batches, prefetching for all keys of the batch at
+// each step, so the misses of a batch overlap:
+//  1. Hash all keys and prefetch their buckets.
+//  2. Prefetch the first entry in each bucket.
+//  3. Prefetch the key of each entry, unless its stored hash doesn't match.
+//  4. Look up the keys as dict_find() does, mostly from the cache now.
+size_t dict_find_batch(dict *d, void * const *keys, size_t n, dict_entry **out)
+{
+    return _dict_find_batch(d, keys, n, out, _dict_type_hash, _dict_type_compare);
+}
+
+// Template of dict_find_batch()
+_DICT_TEMPLATE size_t _dict_find_batch(dict *d, void * const *keys, size_t n, dict_entry **out,
+    _dict_hash_proc *hash_fn, _dict_compare_proc *cmp)
+{
+    uint64_t hashes[DICT_FIND_BATCH];
+    dict_ht *tables[DICT_FIND_BATCH];
+    dict_entry *entries[DICT_FIND_BATCH];
+    size_t found = 0;
+
+    if (d->ht[0].keys + d->ht[1].keys == 0) {
+        memset(out, 0, sizeof(dict_entry *) * n);
+        return 0;
+    }
+    if (dict_is_rehashing(d)) _dict_rehash_1_step(d);
+    int swiss = (d->type->engine == DICT_ENGINE_SWISS);
+
+    for (size_t base = 0; base < n; base += DICT_FIND_BATCH) {
+        size_t m = (n - base < DICT_FIND_BATCH) ? n - base : DICT_FIND_BATCH;
+        void * const *k = keys + base;
+
+        for (size_t i = 0; i < m; i ++) {
+            hashes[i] = hash_fn(d, k[i]);
+            dict_ht *ht = tables[i] = _dict_batch_table(d, hashes[i]);
+            if (swiss) {
+                __builtin_prefetch(ht->ctrl + _dict_swiss_home_group(ht, hashes[i]) * DICT_GROUP_WIDTH);
+            } else {
+                __builtin_prefetch(&ht->table[hashes[i] & ht->size_mask]);
+            }
+        }
+        for (size_t i = 0; i < m; i ++) {
+            entries[i] = _dict_batch_candidate(d, tables[i], hashes[i]);
+            if (entries[i]) __builtin_prefetch(entries[i]);
+        }
+        for (size_t i = 0; i < m; i ++) {
+            dict_entry *de = entries[i];
+            if (de && (!_dict_has_stored_hash(d) || _dict_entry_hash(d, de) == hashes[i])) {
+                __builtin_prefetch(de->key);
+            }
+        }
+        for (size_t i = 0; i < m; i ++) {
+            out[base + i] = _dict_find_by_hash(d, k[i], hashes[i], cmp);
+            if (out[base + i]) found ++;
+        }
+    }
+    return found;
+}
+
 // Delete the entry with 'key' from dict 'd'. Return DICT_OK if deteled, otherwise DICT_ERR.
 int dict_delete(dict *d, const void *key)
 {
-    return dict_generic_delete(d, key, 1) ? DICT_OK : DICT_ERR;
+    return _dict_delete(d, key, _dict_type_hash, _dict_type_compare);
+}
+
+// Template of dict_delete()
+_DICT_TEMPLATE int _dict_delete(dict *d, const void *key, _dict_hash_proc *hash_fn, _dict_compare_proc *cmp)
+{
+    if (_dict_generic_delete(d, key, 1, hash_fn, cmp) == NULL) return DICT_ERR;
+    dict_shrink_if_needed(d);
+    return DICT_OK;
 }
 
 // Unlink the entry with 'key' from dict 'd'. The returned entry may be freed later.
 dict_entry * dict_unlink(dict *d, const void *key)
 {
-    return dict_generic_delete(d, key, 0);
+    return _dict_unlink(d, key, _dict_type_hash, _dict_type_compare);
+}
+
+// Template of dict_unlink()
+_DICT_TEMPLATE dict_entry *_dict_unlink(dict *d, const void *key, _dict_hash_proc *hash_fn, _dict_compare_proc *cmp)
+{
+    dict_entry *de = _dict_generic_delete(d, key, 0, hash_fn, cmp);
+    if (de) dict_shrink_if_needed(d);
+    return de;
 }
 
 // Free the entry 'de' that is unlinked from dict 'd'.
@@ -304,48 +619,44 @@ int dict_free_unlinked_entry(dict *d, dict_entry *de)
 {
     if (de == NULL) return DICT_ERR;
 
-    dict_free_key(d, de);
-    dict_free_val(d, de);
-    printf("de addr: 0x%lx \n", (unsigned long)de);
-    fflush(stdout);
-    free(de);
+    _dict_free_entry(d, de);
 
     return DICT_OK;
 }
 
 // Generic delele helper function for dict_delete() and dict_unlink().
 // It searches and removes an entry from the dict 'd'.
-static dict_entry *dict_generic_delete(dict *d, const void *key, int do_free)
+_DICT_TEMPLATE dict_entry *_dict_generic_delete(dict *d, const void *key, int do_free,
+    _dict_hash_proc *hash_fn, _dict_compare_proc *cmp)
 {
+    if (d->type->engine == DICT_ENGINE_SWISS) return _dict_swiss_generic_delete(d, key, do_free, hash_fn, cmp);
     if (d->ht[0].keys == 0 && d->ht[1].keys == 0) return NULL;
     if (dict_is_rehashing(d)) _dict_rehash_1_step(d); // Perform 1 step rehashing if there are entries and the dict is rehashing.
 
-    unsigned long idx, hash = dict_hash_key(d, key);
+    unsigned long idx, hash = hash_fn(d, key);
     dict_entry *de, *prev_de;
     for (int table = 0; table <= 1; table ++) {
         idx = hash & d->ht[table].size_mask;
         de = d->ht[table].table[idx];
         prev_de = NULL;
         while(de){
-            if (de->key == key || dict_compare_key(d, de->key, key)) {
+            if (_dict_entry_match(d, de, key, hash, cmp)) {
                 // Unlink the entry from the entry chain in this slot
                 if (prev_de) {
-                    prev_de->next = de->next;
+                    _dict_set_next(prev_de, dict_get_next(de));
                 } else {
-                    d->ht[table].table[idx] = de->next;
+                    d->ht[table].table[idx] = dict_get_next(de);
                 }
                 // Free if 'free' is true
                 if (do_free) {
-                    dict_free_key(d, de);
-                    dict_free_val(d, de);
-                    free(de);
+                    _dict_free_entry(d, de);
                 }
                 d->ht[table].keys --;
                 return de;
             }
 
             prev_de = de;
-            de = de->next;
+            de = dict_get_next(de);
         }
         if (!dict_is_rehashing(d)) break;
     }
@@ -357,12 +668,16 @@ void dict_release(dict *d)
 {
     _dict_ht_clear(d, &d->ht[0], NULL);
     _dict_ht_clear(d, &d->ht[1], NULL);
-    free(d);
+    zfree(d);
 }
 
 // Clear(release) an entire hast table and its entries
 static int _dict_ht_clear(dict *d, dict_ht *ht, void (callback)(void))
 {
+    if (d->type->engine == DICT_ENGINE_SWISS) {
+        _dict_swiss_ht_clear(d, ht, callback);
+        return DICT_OK;
+    }
     if (ht->table == NULL) return DICT_OK;
 
     for (unsigned long i = 0; i < ht->size && ht->keys > 0; i ++) {
@@ -372,18 +687,16 @@ static int _dict_ht_clear(dict *d, dict_ht *ht, void (callback)(void))
 
         if ((de = ht->table[i]) == NULL) continue;
         while (de) {
-            next_de = de->next;
+            next_de = dict_get_next(de);
             // free current entry
-            dict_free_key(d, de);
-            dict_free_val(d, de);
-            free(de);
+            _dict_free_entry(d, de);
 
             de = next_de;
             ht->keys --;
         }
     }
     server_assert(ht->keys == 0); // Now there should be no keys in the hash table
-    free(ht->table);
+    zfree(ht->table);
     _dict_ht_reset(ht);
     return DICT_OK; // Never fails
 }
@@ -393,10 +706,10 @@ long long dict_fingerprint(dict *d)
 {
     long long integers[6], hash = 0;
 
-    integers[0] = (long)d->ht[0].table;
+    integers[0] = (long)d->ht[0].table + (long)d->ht[0].ctrl;  // one of them is NULL
     integers[1] = d->ht[0].size;
     integers[2] = d->ht[0].keys;
-    integers[3] = (long)d->ht[1].table;
+    integers[3] = (long)d->ht[1].table + (long)d->ht[1].ctrl;
     integers[4] = d->ht[1].size;
     integers[5] = d->ht[1].keys;
     // I don' know this. It's Tomas Wang's 64 bit integer hash.
@@ -415,7 +728,7 @@ long long dict_fingerprint(dict *d)
 // Get a unsafe iterator for dict 'd'
 dict_iterator *dict_get_iterator(dict *d)
 {
-    dict_iterator *iter = malloc(sizeof(dict_iterator));
+    dict_iterator *iter = zmalloc(sizeof(dict_iterator));
 
     iter->d = d;
     iter->table = 0;
@@ -434,8 +747,20 @@ dict_iterator *dict_get_safe_iterator(dict *d)
     return iter;
 }
 
+// Called when dict_next() is first called on 'iter'. Pause rehashing for a safe iterator, or take
+// fingerprint of the dict for an unsafe iterator.
+static void _dict_iterator_start(dict_iterator *iter)
+{
+    if (iter->safe) {
+        iter->d->num_safe_iterators ++;
+    } else {
+        iter->fingerprint = dict_fingerprint(iter->d);
+    }
+}
+
 dict_entry *dict_next(dict_iterator *iter)
 {
+    if (iter->d->type->engine == DICT_ENGINE_SWISS) return _dict_swiss_next(iter);
     dict_entry *de = iter->entry;
 
     while (1)
@@ -443,13 +768,7 @@ dict_entry *dict_next(dict_iterator *iter)
         if (de == NULL) {
             dict_ht * ht = &iter->d->ht[iter->table];
             // dict_next first called ?
-            if (iter->index == -1 && iter->table == 0) {
-                if (iter->safe) {
-                    iter->d->num_safe_iterators ++;
-                } else {
-                    iter->fingerprint = dict_fingerprint(iter->d);
-                }
-            }
+            if (iter->index == -1 && iter->table == 0) _dict_iterator_start(iter);
             // No entry in current slot, iterate to the next slot
             iter->index ++;
 
@@ -466,7 +785,7 @@ dict_entry *dict_next(dict_iterator *iter)
             // Iterate from the begining of the next slot
             de = ht->table[iter->index];
         } else {
-            iter->entry = de->next;
+            iter->entry = dict_get_next(de);
             return de;
         }
     }
@@ -483,7 +802,7 @@ int dict_free_iterator(dict_iterator *iter)
             server_assert(iter->fingerprint == dict_fingerprint(iter->d));
         }
     }
-    free(iter);
+    zfree(iter);
     return DICT_OK;
 }
 
@@ -497,6 +816,625 @@ void dict_disable_resize()
     dict_can_resize = 0;
 }
 
+// Reverse bits of 'v'.
+static unsigned long _dict_rev_bits(unsigned long v)
+{
+    unsigned long s = CHAR_BIT * sizeof(v), mask = ~0UL;
+    while ((s >>= 1) > 0) {
+        mask ^= (mask << s);
+        v = ((v >> s) & mask) | ((v << s) & ~mask);
+    }
+    return v;
+}
+
+// Mask of the bucket index in 'ht'. Buckets of DICT_ENGINE_SWISS are the home groups of keys
+#define _dict_scan_mask(d, ht) (((d)->type->engine == DICT_ENGINE_SWISS) ? \
+    (ht)->size / DICT_GROUP_WIDTH - 1 : (ht)->size_mask)
+
+// Call 'fn' with every entry in bucket 'idx' of 'ht'.
+static void _dict_scan_bucket(dict *d, dict_ht *ht, unsigned long idx, dict_scan_proc *fn, void *privdata)
+{
+    if (d->type->engine == DICT_ENGINE_SWISS) {
+        _dict_swiss_scan_group(d, ht, idx, fn, privdata);
+        return;
+    }
+    for (dict_entry *de = ht->table[idx]; de; de = dict_get_next(de)) fn(privdata, de);
+}
+
+// Scan one bucket of dict 'd' at 'cursor', calling 'fn' with each of its entries, and return the
+// cursor to pass next time. Start with cursor 0. The scan is done when 0 is returned again.
+//
+// The cursor keeps no state in the dict, yet every key present from the beginning to the end of
+// the scan is returned, even if the dict is resized in between. Some keys may be returned more
+// than once. The trick is to increment the cursor with its bits reversed, so that the high bits
+// of the bucket index are visited first: a bucket of a table of size N is split into buckets of
+// a table of size 2N that share its low bits, which are all still to be visited, and buckets of
+// a smaller table merge buckets that are all visited. While rehashing, the bucket of the smaller
+// table is scanned along with all buckets of the larger table that it expands to.
+//
+// 'fn' must not modify the dict.
+unsigned long dict_scan(dict *d, unsigned long cursor, dict_scan_proc *fn, void *privdata)
+{
+    if (dict_keys(d) == 0) return 0;
+
+    dict_ht *t0 = &d->ht[0], *t1;
+    unsigned long m0, m1;
+
+    if (!dict_is_rehashing(d)) {
+        m0 = _dict_scan_mask(d, t0);
+        _dict_scan_bucket(d, t0, cursor & m0, fn, privdata);
+    } else {
+        // Make 't0' the smaller table
+        t1 = &d->ht[1];
+        if (t0->size > t1->size) {
+            t0 = &d->ht[1];
+            t1 = &d->ht[0];
+        }
+        m0 = _dict_scan_mask(d, t0);
+        m1 = _dict_scan_mask(d, t1);
+        _dict_scan_bucket(d, t0, cursor & m0, fn, privdata);
+
+        // Then the buckets of the larger table that the bucket expands to
+        do {
+            _dict_scan_bucket(d, t1, cursor & m1, fn, privdata);
+            cursor |= ~m1;
+            cursor = _dict_rev_bits(cursor);
+            cursor ++;
+            cursor = _dict_rev_bits(cursor);
+        } while (cursor & (m0 ^ m1));
+        return cursor;
+    }
+    // Increment the reversed cursor. Setting the unmasked bits makes the increment carry over them
+    cursor |= ~m0;
+    cursor = _dict_rev_bits(cursor);
+    cursor ++;
+    cursor = _dict_rev_bits(cursor);
+    return cursor;
+}
+
+// Return a random unsigned long. Each thread has its own xorshift generator, seeded on first use.
+static unsigned long _dict_random()
+{
+    static __thread uint64_t state = 0;
+    if (state == 0) {
+        util_get_random_bytes((unsigned char *)&state, sizeof(state));
+        state |= 1;
+    }
+    state ^= state >> 12;
+    state ^= state << 25;
+    state ^= state >> 27;
+    return state * 0x2545F4914F6CDD1DULL;
+}
+
+// Number of slots at the start of ht[0] that are already rehashed, thus empty, while rehashing
+#define _dict_rehashed_slots(d) (((d)->type->engine == DICT_ENGINE_SWISS) ? \
+    (unsigned long)(d)->rehash_idx * DICT_GROUP_WIDTH : (unsigned long)(d)->rehash_idx)
+
+// Return slot 'idx' of 'ht'. That is the chain of entries, or the entry if the slot is full for
+// DICT_ENGINE_SWISS, which has no next.
+#define _dict_slot(d, ht, idx) (((d)->type->engine == DICT_ENGINE_SWISS) ? \
+    (((ht)->ctrl[idx] >= 0) ? &(ht)->slots[idx] : NULL) : (ht)->table[idx])
+#define _dict_slot_next(d, de) (((d)->type->engine == DICT_ENGINE_SWISS) ? NULL : dict_get_next(de))
+
+// Return a random entry of dict 'd', or NULL if it's empty. A random non-empty slot is picked,
+// then a random entry in it, so keys in long chains are less likely to be returned than others.
+// See dict_get_fair_random_key(). Every key is equally likely with DICT_ENGINE_SWISS.
+dict_entry *dict_get_random_key(dict *d)
+{
+    dict_entry *de, *orig_de;
+    unsigned long idx, list_len;
+
+    if (dict_keys(d) == 0) return NULL;
+    if (dict_is_rehashing(d)) _dict_rehash_1_step(d);
+
+    if (dict_is_rehashing(d)) {
+        // Slots of ht[0] below the rehashing index are empty. Skip them
+        unsigned long skip = _dict_rehashed_slots(d);
+        do {
+            idx = skip + _dict_random() % (dict_size(d) - skip);
+            de = (idx >= d->ht[0].size) ? _dict_slot(d, &d->ht[1], idx - d->ht[0].size) :
+                _dict_slot(d, &d->ht[0], idx);
+        } while (de == NULL);
+    } else {
+        do {
+            idx = _dict_random() & d->ht[0].size_mask;
+            de = _dict_slot(d, &d->ht[0], idx);
+        } while (de == NULL);
+    }
+
+    // Pick a random entry in the chain
+    list_len = 0;
+    orig_de = de;
+    while (de) {
+        de = _dict_slot_next(d, de);
+        list_len ++;
+    }
+    de = orig_de;
+    for (idx = _dict_random() % list_len; idx > 0; idx --) de = _dict_slot_next(d, de);
+    return de;
+}
+
+// Sample up to 'count' entries of dict 'd' into 'des', and return the number sampled. Entries are
+// taken from contiguous slots at a random position, in both tables while rehashing, so sampling
+// is cheap but far from uniform. It's meant for picking candidates, e.g. of eviction. Long runs
+// of empty slots make it jump to another random position, and it gives up after 10 * 'count'
+// slots, so fewer entries than asked may be returned. The same entry may be returned twice if
+// the table is smaller than that.
+unsigned int dict_get_some_keys(dict *d, dict_entry **des, unsigned int count)
+{
+    unsigned int stored = 0;
+
+    if (dict_keys(d) < count) count = dict_keys(d);
+    if (count == 0) return 0;
+    unsigned long max_steps = count * 10;
+
+    // Rehash in proportion to 'count'
+    for (unsigned int j = 0; j < count && dict_is_rehashing(d); j ++) _dict_rehash_1_step(d);
+
+    int tables = dict_is_rehashing(d) ? 2 : 1;
+    unsigned long max_size_mask = d->ht[0].size_mask;
+    if (tables > 1 && max_size_mask < d->ht[1].size_mask) max_size_mask = d->ht[1].size_mask;
+
+    // Walk slots from a random position of the larger table
+    unsigned long i = _dict_random() & max_size_mask, empty_len = 0;
+    while (stored < count && max_steps --) {
+        for (int j = 0; j < tables; j ++) {
+            // Slots of ht[0] below the rehashing index are empty. If 'i' is beyond ht[1] too,
+            // which is smaller then, jump to the rehashing index
+            if (tables == 2 && j == 0 && i < _dict_rehashed_slots(d)) {
+                if (i >= d->ht[1].size) {
+                    i = _dict_rehashed_slots(d);
+                } else {
+                    continue;
+                }
+            }
+            if (i >= d->ht[j].size) continue;
+
+            dict_entry *de = _dict_slot(d, &d->ht[j], i);
+            if (de == NULL) {
+                // Too many empty slots in a row. Jump to another random position
+                if (++ empty_len >= 5 && empty_len > count) {
+                    i = _dict_random() & max_size_mask;
+                    empty_len = 0;
+                }
+                continue;
+            }
+            empty_len = 0;
+            while (de) {
+                des[stored ++] = de;
+                if (stored == count) return stored;
+                de = _dict_slot_next(d, de);
+            }
+        }
+        i = (i + 1) & max_size_mask;
+    }
+    return stored;
+}
+
+// Number of entries sampled by dict_get_fair_random_key()
+#define DICT_FAIR_SAMPLES   15
+
+// Return a random entry of dict 'd' like dict_get_random_key(), but with much less bias toward
+// keys in short chains. Whole chains are sampled by dict_get_some_keys(), and one of the entries
+// is picked at random, so a key in a long chain gets the chances of its whole chain.
+dict_entry *dict_get_fair_random_key(dict *d)
+{
+    dict_entry *entries[DICT_FAIR_SAMPLES];
+
+    if (d->type->engine == DICT_ENGINE_SWISS) return dict_get_random_key(d);  // already fair
+    unsigned int count = dict_get_some_keys(d, entries, DICT_FAIR_SAMPLES);
+    if (count == 0) return dict_get_random_key(d);
+    return entries[_dict_random() % count];
+}
+
+/*-------------------------------------SWISS ENGINE----------------------------------------------*/
+
+// Dicts of DICT_ENGINE_SWISS keep entries inline in the 'slots' of their hash tables, like the
+// Swiss tables of Abseil. Adding a key mallocs nothing and finding a key walks no chain. Each
+// slot has a control byte in 'ctrl': DICT_CTRL_EMPTY, DICT_CTRL_DELETED, or h2, the 7 low bits of
+// the hash of its key. The high bits of the hash (h1) pick the first group of DICT_GROUP_WIDTH
+// slots to probe, and further groups are probed triangularly. A whole group of control bytes is
+// matched against h2 with a few SIMD instructions, so keys are compared only on a h2 match, and
+// the probing stops at the first group with an empty slot. A table is filled up to 7/8 of its size.
+//
+// A slot is deleted as empty if its group has an empty slot, since no probe goes past the group
+// then. Otherwise it becomes a tombstone that probes go past but inserts can reuse. Resizing
+// (which also purges tombstones) is incremental as in the chained engine, a group per step.
+//
+// The hash of a key is kept in its entry, in the room of 'next', so that resizing doesn't hash
+// keys again and a h2 match is confirmed without touching the key.
+//
+// Entries returned by dict_find() and dict_accommodate_key() live in the table and are valid only
+// until the dict is modified. dict_unlink() returns a malloc()ed copy.
+
+#define DICT_GROUP_FULL_MASK    ((uint32_t)((1ULL << DICT_GROUP_WIDTH) - 1))
+#define _dict_h1(hash)          ((hash) >> 7)
+#define _dict_h2(hash)          ((int8_t)((hash) & 0x7f))
+#define _dict_swiss_max_load(size)  ((size) - (size) / 8)
+
+// Return a bit mask of the slots whose control bytes in 'group' are 'c'.
+static inline uint32_t _dict_group_match(const int8_t *group, int8_t c)
+{
+#if defined(__AVX2__)
+    __m256i ctrl = _mm256_load_si256((const __m256i *)group);
+    return (uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(ctrl, _mm256_set1_epi8(c)));
+#elif defined(__SSE2__)
+    __m128i ctrl = _mm_load_si128((const __m128i *)group);
+    return (uint32_t)_mm_movemask_epi8(_mm_cmpeq_epi8(ctrl, _mm_set1_epi8(c)));
+#else
+    uint32_t mask = 0;
+    for (int i = 0; i < DICT_GROUP_WIDTH; i ++) {
+        if (group[i] == c) mask |= 1u << i;
+    }
+    return mask;
+#endif
+}
+
+// Return a bit mask of the empty or deleted slots in 'group'. Only their control bytes are negative.
+static inline uint32_t _dict_group_match_free(const int8_t *group)
+{
+#if defined(__AVX2__)
+    return (uint32_t)_mm256_movemask_epi8(_mm256_load_si256((const __m256i *)group));
+#elif defined(__SSE2__)
+    return (uint32_t)_mm_movemask_epi8(_mm_load_si128((const __m128i *)group));
+#else
+    uint32_t mask = 0;
+    for (int i = 0; i < DICT_GROUP_WIDTH; i ++) {
+        if (group[i] < 0) mask |= 1u << i;
+    }
+    return mask;
+#endif
+}
+
+// Alloc hash table 'ht' with 'size' empty slots.
+static void _dict_swiss_ht_init(dict_ht *ht, unsigned long size)
+{
+    _dict_ht_reset(ht);
+    ht->ctrl = zaligned_alloc(DICT_GROUP_WIDTH, size);  // aligned for SIMD loads of groups
+    memset(ht->ctrl, DICT_CTRL_EMPTY, size);
+    ht->slots = zmalloc(sizeof(dict_entry) * size);
+    ht->size = size;
+    ht->size_mask = size - 1;
+}
+
+// Free hash table 'ht' without touching its entries.
+static void _dict_swiss_ht_free(dict_ht *ht)
+{
+    zfree(ht->ctrl);
+    zfree(ht->slots);
+    _dict_ht_reset(ht);
+}
+
+// Return index of the home group of 'hash' in 'ht', where probing starts.
+static unsigned long _dict_swiss_home_group(dict_ht *ht, uint64_t hash)
+{
+    return _dict_h1(hash) & (ht->size / DICT_GROUP_WIDTH - 1);
+}
+
+// Return the first slot in the home group of 'hash' in 'ht' with a matching h2, or NULL.
+static dict_entry *_dict_swiss_candidate(dict_ht *ht, uint64_t hash)
+{
+    unsigned long g = _dict_swiss_home_group(ht, hash);
+    uint32_t match = _dict_group_match(ht->ctrl + g * DICT_GROUP_WIDTH, _dict_h2(hash));
+    return match ? &ht->slots[g * DICT_GROUP_WIDTH + __builtin_ctz(match)] : NULL;
+}
+
+// Return index of the slot holding 'key' with 'hash' in 'ht', or -1 if not found.
+_DICT_TEMPLATE long _dict_swiss_lookup(dict *d, dict_ht *ht, const void *key, uint64_t hash, _dict_compare_proc *cmp)
+{
+    if (ht->keys == 0) return -1;
+
+    unsigned long group_mask = ht->size / DICT_GROUP_WIDTH - 1;
+    unsigned long g = _dict_h1(hash) & group_mask;
+    int8_t h2 = _dict_h2(hash);
+
+    for (unsigned long i = 1; i <= group_mask + 1; i ++) {
+        const int8_t *group = ht->ctrl + g * DICT_GROUP_WIDTH;
+        uint32_t match = _dict_group_match(group, h2);
+        while (match) {
+            unsigned long idx = g * DICT_GROUP_WIDTH + __builtin_ctz(match);
+            if (_dict_entry_match(d, &ht->slots[idx], key, hash, cmp)) return idx;
+            match &= match - 1;
+        }
+        if (_dict_group_match(group, DICT_CTRL_EMPTY)) return -1;  // Probing ends at an empty slot
+        g = (g + i) & group_mask;
+    }
+    return -1;
+}
+
+// Claim the first empty or deleted slot on the probe sequence of 'hash' in 'ht' for a new key
+// and return its index. The caller fills the entry in the slot.
+static unsigned long _dict_swiss_claim_slot(dict_ht *ht, uint64_t hash)
+{
+    unsigned long group_mask = ht->size / DICT_GROUP_WIDTH - 1;
+    unsigned long g = _dict_h1(hash) & group_mask;
+
+    for (unsigned long i = 1; ; i ++) {
+        uint32_t free_mask = _dict_group_match_free(ht->ctrl + g * DICT_GROUP_WIDTH);
+        if (free_mask) {
+            unsigned long idx = g * DICT_GROUP_WIDTH + __builtin_ctz(free_mask);
+            if (ht->ctrl[idx] == DICT_CTRL_DELETED) ht->deleted --;
+            ht->ctrl[idx] = _dict_h2(hash);
+            ht->keys ++;
+            return idx;
+        }
+        server_assert(i <= group_mask);   // There is always a free slot below the max load
+        g = (g + i) & group_mask;
+    }
+}
+
+// Mark slot 'idx' of 'ht' as free after its entry is removed.
+static void _dict_swiss_erase_slot(dict_ht *ht, unsigned long idx)
+{
+    const int8_t *group = ht->ctrl + (idx & ~(unsigned long)(DICT_GROUP_WIDTH - 1));
+    if (_dict_group_match(group, DICT_CTRL_EMPTY)) {
+        ht->ctrl[idx] = DICT_CTRL_EMPTY;
+    } else {
+        ht->ctrl[idx] = DICT_CTRL_DELETED;
+        ht->deleted ++;
+    }
+    ht->keys --;
+}
+
+// Resize dict 'd' to hold 'new_size' keys below the max load, and begin incremental rehashing.
+// Resizing to the current size is allowed to purge tombstones.
+static int _dict_swiss_resize_to(dict *d, unsigned long new_size)
+{
+    unsigned long ht_size = _dict_next_power(new_size);
+    if (ht_size < DICT_GROUP_WIDTH) ht_size = DICT_GROUP_WIDTH;
+    while (_dict_swiss_max_load(ht_size) < new_size) ht_size <<= 1;
+    // Keys can't exceed slots, unlike chained tables
+    if (_dict_swiss_max_load(ht_size) <= d->ht[0].keys) return DICT_ERR;
+    if (ht_size == d->ht[0].size && d->ht[0].deleted == 0) return DICT_ERR;
+
+    dict_ht ht;
+    _dict_swiss_ht_init(&ht, ht_size);
+    if (d->ht[0].size == 0) {
+        d->ht[0] = ht;
+        return DICT_OK;
+    }
+    d->ht[1] = ht;
+    d->rehash_idx = 0;
+    return DICT_OK;
+}
+
+// Perform N steps of incremental rehashing. Each step moves the keys of a group from ht[0] to
+// ht[1]. Moved slots become tombstones, so ht[0] is still probed right until it is freed.
+// Return 1 if there are still keys to move, otherwise 0.
+static int _dict_swiss_rehash(dict *d, int n)
+{
+    int max_empty_groups = n * 10;  // Max allowable empty groups to visit
+    if (!dict_is_rehashing(d)) return 0;
+
+    dict_ht *from = &d->ht[0], *to = &d->ht[1];
+    while (n -- && from->keys != 0) {
+        int8_t *group;
+        uint32_t full_mask;
+        // Find the first group with keys, or return if reach max allowable empty groups
+        while (1) {
+            server_assert(d->rehash_idx < (long)(from->size / DICT_GROUP_WIDTH));
+            group = from->ctrl + d->rehash_idx * DICT_GROUP_WIDTH;
+            full_mask = ~_dict_group_match_free(group) & DICT_GROUP_FULL_MASK;
+            if (full_mask) break;
+            d->rehash_idx ++;
+            if (--max_empty_groups == 0) return 1;
+        }
+        while (full_mask) {
+            int i = __builtin_ctz(full_mask);
+            dict_entry *de = &from->slots[d->rehash_idx * DICT_GROUP_WIDTH + i];
+            unsigned long idx = _dict_swiss_claim_slot(to, _dict_entry_key_hash(d, de));
+            to->slots[idx] = *de;
+            group[i] = DICT_CTRL_DELETED;
+            from->keys --;
+            full_mask &= full_mask - 1;
+        }
+        d->rehash_idx ++;
+    }
+    // All keys moved. Swap the two tables
+    if (from->keys == 0) {
+        _dict_swiss_ht_free(from);
+        *from = *to;
+        _dict_ht_reset(to);
+        d->rehash_idx = -1;
+        return 0;
+    }
+    return 1;
+}
+
+// Expand hash table if needed. Open addressing tables can't be overfilled, so they expand even
+// if resizing is disabled. Lots of tombstones are purged by resizing to the same size.
+static int _dict_swiss_expand_if_needed(dict *d)
+{
+    if (dict_is_rehashing(d)) return DICT_OK;
+    if (d->ht[0].size == 0) return dict_resize_to(d, DICT_HT_INITIAL_SIZE);
+    if (d->ht[0].keys + d->ht[0].deleted >= _dict_swiss_max_load(d->ht[0].size)) {
+        return dict_resize_to(d, d->ht[0].keys * 2);
+    }
+    return DICT_OK;
+}
+
+_DICT_TEMPLATE dict_entry *_dict_swiss_accommodate_key(dict *d, void *key, dict_entry **existing_entry,
+    _dict_hash_proc *hash_fn, _dict_compare_proc *cmp)
+{
+    if (dict_is_rehashing(d)) _dict_rehash_1_step(d);
+    _dict_swiss_expand_if_needed(d);
+    // Keys added while rehashing go to ht[1]. If it's full before rehashing ends, end it now
+    dict_ht *ht1 = &d->ht[1];
+    if (dict_is_rehashing(d) && d->num_safe_iterators == 0 &&
+        ht1->keys + ht1->deleted >= _dict_swiss_max_load(ht1->size)) {
+        while (dict_rehash(d, 100));
+        _dict_swiss_expand_if_needed(d);
+    }
+
+    uint64_t hash = hash_fn(d, key);
+    for (int table = 0; table <= 1; table ++) {
+        long idx = _dict_swiss_lookup(d, &d->ht[table], key, hash, cmp);
+        if (idx != -1) {
+            if (existing_entry) *existing_entry = &d->ht[table].slots[idx];
+            return NULL;
+        }
+        if (!dict_is_rehashing(d)) break;
+    }
+
+    dict_ht *ht = &d->ht[dict_is_rehashing(d) ? 1 : 0];
+    dict_entry *de = &ht->slots[_dict_swiss_claim_slot(ht, hash)];
+    de->hash = hash;
+    return de;
+}
+
+_DICT_TEMPLATE dict_entry *_dict_swiss_find(dict *d, const void *key, uint64_t hash, _dict_compare_proc *cmp)
+{
+    for (int table = 0; table <= 1; table ++) {
+        long idx = _dict_swiss_lookup(d, &d->ht[table], key, hash, cmp);
+        if (idx != -1) return &d->ht[table].slots[idx];
+        if (!dict_is_rehashing(d)) break;
+    }
+    return NULL;
+}
+
+_DICT_TEMPLATE dict_entry *_dict_swiss_generic_delete(dict *d, const void *key, int do_free,
+    _dict_hash_proc *hash_fn, _dict_compare_proc *cmp)
+{
+    if (d->ht[0].keys == 0 && d->ht[1].keys == 0) return NULL;
+    if (dict_is_rehashing(d)) _dict_rehash_1_step(d);
+
+    uint64_t hash = hash_fn(d, key);
+    for (int table = 0; table <= 1; table ++) {
+        dict_ht *ht = &d->ht[table];
+        long idx = _dict_swiss_lookup(d, ht, key, hash, cmp);
+        if (idx != -1) {
+            dict_entry *de = &ht->slots[idx];
+            if (do_free) {
+                dict_free_key(d, de);
+                dict_free_val(d, de);
+            } else {
+                // The slot may be reused soon. Hand out a copy that outlives it
+                dict_entry *copy = slab_alloc(sizeof(dict_entry));
+                *copy = *de;
+                de = copy;
+            }
+            _dict_swiss_erase_slot(ht, idx);
+            return de;
+        }
+        if (!dict_is_rehashing(d)) break;
+    }
+    return NULL;
+}
+
+static void _dict_swiss_ht_clear(dict *d, dict_ht *ht, void (callback)(void))
+{
+    if (ht->ctrl == NULL) return;
+
+    for (unsigned long i = 0; i < ht->size && ht->keys > 0; i ++) {
+        if (callback && (i & 65535) == 0) callback();
+        if (ht->ctrl[i] < 0) continue;
+        dict_free_key(d, &ht->slots[i]);
+        dict_free_val(d, &ht->slots[i]);
+        ht->keys --;
+    }
+    server_assert(ht->keys == 0);
+    _dict_swiss_ht_free(ht);
+}
+
+// Call 'fn' with every entry whose home group is 'g' in 'ht'. They are found on the probe sequence
+// of the group, which ends at the first group with an empty slot, as in _dict_swiss_lookup().
+static void _dict_swiss_scan_group(dict *d, dict_ht *ht, unsigned long g, dict_scan_proc *fn, void *privdata)
+{
+    if (ht->keys == 0) return;
+
+    unsigned long group_mask = ht->size / DICT_GROUP_WIDTH - 1, home = g;
+
+    for (unsigned long i = 1; i <= group_mask + 1; i ++) {
+        const int8_t *group = ht->ctrl + g * DICT_GROUP_WIDTH;
+        uint32_t full_mask = ~_dict_group_match_free(group) & DICT_GROUP_FULL_MASK;
+        while (full_mask) {
+            dict_entry *de = &ht->slots[g * DICT_GROUP_WIDTH + __builtin_ctz(full_mask)];
+            if ((_dict_h1(de->hash) & group_mask) == home) fn(privdata, de);
+            full_mask &= full_mask - 1;
+        }
+        if (_dict_group_match(group, DICT_CTRL_EMPTY)) return;
+        g = (g + i) & group_mask;
+    }
+}
+
+static dict_entry *_dict_swiss_next(dict_iterator *iter)
+{
+    while (1) {
+        dict_ht *ht = &iter->d->ht[iter->table];
+        if (iter->index == -1 && iter->table == 0) _dict_iterator_start(iter);
+        iter->index ++;
+
+        if (iter->index >= (long)ht->size) {
+            // No entry in first hash table, switch to the second if rehashing
+            if (dict_is_rehashing(iter->d) && iter->table == 0) {
+                iter->table = 1;
+                iter->index = -1;
+                continue;
+            }
+            return NULL;
+        }
+        if (ht->ctrl[iter->index] >= 0) return &ht->slots[iter->index];
+    }
+}
+
+/*-------------------------------------SPECIALIZED DICTS-------------------------------------*/
+
+// Stamp out the variants 'prefix'_find(), 'prefix'_fetch_value(), 'prefix'_find_batch(),
+// 'prefix'_add_entry(), 'prefix'_delete() and 'prefix'_unlink() of the dict API for dicts whose
+// type has 'hash_func' and 'compare_func'. They behave the same as the generic functions, but call
+// 'hash_func' and 'compare_func' directly, so the compiler inlines them if it can see them.
+// Use them only on dicts of a matching type, as the rest of the API still goes through dict_type.
+// Declare them with DICT_DECLARE_SPECIALIZED() in dict.h.
+#define DICT_DEFINE_SPECIALIZED(prefix, hash_func, compare_func) \
+static inline uint64_t _##prefix##_hash(dict *d, const void *key) \
+{ \
+    return hash_func(key); \
+} \
+static inline int _##prefix##_compare(dict *d, const void *key1, const void *key2) \
+{ \
+    return compare_func(key1, key2); \
+} \
+dict_entry *prefix##_find(dict *d, const void *key) \
+{ \
+    return _dict_find(d, key, _##prefix##_hash, _##prefix##_compare); \
+} \
+void *prefix##_fetch_value(dict *d, const void *key) \
+{ \
+    dict_entry *de = _dict_find(d, key, _##prefix##_hash, _##prefix##_compare); \
+    return de ? dict_get_val(de) : NULL; \
+} \
+size_t prefix##_find_batch(dict *d, void * const *keys, size_t n, dict_entry **out) \
+{ \
+    return _dict_find_batch(d, keys, n, out, _##prefix##_hash, _##prefix##_compare); \
+} \
+int prefix##_add_entry(dict *d, void *key, void *val) \
+{ \
+    return _dict_add_entry(d, key, val, _##prefix##_hash, _##prefix##_compare); \
+} \
+int prefix##_delete(dict *d, const void *key) \
+{ \
+    return _dict_delete(d, key, _##prefix##_hash, _##prefix##_compare); \
+} \
+dict_entry *prefix##_unlink(dict *d, const void *key) \
+{ \
+    return _dict_unlink(d, key, _##prefix##_hash, _##prefix##_compare); \
+}
+
+// Return 1 if sds keys 'key1' and 'key2' are the same. See dict_sample_compare_sds_key()
+static inline int _dict_sds_key_equal(const void *key1, const void *key2)
+{
+    size_t len = sds_len((const sds)key1);
+    if (len != sds_len((const sds)key2)) return 0;
+    return memcmp(key1, key2, len) == 0;
+}
+
+// Databases, with each hash their keys can be hashed by. See db.c
+DICT_DEFINE_SPECIALIZED(dict_sds_siphash, dict_sample_hash, _dict_sds_key_equal)
+DICT_DEFINE_SPECIALIZED(dict_sds_wyhash, dict_sample_wyhash, _dict_sds_key_equal)
+DICT_DEFINE_SPECIALIZED(dict_sds_crc32c, dict_sample_crc32c_hash, _dict_sds_key_equal)
+// The command table. See command.c
+DICT_DEFINE_SPECIALIZED(dict_cmd, dict_sample_case_hash, dict_sample_compare_sds_key_case)
+
 // Some sample helper functions for constructing dict_type, like test_dict_type, db_dict_type, etc.
 uint64_t dict_sample_hash(const void *key)
 {
@@ -506,14 +1444,27 @@ uint64_t dict_sample_case_hash(const void *key)
 {
     return siphash_nocase((const uint8_t*)key, sds_len((const sds)key), dict_hash_seed);
 }
+uint64_t dict_sample_wyhash(const void *key)
+{
+    return wyhash((const uint8_t*)key, sds_len((const sds)key), dict_hash_seed);
+}
+uint64_t dict_sample_crc32c_hash(const void *key)
+{
+    return crc32c_hash((const uint8_t*)key, sds_len((const sds)key), dict_hash_seed);
+}
+// Return the sample hash function of sds keys for 'hash', DICT_HASH_XXX.
+uint64_t (*dict_sample_hash_func(int hash))(const void *key)
+{
+    switch (hash) {
+    case DICT_HASH_WYHASH: return dict_sample_wyhash;
+    case DICT_HASH_CRC32C: return dict_sample_crc32c_hash;
+    default: return dict_sample_hash;
+    }
+}
 // Case sensitive care. Used in database for key-obj lookup. Return 1 if same, 0 otherwise
 int dict_sample_compare_sds_key(const void *key1, const void *key2)
 {
-    int len_1, len_2;
-    len_1 = sds_len((const sds)key1);
-    len_2 = sds_len((const sds)key2);
-    if (len_1 != len_2) return 0;
-    return memcmp(key1, key2, len_1) == 0;
+    return _dict_sds_key_equal(key1, key2);
 }
 // Case insensitive compare. Used in command table for fast command loopup. Note it's non binary-safe.
 int dict_sample_compare_sds_key_case(const void *key1, const void *key2)
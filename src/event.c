@@ -2,19 +2,1067 @@
     ArenaDB event loop implementation. 5.2
 */
 
+/*
+*   The event loop monitors registered file events (fds) and dispatches the fired ones
+*   to their ae_file_proc callbacks. The polling is done by a backend chosen when the loop is
+*   created, with its state hidden behind 'api_data':
+*    - epoll. The cost of every wakeup is proportional to the number of ready fds, not the
+*      number of monitored fds. But every change of monitored states costs an epoll_ctl().
+*    - io_uring. Besides telling when fds are ready, it does the I/O itself if the kernel is new
+*      enough: connections are accepted and data received into buffers of the loop by multishot
+*      requests, and sends are queued. Everything queued in an iteration is submitted in a batch
+*      together with the wait, by a single io_uring_enter(). See ae_get_io_ops(). If io_uring is
+*      not available, the loop falls back to epoll.
+*
+*   Time events are processed after file events in the same round. The poll blocks at most
+*   until the nearest time event is due, so timers fire even if no fd becomes ready.
+*/
+
 #include <stdlib.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include <string.h>
+#include <poll.h>
+#include <stdatomic.h>
+#include <sys/epoll.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
 #include "event.h"
+#include "zmalloc.h"
+#include "debug.h"
 
-// Create an event loop that can handle up to 'set_size' events simultaneously
-ae_event_loop *ae_create_event_loop(int set_size)
-{
-    ae_event_loop *el = malloc(sizeof(ae_event_loop));
-    el->events = malloc(sizeof(ae_file_event) * set_size);
-    el->fired = malloc(sizeof(ae_fired_event) * set_size);
+// Polling backend
+typedef struct ae_api {
+    const char *name;
+    int (*create)(ae_event_loop *el);
+    void (*free)(ae_event_loop *el);
+    int (*add_event)(ae_event_loop *el, int fd, int mask);      // Add states in 'mask' to monitor
+    void (*del_event)(ae_event_loop *el, int fd, int del_mask); // Stop monitoring states in 'del_mask'
+    int (*poll)(ae_event_loop *el, int timeout);                // Fill 'fired'. Return its length
+    // I/O completed by the backend. NULL if it can't
+    int (*get_io_ops)(ae_event_loop *el);                       // Return AE_IO_XXX it can do
+    int (*add_io)(ae_event_loop *el, int fd, int op);           // Start accept or recv
+    void (*del_io)(ae_event_loop *el, int fd, int op);          // Stop accept or recv
+    int (*register_buffer)(ae_event_loop *el, int fd, void *buf, size_t len);
+    int (*send)(ae_event_loop *el, int fd, const void *buf, size_t len);
+} ae_api;
 
+static int _ae_epoll_create(ae_event_loop *el);
+static void _ae_epoll_free(ae_event_loop *el);
+static int _ae_epoll_add_event(ae_event_loop *el, int fd, int mask);
+static void _ae_epoll_del_event(ae_event_loop *el, int fd, int del_mask);
+static int _ae_epoll_poll(ae_event_loop *el, int timeout);
+static int _ae_uring_create(ae_event_loop *el);
+static void _ae_uring_free(ae_event_loop *el);
+static int _ae_uring_add_event(ae_event_loop *el, int fd, int mask);
+static void _ae_uring_del_event(ae_event_loop *el, int fd, int del_mask);
+static int _ae_uring_poll(ae_event_loop *el, int timeout);
+static int _ae_uring_get_io_ops(ae_event_loop *el);
+static int _ae_uring_add_io(ae_event_loop *el, int fd, int op);
+static void _ae_uring_del_io(ae_event_loop *el, int fd, int op);
+static int _ae_uring_register_buffer(ae_event_loop *el, int fd, void *buf, size_t len);
+static int _ae_uring_send(ae_event_loop *el, int fd, const void *buf, size_t len);
+
+static const ae_api ae_api_epoll = {"epoll", _ae_epoll_create, _ae_epoll_free,
+    _ae_epoll_add_event, _ae_epoll_del_event, _ae_epoll_poll, NULL, NULL, NULL, NULL, NULL};
+static const ae_api ae_api_uring = {"io_uring", _ae_uring_create, _ae_uring_free,
+    _ae_uring_add_event, _ae_uring_del_event, _ae_uring_poll, _ae_uring_get_io_ops,
+    _ae_uring_add_io, _ae_uring_del_io, _ae_uring_register_buffer, _ae_uring_send};
+
+static void _ae_update_max_fd(ae_event_loop *el, int fd);
+static long long _ae_get_monotonic_ms();
+static long long _ae_ms_until_nearest_timer(ae_event_loop *el);
+static int _ae_process_time_events(ae_event_loop *el);
+
+// Create an event loop that can handle up to 'set_size' events simultaneously, polled by
+// 'backend', AE_BACKEND_EPOLL or AE_BACKEND_IO_URING. io_uring falls back to epoll if the
+// kernel doesn't support it.
+ae_event_loop *ae_create_event_loop(int set_size, int backend)
+{
+    ae_event_loop *el = zmalloc(sizeof(ae_event_loop));
+    el->events = zmalloc(sizeof(ae_file_event) * set_size);
+    el->fired = zmalloc(sizeof(ae_fired_event) * set_size);
+    el->set_size = set_size;
+    el->max_fd = -1;
+    el->time_event_head = NULL;
+    el->time_event_next_id = 0;
+    el->stop = 0;
+    el->before_sleep = NULL;
     for (int i = 0; i < set_size; i ++) {
         el->events[i].state_mask = AE_STATE_NONE;
+        el->events[i].io_mask = AE_IO_NONE;
+        el->events[i].io_gen = 0;
+        el->events[i].io_proc = NULL;
     }
 
+    el->api = (backend == AE_BACKEND_IO_URING) ? &ae_api_uring : &ae_api_epoll;
+    int ret = el->api->create(el);
+    if (ret == AE_ERR && el->api == &ae_api_uring) {
+        el->api = &ae_api_epoll;    // Fall back to epoll
+        ret = el->api->create(el);
+    }
+    if (ret == AE_ERR) {
+        zfree(el->events);
+        zfree(el->fired);
+        zfree(el);
+        return NULL;
+    }
     return el;
 }
+
+// Return name of the backend polling the event loop 'el'.
+const char *ae_get_api_name(ae_event_loop *el)
+{
+    return el->api->name;
+}
+
+// Delete the event loop 'el' and release its resources.
+void ae_delete_event_loop(ae_event_loop *el)
+{
+    ae_time_event *te = el->time_event_head, *next;
+    while (te) {
+        next = te->next;
+        if (te->finalizer) te->finalizer(el, te->client_data);
+        zfree(te);
+        te = next;
+    }
+    el->api->free(el);
+    zfree(el->events);
+    zfree(el->fired);
+    zfree(el);
+}
+
+// Register file event of 'fd' to monitor states in 'mask'. 'proc' is called when any of them fires.
+// Return AE_ERR if 'fd' is out of the range of the event loop or the backend fails.
+int ae_create_file_event(ae_event_loop *el, int fd, int mask, ae_file_proc *proc)
+{
+    if (fd >= el->set_size) {
+        errno = ERANGE;
+        return AE_ERR;
+    }
+
+    ae_file_event *e = &el->events[fd];
+    if (el->api->add_event(el, fd, mask) == AE_ERR) return AE_ERR;
+
+    e->state_mask |= mask;
+    e->proc = proc;
+    if (fd > el->max_fd) el->max_fd = fd;
+    return AE_OK;
+}
+
+// Stop monitoring states in 'mask' of 'fd'. The fd is removed from the loop if no state left.
+void ae_delete_file_event(ae_event_loop *el, int fd, int mask)
+{
+    if (fd >= el->set_size) return;
+
+    ae_file_event *e = &el->events[fd];
+    if (e->state_mask == AE_STATE_NONE) return;
+
+    el->api->del_event(el, fd, mask);
+    e->state_mask &= ~mask;
+    _ae_update_max_fd(el, fd);
+}
+
+// Update max_fd if 'fd' was the highest one and nothing of it is monitored any more.
+static void _ae_update_max_fd(ae_event_loop *el, int fd)
+{
+    ae_file_event *e = &el->events[fd];
+    if (fd != el->max_fd || e->state_mask != AE_STATE_NONE || e->io_mask != AE_IO_NONE) return;
+
+    int j;
+    for (j = el->max_fd - 1; j >= 0; j --) {
+        if (el->events[j].state_mask != AE_STATE_NONE || el->events[j].io_mask != AE_IO_NONE) break;
+    }
+    el->max_fd = j;
+}
+
+// Return the states being monitored for 'fd'.
+int ae_get_file_events(ae_event_loop *el, int fd)
+{
+    if (fd >= el->set_size) return AE_STATE_NONE;
+    return el->events[fd].state_mask;
+}
+
+// Create a time event that fires after 'milliseconds'. Return its id.
+long long ae_create_time_event(ae_event_loop *el, long long milliseconds, ae_time_proc *proc,
+    void *client_data, ae_event_finalizer_proc *finalizer)
+{
+    ae_time_event *te = zmalloc(sizeof(ae_time_event));
+
+    te->id = el->time_event_next_id ++;
+    te->when_ms = _ae_get_monotonic_ms() + milliseconds;
+    te->proc = proc;
+    te->finalizer = finalizer;
+    te->client_data = client_data;
+    te->next = el->time_event_head;
+    el->time_event_head = te;
+    return te->id;
+}
+
+// Delete the time event with 'id'. The event is only marked here and freed in the next
+// round of time event processing, so it's safe to call this from within an ae_time_proc.
+int ae_delete_time_event(ae_event_loop *el, long long id)
+{
+    for (ae_time_event *te = el->time_event_head; te; te = te->next) {
+        if (te->id == id) {
+            te->id = AE_DELETED_EVENT_ID;
+            return AE_OK;
+        }
+    }
+    return AE_ERR;
+}
+
+// Wait for and process fired events. 'flags' selects the type of events to process.
+// If AE_DONT_WAIT is set, return as soon as all events that can be processed without waiting
+// are processed. Return the number of events processed.
+int ae_process_events(ae_event_loop *el, int flags)
+{
+    int processed = 0;
+
+    if (!(flags & AE_ALL_EVENTS)) return 0;
+
+    // Poll even if only time events are wanted, so that we sleep until the nearest timer.
+    if (el->max_fd != -1 || ((flags & AE_EVENT_TIME) && !(flags & AE_DONT_WAIT))) {
+        int timeout = -1;   // -1 blocks until an event fires
+        if (flags & AE_DONT_WAIT) {
+            timeout = 0;
+        } else if (flags & AE_EVENT_TIME) {
+            long long ms = _ae_ms_until_nearest_timer(el);
+            if (ms != -1) timeout = (ms > 0x7fffffff) ? 0x7fffffff : (int)ms;
+        }
+
+        int num_events = el->api->poll(el, timeout);
+        if (!(flags & AE_EVENT_FILE)) num_events = 0;
+
+        for (int i = 0; i < num_events; i ++) {
+            ae_fired_event *fe = &el->fired[i];
+            ae_file_event *e = &el->events[fe->fd];
+            if (fe->io_op == AE_IO_SEND) {
+                // Always reported, so that the owner knows its buffer is free again
+                e->io_mask &= ~AE_IO_SEND;
+                _ae_update_max_fd(el, fe->fd);
+                e->io_proc(el, fe->fd, AE_IO_SEND, NULL, fe->res, e->io_data);
+            } else if (fe->io_op != AE_IO_NONE) {
+                // A callback earlier in this round may have stopped the operation. Skip it.
+                if ((e->io_mask & fe->io_op) && fe->io_gen == e->io_gen) {
+                    e->io_proc(el, fe->fd, fe->io_op, fe->buf, fe->res, e->io_data);
+                }
+            } else {
+                // A callback earlier in this round may have deleted some states of this fd. Skip them.
+                int state = fe->state & e->state_mask;
+                if (state != AE_STATE_NONE) e->proc(el, fe->fd, state);
+            }
+            processed ++;
+        }
+    }
+
+    if (flags & AE_EVENT_TIME) processed += _ae_process_time_events(el);
+
+    return processed;
+}
+
+// Event loop main. Process events until ae_stop() is called.
+void ae_main(ae_event_loop *el)
+{
+    el->stop = 0;
+    while (!el->stop) {
+        if (el->before_sleep) el->before_sleep(el);
+        ae_process_events(el, AE_ALL_EVENTS);
+    }
+}
+
+// Set the procedure called in every iteration of ae_main() before waiting for events.
+void ae_set_before_sleep_proc(ae_event_loop *el, ae_before_sleep_proc *before_sleep)
+{
+    el->before_sleep = before_sleep;
+}
+
+// Stop the event loop after current round of processing.
+void ae_stop(ae_event_loop *el)
+{
+    el->stop = 1;
+}
+
+/*-------------------------------------I/O COMPLETION-------------------------------------------*/
+// Backends that can do the I/O themselves take over the recv(), send() and accept() calls of
+// the callbacks, so the loop pays for them in the batched submission of each iteration rather
+// than a syscall each.
+
+// Return AE_IO_XXX operations the event loop 'el' can do itself, or AE_IO_NONE if its backend only
+// tells when fds are ready.
+int ae_get_io_ops(ae_event_loop *el)
+{
+    return el->api->get_io_ops ? el->api->get_io_ops(el) : AE_IO_NONE;
+}
+
+// Start operation 'op', AE_IO_ACCEPT or AE_IO_RECV, on 'fd'. It goes on until deleted, calling
+// 'proc' with 'client_data' at each completion. It stops by itself once an error or end of file
+// is reported. Return AE_ERR if 'fd' is out of range or the backend can't do it.
+int ae_create_io_event(ae_event_loop *el, int fd, int op, ae_io_proc *proc, void *client_data)
+{
+    if (fd >= el->set_size || !(ae_get_io_ops(el) & op)) {
+        errno = (fd >= el->set_size) ? ERANGE : EOPNOTSUPP;
+        return AE_ERR;
+    }
+
+    ae_file_event *e = &el->events[fd];
+    e->io_gen ++;
+    e->io_proc = proc;
+    e->io_data = client_data;
+    if (el->api->add_io(el, fd, op) == AE_ERR) return AE_ERR;
+
+    e->io_mask |= op;
+    if (fd > el->max_fd) el->max_fd = fd;
+    return AE_OK;
+}
+
+// Stop operations in 'op' of 'fd'. Their completions not processed yet are dropped. A send in
+// progress can't be stopped. Its completion is still reported.
+void ae_delete_io_event(ae_event_loop *el, int fd, int op)
+{
+    if (fd >= el->set_size) return;
+
+    ae_file_event *e = &el->events[fd];
+    op &= e->io_mask & ~AE_IO_SEND;
+    if (op == AE_IO_NONE) return;
+
+    el->api->del_io(el, fd, op);
+    e->io_mask &= ~op;
+    e->io_gen ++;
+    _ae_update_max_fd(el, fd);
+}
+
+// Register 'len' bytes at 'buf' as the buffer of 'fd', so that sending from it doesn't map its
+// pages in the kernel every time. A later call for the same fd replaces it, and a NULL 'buf'
+// unregisters it. Return AE_ERR if the backend can't.
+int ae_register_buffer(ae_event_loop *el, int fd, void *buf, size_t len)
+{
+    if (fd >= el->set_size || el->api->register_buffer == NULL) return AE_ERR;
+    return el->api->register_buffer(el, fd, buf, len);
+}
+
+// Send 'len' bytes at 'buf' to 'fd', whose operations are started by ae_create_io_event(). The
+// completion is reported to its 'proc' as AE_IO_SEND, and 'buf' must be left as is until then.
+// One send at a time per fd. Return AE_ERR if the backend can't do it or a send is in progress.
+int ae_send(ae_event_loop *el, int fd, const void *buf, size_t len)
+{
+    if (fd >= el->set_size || !(ae_get_io_ops(el) & AE_IO_SEND)) return AE_ERR;
+
+    ae_file_event *e = &el->events[fd];
+    if ((e->io_mask & AE_IO_SEND) || e->io_proc == NULL) return AE_ERR;
+    if (el->api->send(el, fd, buf, len) == AE_ERR) return AE_ERR;
+
+    e->io_mask |= AE_IO_SEND;
+    if (fd > el->max_fd) el->max_fd = fd;
+    return AE_OK;
+}
+
+/*-------------------------------------TIME EVENTS-------------------------------------------*/
+
+// Return milliseconds from an arbitrary point. Not affected by changes of the system clock.
+static long long _ae_get_monotonic_ms()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ((long long)ts.tv_sec * 1000) + (ts.tv_nsec / 1000000);
+}
+
+// Return milliseconds until the nearest time event fires, 0 if one is already due,
+// or -1 if there is no time event at all.
+static long long _ae_ms_until_nearest_timer(ae_event_loop *el)
+{
+    long long nearest = -1;
+
+    for (ae_time_event *te = el->time_event_head; te; te = te->next) {
+        if (te->id == AE_DELETED_EVENT_ID) continue;
+        if (nearest == -1 || te->when_ms < nearest) nearest = te->when_ms;
+    }
+    if (nearest == -1) return -1;
+
+    long long ms = nearest - _ae_get_monotonic_ms();
+    return (ms > 0) ? ms : 0;
+}
+
+// Process due time events and free deleted ones. Return number of time events processed.
+static int _ae_process_time_events(ae_event_loop *el)
+{
+    int processed = 0;
+    // Events created by callbacks in this round are not processed until next round.
+    long long max_id = el->time_event_next_id - 1;
+    ae_time_event *te = el->time_event_head, *prev = NULL;
+
+    while (te) {
+        // Free deleted events
+        if (te->id == AE_DELETED_EVENT_ID) {
+            ae_time_event *next = te->next;
+            if (prev) prev->next = next;
+            else el->time_event_head = next;
+            if (te->finalizer) te->finalizer(el, te->client_data);
+            zfree(te);
+            te = next;
+            continue;
+        }
+
+        if (te->id <= max_id && te->when_ms <= _ae_get_monotonic_ms()) {
+            int ret = te->proc(el, te->id, te->client_data);
+            processed ++;
+            if (ret != AE_NOMORE) {
+                te->when_ms = _ae_get_monotonic_ms() + ret;
+            } else {
+                te->id = AE_DELETED_EVENT_ID;
+            }
+        }
+        prev = te;
+        te = te->next;
+    }
+    return processed;
+}
+
+/*-------------------------------------EPOLL BACKEND-------------------------------------------*/
+
+// API data for epoll.
+typedef struct ae_epoll_state {
+    int epfd;
+    struct epoll_event *events; // Events returned by epoll_wait()
+} ae_epoll_state;
+
+static int _ae_epoll_create(ae_event_loop *el)
+{
+    ae_epoll_state *state = zmalloc(sizeof(ae_epoll_state));
+
+    state->events = zmalloc(sizeof(struct epoll_event) * el->set_size);
+    state->epfd = epoll_create(1024); // 1024 is just a hint for the kernel
+    if (state->epfd == -1) {
+        zfree(state->events);
+        zfree(state);
+        return AE_ERR;
+    }
+    el->api_data = state;
+    return AE_OK;
+}
+
+static void _ae_epoll_free(ae_event_loop *el)
+{
+    ae_epoll_state *state = el->api_data;
+
+    close(state->epfd);
+    zfree(state->events);
+    zfree(state);
+}
+
+// Add states in 'mask' to those already monitored for 'fd'.
+static int _ae_epoll_add_event(ae_event_loop *el, int fd, int mask)
+{
+    ae_epoll_state *state = el->api_data;
+    struct epoll_event ee = {0};
+    // If the fd is already monitored, we need a MOD operation. Otherwise an ADD
+    int op = (el->events[fd].state_mask == AE_STATE_NONE) ? EPOLL_CTL_ADD : EPOLL_CTL_MOD;
+
+    mask |= el->events[fd].state_mask; // Merge old states
+    if (mask & AE_STATE_READABLE) ee.events |= EPOLLIN;
+    if (mask & AE_STATE_WRITABLE) ee.events |= EPOLLOUT;
+    ee.data.fd = fd;
+
+    if (epoll_ctl(state->epfd, op, fd, &ee) == -1) return AE_ERR;
+    return AE_OK;
+}
+
+// Remove states in 'del_mask' from those monitored for 'fd'.
+static void _ae_epoll_del_event(ae_event_loop *el, int fd, int del_mask)
+{
+    ae_epoll_state *state = el->api_data;
+    struct epoll_event ee = {0};
+    int mask = el->events[fd].state_mask & (~del_mask);
+
+    if (mask & AE_STATE_READABLE) ee.events |= EPOLLIN;
+    if (mask & AE_STATE_WRITABLE) ee.events |= EPOLLOUT;
+    ee.data.fd = fd;
+
+    if (mask != AE_STATE_NONE) {
+        epoll_ctl(state->epfd, EPOLL_CTL_MOD, fd, &ee);
+    } else {
+        // Note, kernel < 2.6.9 requires a non null event pointer even for EPOLL_CTL_DEL.
+        epoll_ctl(state->epfd, EPOLL_CTL_DEL, fd, &ee);
+    }
+}
+
+// Wait at most 'timeout' milliseconds (-1 to block) and fill 'fired' with ready fds.
+// Return number of fired events.
+static int _ae_epoll_poll(ae_event_loop *el, int timeout)
+{
+    ae_epoll_state *state = el->api_data;
+
+    int num_events = epoll_wait(state->epfd, state->events, el->set_size, timeout);
+    if (num_events <= 0) return 0; // timeout or interrupted (EINTR)
+
+    for (int i = 0; i < num_events; i ++) {
+        struct epoll_event *e = &state->events[i];
+        int mask = AE_STATE_NONE;
+
+        // Errors and hangups are reported as both readable and writable so that
+        // the callback gets a chance to read() or write() and see the error.
+        if (e->events & EPOLLIN)  mask |= AE_STATE_READABLE;
+        if (e->events & EPOLLOUT) mask |= AE_STATE_WRITABLE;
+        if (e->events & EPOLLERR) mask |= AE_STATE_READABLE | AE_STATE_WRITABLE;
+        if (e->events & EPOLLHUP) mask |= AE_STATE_READABLE | AE_STATE_WRITABLE;
+        el->fired[i].fd = e->data.fd;
+        el->fired[i].state = mask;
+        el->fired[i].io_op = AE_IO_NONE;
+    }
+    return num_events;
+}
+
+/*-------------------------------------IO_URING BACKEND-------------------------------------------*/
+
+// The io_uring backend tells when fds are ready like epoll does, so it works with any
+// ae_file_proc. Each monitored fd has one oneshot IORING_OP_POLL_ADD request with all its states.
+// A request that completes is re-armed in the next poll as long as the fd is still monitored.
+// Since a oneshot poll checks readiness when armed, data left unread fires again, like
+// level-triggered epoll.
+//
+// On Linux 6.0+ it also does the I/O itself (see ae_get_io_ops()):
+//  - Accepts are multishot requests, each completion a new connection.
+//  - Receives are multishot requests too. The kernel picks a buffer of the loop's provided buffer
+//    ring for every completion, so no buffer is tied up by idle connections. Buffers are given
+//    back to the ring in the next poll, after the callbacks have consumed them.
+//  - Sends are queued one per fd. Those from the buffer registered for the fd are fixed buffer
+//    writes, which skip mapping the buffer's pages in the kernel.
+// Multishot requests that stop, e.g. when the buffer ring runs dry, are started again in the
+// next poll. Requests of all kinds are only queued in the submission ring. They are submitted,
+// and completions waited for, by one io_uring_enter() per poll. The ring is driven by raw
+// syscalls, so liburing is not needed.
+
+#define AE_URING_SQ_ENTRIES     1024
+#define AE_URING_IGNORE_DATA    UINT64_MAX  // user_data of requests whose completion is ignored
+#define AE_URING_BUF_COUNT      256         // Buffers in the provided buffer ring, a power of 2
+#define AE_URING_BUF_SIZE       (16*1024)   // Max bytes of a receive completion
+#define AE_URING_BUF_GROUP      0
+#define AE_URING_MAX_FIXED      (1<<14)     // Max buffers registered, a kernel limit
+
+// user_data of a request: generation in the high 32 bits, then AE_IO_XXX (0 for a poll), then fd
+#define _ae_uring_data(fd, op, gen) (((uint64_t)(gen) << 32) | ((uint64_t)(op) << 24) | (uint32_t)(fd))
+
+// Multishot request to start again in the next poll
+typedef struct ae_uring_restart {
+    int fd;
+    int op;
+    unsigned gen;
+} ae_uring_restart;
+
+// API data for io_uring.
+typedef struct ae_uring_state {
+    int ring_fd;
+    // Submission ring
+    unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+    struct io_uring_sqe *sqes;
+    unsigned sq_entries;
+    unsigned to_submit;     // SQEs queued since last io_uring_enter()
+    // Completion ring
+    unsigned *cq_head, *cq_tail, *cq_mask;
+    struct io_uring_cqe *cqes;
+    // Mapped memory
+    void *sq_ring, *cq_ring;
+    size_t sq_ring_size, cq_ring_size, sqes_size;
+    // Per fd states
+    unsigned *gen;          // Generation of the poll request of each fd. Stale completions are ignored
+    unsigned char *armed;   // Is there a poll request of the fd in flight?
+    int num_fired;          // Number of events fired in last poll, to be re-armed
+    // I/O completion. See _ae_uring_setup_io()
+    int io_ops;             // AE_IO_XXX supported, AE_IO_NONE if the kernel is too old
+    struct io_uring_buf_ring *buf_ring; // Provided buffer ring, shared with the kernel
+    char *bufs;             // AE_URING_BUF_COUNT buffers of AE_URING_BUF_SIZE bytes in the ring
+    unsigned short buf_tail;    // Tail of the buffer ring, published at each poll
+    struct iovec *fixed;    // Buffer registered for each fd below 'num_fixed'
+    int num_fixed;
+    ae_uring_restart *restarts; // Multishot requests to start again in the next poll
+    int num_restarts;
+} ae_uring_state;
+
+static int _ae_uring_setup_io(ae_event_loop *el, ae_uring_state *state);
+
+static int _ae_uring_enter(int fd, unsigned to_submit, unsigned min_complete, unsigned flags,
+    void *arg, size_t arg_size)
+{
+    return (int)syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, arg, arg_size);
+}
+
+static int _ae_uring_register(int fd, unsigned opcode, void *arg, unsigned nr_args)
+{
+    return (int)syscall(__NR_io_uring_register, fd, opcode, arg, nr_args);
+}
+
+static int _ae_uring_create(ae_event_loop *el)
+{
+    // fds are packed in 24 bits of user_data
+    if (el->set_size > (1 << 24)) return AE_ERR;
+
+    struct io_uring_params p;
+    memset(&p, 0, sizeof(p));
+    // Completions of all in flight polls must fit in the completion ring
+    p.flags = IORING_SETUP_CQSIZE;
+    p.cq_entries = el->set_size * 2;
+
+    int ring_fd = (int)syscall(__NR_io_uring_setup, AE_URING_SQ_ENTRIES, &p);
+    if (ring_fd == -1) return AE_ERR;
+    // Waiting with a timeout needs IORING_ENTER_EXT_ARG (Linux 5.11)
+    if (!(p.features & IORING_FEAT_EXT_ARG)) {
+        close(ring_fd);
+        return AE_ERR;
+    }
+
+    ae_uring_state *state = zmalloc(sizeof(ae_uring_state));
+    state->ring_fd = ring_fd;
+    state->sq_ring_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    state->cq_ring_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        if (state->cq_ring_size > state->sq_ring_size) state->sq_ring_size = state->cq_ring_size;
+        state->cq_ring_size = state->sq_ring_size;
+    }
+    state->sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+
+    state->sq_ring = mmap(NULL, state->sq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+        ring_fd, IORING_OFF_SQ_RING);
+    state->cq_ring = (p.features & IORING_FEAT_SINGLE_MMAP) ? state->sq_ring :
+        mmap(NULL, state->cq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+        ring_fd, IORING_OFF_CQ_RING);
+    state->sqes = mmap(NULL, state->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+        ring_fd, IORING_OFF_SQES);
+    if (state->sq_ring == MAP_FAILED || state->cq_ring == MAP_FAILED || state->sqes == MAP_FAILED) {
+        if (state->sq_ring != MAP_FAILED) munmap(state->sq_ring, state->sq_ring_size);
+        if (state->cq_ring != MAP_FAILED && state->cq_ring != state->sq_ring) munmap(state->cq_ring, state->cq_ring_size);
+        if (state->sqes != MAP_FAILED) munmap(state->sqes, state->sqes_size);
+        close(ring_fd);
+        zfree(state);
+        return AE_ERR;
+    }
+
+    state->sq_head = (unsigned *)((char *)state->sq_ring + p.sq_off.head);
+    state->sq_tail = (unsigned *)((char *)state->sq_ring + p.sq_off.tail);
+    state->sq_mask = (unsigned *)((char *)state->sq_ring + p.sq_off.ring_mask);
+    state->sq_array = (unsigned *)((char *)state->sq_ring + p.sq_off.array);
+    state->sq_entries = p.sq_entries;
+    state->to_submit = 0;
+    state->cq_head = (unsigned *)((char *)state->cq_ring + p.cq_off.head);
+    state->cq_tail = (unsigned *)((char *)state->cq_ring + p.cq_off.tail);
+    state->cq_mask = (unsigned *)((char *)state->cq_ring + p.cq_off.ring_mask);
+    state->cqes = (struct io_uring_cqe *)((char *)state->cq_ring + p.cq_off.cqes);
+
+    state->gen = zcalloc(el->set_size, sizeof(unsigned));
+    state->armed = zcalloc(el->set_size, sizeof(unsigned char));
+    state->num_fired = 0;
+    el->api_data = state;
+    // Without I/O completion, the backend still polls
+    state->io_ops = (_ae_uring_setup_io(el, state) == AE_OK) ? (AE_IO_ACCEPT | AE_IO_RECV | AE_IO_SEND) : AE_IO_NONE;
+    return AE_OK;
+}
+
+static void _ae_uring_free(ae_event_loop *el)
+{
+    ae_uring_state *state = el->api_data;
+
+    munmap(state->sqes, state->sqes_size);
+    if (state->cq_ring != state->sq_ring) munmap(state->cq_ring, state->cq_ring_size);
+    munmap(state->sq_ring, state->sq_ring_size);
+    close(state->ring_fd);
+    if (state->buf_ring) munmap(state->buf_ring, AE_URING_BUF_COUNT * sizeof(struct io_uring_buf));
+    zfree(state->bufs);
+    zfree(state->fixed);
+    zfree(state->restarts);
+    zfree(state->gen);
+    zfree(state->armed);
+    zfree(state);
+}
+
+// Return a zeroed SQE to fill, queued to be submitted by the next io_uring_enter(). If the
+// submission ring is full, submit what's queued first.
+static struct io_uring_sqe *_ae_uring_get_sqe(ae_uring_state *state)
+{
+    unsigned tail = *state->sq_tail;
+
+    while (tail - atomic_load_explicit((_Atomic unsigned *)state->sq_head, memory_order_acquire) >= state->sq_entries) {
+        int ret = _ae_uring_enter(state->ring_fd, state->to_submit, 0, 0, NULL, 0);
+        if (ret > 0) {
+            state->to_submit -= ret;
+        } else if (ret == -1 && (errno == EBUSY || errno == EAGAIN)) {
+            // Completions waiting in the kernel hold up submission. Flush them to the
+            // completion ring, which the next poll reaps
+            _ae_uring_enter(state->ring_fd, 0, 0, IORING_ENTER_GETEVENTS, NULL, 0);
+        } else if (ret == -1 && errno != EINTR) {
+            server_panic("io_uring failed to submit (Error: %s)", strerror(errno));
+        }
+    }
+
+    unsigned idx = tail & *state->sq_mask;
+    struct io_uring_sqe *sqe = &state->sqes[idx];
+    memset(sqe, 0, sizeof(*sqe));
+    state->sq_array[idx] = idx;
+    atomic_store_explicit((_Atomic unsigned *)state->sq_tail, tail + 1, memory_order_release);
+    state->to_submit ++;
+    return sqe;
+}
+
+// Queue a oneshot poll of the states in 'mask' of 'fd'.
+static void _ae_uring_arm(ae_uring_state *state, int fd, int mask)
+{
+    struct io_uring_sqe *sqe = _ae_uring_get_sqe(state);
+
+    sqe->opcode = IORING_OP_POLL_ADD;
+    sqe->fd = fd;
+    if (mask & AE_STATE_READABLE) sqe->poll32_events |= POLLIN;
+    if (mask & AE_STATE_WRITABLE) sqe->poll32_events |= POLLOUT;
+    sqe->user_data = _ae_uring_data(fd, AE_IO_NONE, ++ state->gen[fd]);
+    state->armed[fd] = 1;
+}
+
+// Queue the removal of the poll in flight of 'fd', if any. A completion of it that is already
+// posted is ignored, as the generation of the fd changes.
+static void _ae_uring_disarm(ae_uring_state *state, int fd)
+{
+    if (!state->armed[fd]) return;
+
+    struct io_uring_sqe *sqe = _ae_uring_get_sqe(state);
+    sqe->opcode = IORING_OP_POLL_REMOVE;
+    sqe->fd = -1;
+    sqe->addr = _ae_uring_data(fd, AE_IO_NONE, state->gen[fd]);
+    sqe->user_data = AE_URING_IGNORE_DATA;
+    state->gen[fd] ++;
+    state->armed[fd] = 0;
+}
+
+// Add states in 'mask' to those already monitored for 'fd'.
+static int _ae_uring_add_event(ae_event_loop *el, int fd, int mask)
+{
+    ae_uring_state *state = el->api_data;
+    int old_mask = el->events[fd].state_mask;
+
+    mask |= old_mask;
+    if (state->armed[fd] && mask == old_mask) return AE_OK;
+    _ae_uring_disarm(state, fd);
+    _ae_uring_arm(state, fd, mask);
+    return AE_OK;
+}
+
+// Remove states in 'del_mask' from those monitored for 'fd'.
+static void _ae_uring_del_event(ae_event_loop *el, int fd, int del_mask)
+{
+    ae_uring_state *state = el->api_data;
+    int mask = el->events[fd].state_mask & (~del_mask);
+
+    _ae_uring_disarm(state, fd);
+    if (mask != AE_STATE_NONE) _ae_uring_arm(state, fd, mask);
+}
+
+// Queue multishot request 'op', AE_IO_ACCEPT or AE_IO_RECV, of 'fd' with generation 'gen'.
+static void _ae_uring_start_io(ae_uring_state *state, int fd, int op, unsigned gen)
+{
+    struct io_uring_sqe *sqe = _ae_uring_get_sqe(state);
+
+    sqe->fd = fd;
+    sqe->user_data = _ae_uring_data(fd, op, gen);
+    if (op == AE_IO_ACCEPT) {
+        sqe->opcode = IORING_OP_ACCEPT;
+        sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+    } else {
+        sqe->opcode = IORING_OP_RECV;
+        sqe->ioprio = IORING_RECV_MULTISHOT;
+        sqe->flags = IOSQE_BUFFER_SELECT;
+        sqe->buf_group = AE_URING_BUF_GROUP;
+    }
+}
+
+// Give buffer 'buf' back to the buffer ring. It's seen by the kernel once the tail is published.
+static void _ae_uring_put_buf(ae_uring_state *state, const char *buf)
+{
+    unsigned short bid = (buf - state->bufs) / AE_URING_BUF_SIZE;
+    struct io_uring_buf *b = &state->buf_ring->bufs[state->buf_tail & (AE_URING_BUF_COUNT - 1)];
+
+    b->addr = (uint64_t)(uintptr_t)(state->bufs + (size_t)bid * AE_URING_BUF_SIZE);
+    b->len = AE_URING_BUF_SIZE;
+    b->bid = bid;
+    state->buf_tail ++;
+}
+
+// Tell if the kernel does multishot receives (Linux 6.0), the newest of the features needed, by
+// starting one on a socket pair and cancelling it. If not supported, it fails with -EINVAL.
+static int _ae_uring_probe_recv(ae_uring_state *state)
+{
+    int sv[2];
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv) == -1) return 0;
+
+    _ae_uring_start_io(state, sv[0], AE_IO_RECV, 0);
+    struct io_uring_sqe *sqe = _ae_uring_get_sqe(state);
+    sqe->opcode = IORING_OP_ASYNC_CANCEL;
+    sqe->fd = -1;
+    sqe->addr = _ae_uring_data(sv[0], AE_IO_RECV, 0);
+    sqe->user_data = AE_URING_IGNORE_DATA;
+    int ret = _ae_uring_enter(state->ring_fd, state->to_submit, 2, IORING_ENTER_GETEVENTS, NULL, 0);
+    if (ret > 0) state->to_submit -= ret;
+
+    int supported = 0;
+    unsigned head = *state->cq_head;
+    unsigned tail = atomic_load_explicit((_Atomic unsigned *)state->cq_tail, memory_order_acquire);
+    for (; head != tail; head ++) {
+        struct io_uring_cqe *cqe = &state->cqes[head & *state->cq_mask];
+        if (cqe->user_data != AE_URING_IGNORE_DATA) supported = (cqe->res != -EINVAL);
+    }
+    atomic_store_explicit((_Atomic unsigned *)state->cq_head, head, memory_order_release);
+    close(sv[0]);
+    close(sv[1]);
+    return supported;
+}
+
+// Set up I/O completion: the provided buffer ring receives go to (Linux 5.19), and the table of
+// registered buffers, sparse so that buffers of fds come and go. The registered buffers are
+// optional, sends just don't use them if the table can't be made. Return AE_ERR if the kernel
+// can't do I/O completion.
+static int _ae_uring_setup_io(ae_event_loop *el, ae_uring_state *state)
+{
+    state->buf_ring = NULL;
+    state->bufs = NULL;
+    state->fixed = NULL;
+    state->num_fixed = 0;
+    state->restarts = NULL;
+    state->num_restarts = 0;
+
+    // The ring must be page aligned
+    size_t ring_size = AE_URING_BUF_COUNT * sizeof(struct io_uring_buf);
+    state->buf_ring = mmap(NULL, ring_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (state->buf_ring == MAP_FAILED) {
+        state->buf_ring = NULL;
+        return AE_ERR;
+    }
+    struct io_uring_buf_reg reg;
+    memset(&reg, 0, sizeof(reg));
+    reg.ring_addr = (uint64_t)(uintptr_t)state->buf_ring;
+    reg.ring_entries = AE_URING_BUF_COUNT;
+    reg.bgid = AE_URING_BUF_GROUP;
+    if (_ae_uring_register(state->ring_fd, IORING_REGISTER_PBUF_RING, &reg, 1) < 0 || !_ae_uring_probe_recv(state)) {
+        munmap(state->buf_ring, ring_size);
+        state->buf_ring = NULL;
+        return AE_ERR;
+    }
+
+    state->bufs = zmalloc((size_t)AE_URING_BUF_COUNT * AE_URING_BUF_SIZE);
+    state->buf_tail = 0;
+    for (int i = 0; i < AE_URING_BUF_COUNT; i ++) _ae_uring_put_buf(state, state->bufs + (size_t)i * AE_URING_BUF_SIZE);
+    atomic_store_explicit((_Atomic unsigned short *)&state->buf_ring->tail, state->buf_tail, memory_order_release);
+
+    // At most one live multishot request per fd stops in a round. See _ae_uring_complete_io()
+    state->restarts = zmalloc(sizeof(ae_uring_restart) * el->set_size);
+
+    struct io_uring_rsrc_register rr;
+    memset(&rr, 0, sizeof(rr));
+    rr.nr = (el->set_size < AE_URING_MAX_FIXED) ? el->set_size : AE_URING_MAX_FIXED;
+    rr.flags = IORING_RSRC_REGISTER_SPARSE;
+    if (_ae_uring_register(state->ring_fd, IORING_REGISTER_BUFFERS2, &rr, sizeof(rr)) == 0) {
+        state->num_fixed = rr.nr;
+        state->fixed = zcalloc(rr.nr, sizeof(struct iovec));
+    }
+    return AE_OK;
+}
+
+static int _ae_uring_get_io_ops(ae_event_loop *el)
+{
+    ae_uring_state *state = el->api_data;
+    return state->io_ops;
+}
+
+// Start multishot request 'op' of 'fd'.
+static int _ae_uring_add_io(ae_event_loop *el, int fd, int op)
+{
+    _ae_uring_start_io(el->api_data, fd, op, el->events[fd].io_gen);
+    return AE_OK;
+}
+
+// Queue the cancellation of the multishot request 'op' of 'fd'. Its completions posted before
+// are dropped, as the generation of the fd changes. See ae_delete_io_event()
+static void _ae_uring_del_io(ae_event_loop *el, int fd, int op)
+{
+    struct io_uring_sqe *sqe = _ae_uring_get_sqe(el->api_data);
+
+    sqe->opcode = IORING_OP_ASYNC_CANCEL;
+    sqe->fd = -1;
+    sqe->addr = _ae_uring_data(fd, op, el->events[fd].io_gen);
+    sqe->user_data = AE_URING_IGNORE_DATA;
+}
+
+// Register 'len' bytes at 'buf' as the fixed buffer of 'fd', at index 'fd' of the table.
+static int _ae_uring_register_buffer(ae_event_loop *el, int fd, void *buf, size_t len)
+{
+    ae_uring_state *state = el->api_data;
+    if (fd >= state->num_fixed) return AE_ERR;
+    if (buf == NULL && state->fixed[fd].iov_base == NULL) return AE_OK;  // Nothing to unregister
+
+    struct iovec iov = {buf, len};
+    struct io_uring_rsrc_update2 up;
+    memset(&up, 0, sizeof(up));
+    up.offset = fd;
+    up.data = (uint64_t)(uintptr_t)&iov;
+    up.nr = 1;
+    if (_ae_uring_register(state->ring_fd, IORING_REGISTER_BUFFERS_UPDATE, &up, sizeof(up)) < 0) {
+        // E.g. beyond RLIMIT_MEMLOCK. Sends of the fd just don't use a fixed buffer
+        state->fixed[fd].iov_base = NULL;
+        state->fixed[fd].iov_len = 0;
+        return AE_ERR;
+    }
+    state->fixed[fd] = iov;
+    return AE_OK;
+}
+
+// Queue a send of 'len' bytes at 'buf' to 'fd'. A fixed buffer write if 'buf' is within the
+// buffer registered for the fd.
+static int _ae_uring_send(ae_event_loop *el, int fd, const void *buf, size_t len)
+{
+    ae_uring_state *state = el->api_data;
+    struct io_uring_sqe *sqe = _ae_uring_get_sqe(state);
+    const char *p = buf;
+
+    sqe->fd = fd;
+    sqe->addr = (uint64_t)(uintptr_t)buf;
+    sqe->len = len;
+    sqe->user_data = _ae_uring_data(fd, AE_IO_SEND, 0);
+    if (fd < state->num_fixed && p >= (char *)state->fixed[fd].iov_base &&
+        p + len <= (char *)state->fixed[fd].iov_base + state->fixed[fd].iov_len) {
+        sqe->opcode = IORING_OP_WRITE_FIXED;
+        sqe->buf_index = fd;
+    } else {
+        sqe->opcode = IORING_OP_SEND;
+        sqe->msg_flags = MSG_NOSIGNAL;
+    }
+    return AE_OK;
+}
+
+// Fill fired event 'fe' with the completion 'cqe' of request 'op' of 'fd' with generation 'gen'.
+// A multishot request that stops without reporting an error or end of file is started again in
+// the next poll. Return 0 if there is nothing to report.
+static int _ae_uring_complete_io(ae_event_loop *el, struct io_uring_cqe *cqe, int fd, int op,
+    unsigned gen, ae_fired_event *fe)
+{
+    ae_uring_state *state = el->api_data;
+    const char *buf = (cqe->flags & IORING_CQE_F_BUFFER) ?
+        state->bufs + (size_t)(cqe->flags >> IORING_CQE_BUFFER_SHIFT) * AE_URING_BUF_SIZE : NULL;
+
+    // Late completion of a request deleted since, maybe of an earlier fd with the same number.
+    // Its buffer goes back to the ring right away. Sends are never stale, see ae_delete_io_event()
+    if (op != AE_IO_SEND && gen != el->events[fd].io_gen) {
+        if (buf) _ae_uring_put_buf(state, buf);
+        return 0;
+    }
+
+    fe->fd = fd;
+    fe->state = AE_STATE_NONE;
+    fe->io_op = op;
+    fe->io_gen = gen;
+    fe->res = cqe->res;
+    fe->buf = buf;
+    if (op == AE_IO_SEND || (cqe->flags & IORING_CQE_F_MORE)) return 1;
+
+    // Accepts go on whatever happens. Receives, unless the other end is gone. -ENOBUFS means
+    // the buffer ring ran dry, which is no news to the callback
+    if (op == AE_IO_ACCEPT || cqe->res > 0 || cqe->res == -ENOBUFS) {
+        // Only the request of the current generation of an fd is live, and it stops once
+        server_assert(state->num_restarts < el->set_size);
+        ae_uring_restart *r = &state->restarts[state->num_restarts ++];
+        r->fd = fd;
+        r->op = op;
+        r->gen = gen;
+    }
+    return cqe->res != -ENOBUFS;
+}
+
+// Re-arm fds fired last time, submit all queued requests and wait at most 'timeout'
+// milliseconds (-1 to block) for completions. Fill 'fired' with ready fds and completed I/O,
+// and return their number.
+static int _ae_uring_poll(ae_event_loop *el, int timeout)
+{
+    ae_uring_state *state = el->api_data;
+
+    // The callbacks of last round are done with the buffers received into, and fds still
+    // monitored need their polls back
+    for (int i = 0; i < state->num_fired; i ++) {
+        ae_fired_event *fe = &el->fired[i];
+        if (fe->io_op != AE_IO_NONE) {
+            if (fe->buf) _ae_uring_put_buf(state, fe->buf);
+            continue;
+        }
+        int fd = fe->fd;
+        if (!state->armed[fd] && el->events[fd].state_mask != AE_STATE_NONE) {
+            _ae_uring_arm(state, fd, el->events[fd].state_mask);
+        }
+    }
+    state->num_fired = 0;
+    if (state->buf_ring) {
+        atomic_store_explicit((_Atomic unsigned short *)&state->buf_ring->tail, state->buf_tail, memory_order_release);
+    }
+    // Multishot requests stopped last round go on, unless they have been deleted since
+    for (int i = 0; i < state->num_restarts; i ++) {
+        ae_uring_restart *r = &state->restarts[i];
+        ae_file_event *e = &el->events[r->fd];
+        if ((e->io_mask & r->op) && e->io_gen == r->gen) _ae_uring_start_io(state, r->fd, r->op, r->gen);
+    }
+    state->num_restarts = 0;
+
+    // Submit and wait in one syscall
+    unsigned flags = 0, min_complete = 0;
+    struct __kernel_timespec ts;
+    struct io_uring_getevents_arg arg;
+    memset(&arg, 0, sizeof(arg));
+    if (timeout != 0) {
+        flags = IORING_ENTER_GETEVENTS | IORING_ENTER_EXT_ARG;
+        min_complete = 1;
+        if (timeout > 0) {
+            ts.tv_sec = timeout / 1000;
+            ts.tv_nsec = (timeout % 1000) * 1000000LL;
+            arg.ts = (uint64_t)(uintptr_t)&ts;
+        }
+    }
+    int ret = _ae_uring_enter(state->ring_fd, state->to_submit, min_complete, flags,
+        (flags & IORING_ENTER_EXT_ARG) ? &arg : NULL, (flags & IORING_ENTER_EXT_ARG) ? sizeof(arg) : 0);
+    if (ret > 0) state->to_submit -= ret;  // Otherwise timed out or interrupted (ETIME, EINTR)
+
+    // Reap completions
+    unsigned head = *state->cq_head;
+    unsigned tail = atomic_load_explicit((_Atomic unsigned *)state->cq_tail, memory_order_acquire);
+    int num_events = 0;
+
+    while (head != tail && num_events < el->set_size) {
+        struct io_uring_cqe *cqe = &state->cqes[head & *state->cq_mask];
+        head ++;
+        if (cqe->user_data == AE_URING_IGNORE_DATA) continue;
+
+        int fd = (int)(cqe->user_data & 0xffffff);
+        int op = (int)((cqe->user_data >> 24) & 0xff);
+        unsigned gen = (unsigned)(cqe->user_data >> 32);
+        ae_fired_event *fe = &el->fired[num_events];
+        if (op != AE_IO_NONE) {
+            if (_ae_uring_complete_io(el, cqe, fd, op, gen, fe)) num_events ++;
+            continue;
+        }
+
+        if (gen != state->gen[fd] || !state->armed[fd]) continue;  // Stale, the poll was removed
+        state->armed[fd] = 0;
+        if (cqe->res < 0) {
+            // The fd can't be polled. Report it as ready so that the callback sees the error
+            cqe->res = POLLERR;
+        }
+
+        // Errors and hangups are reported as both readable and writable so that
+        // the callback gets a chance to read() or write() and see the error.
+        int mask = AE_STATE_NONE;
+        if (cqe->res & POLLIN)  mask |= AE_STATE_READABLE;
+        if (cqe->res & POLLOUT) mask |= AE_STATE_WRITABLE;
+        if (cqe->res & (POLLERR | POLLHUP)) mask |= AE_STATE_READABLE | AE_STATE_WRITABLE;
+        fe->fd = fd;
+        fe->state = mask;
+        fe->io_op = AE_IO_NONE;
+        num_events ++;
+    }
+    atomic_store_explicit((_Atomic unsigned *)state->cq_head, head, memory_order_release);
+
+    state->num_fired = num_events;
+    return num_events;
+}
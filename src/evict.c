@@ -0,0 +1,160 @@
+/*
+    ArenaDB maxmemory eviction. 5.25
+*/
+
+/*
+*   Once used memory is above server.maxmemory, keys are evicted before each write command until
+*   it's below again. See evict_perform(). Every shard evicts keys of its own databases.
+*
+*   Least recently used keys are found approximately, like Redis does. Each object keeps the LRU
+*   clock of its last access in 'lru', a cached clock of EVICT_LRU_CLOCK_RESOLUTION that costs
+*   nothing to read. A few keys of each database are sampled by dict_get_some_keys() into the
+*   eviction pool of the shard, which keeps the EVICT_POOL_SIZE most idle keys sampled so far,
+*   and the most idle of them is evicted. The pool carries good candidates over from previous
+*   samplings, so that a handful of samples per eviction gets close to true LRU.
+*/
+
+#include <string.h>
+#include "server.h"
+#include "evict.h"
+#include "dict.h"
+#include "db.h"
+#include "obj.h"
+#include "sds.h"
+#include "command.h"
+#include "util.h"
+#include "zmalloc.h"
+
+static void _evict_pool_populate(evict_pool_entry *pool);
+static void _evict_pool_insert(evict_pool_entry *pool, sds key, unsigned long long idle, int dbid);
+static sds _evict_pick_lru(evict_pool_entry *pool, database **db);
+static sds _evict_pick_random(database **db);
+
+// Init eviction for the calling shard. Called in shard_init(), after db_init().
+void evict_init()
+{
+    this_shard->lru_clock = evict_get_lru_clock();
+    this_shard->evict_pool = zcalloc(EVICT_POOL_SIZE, sizeof(evict_pool_entry));
+    this_shard->evict_db = 0;
+    this_shard->stat_evictedkeys = 0;
+}
+
+// Return the current LRU clock. Objects are stamped with the shard's cached copy, updated by
+// server_cron() at least once per tick.
+unsigned int evict_get_lru_clock()
+{
+    return (util_get_time_in_millisecond() / EVICT_LRU_CLOCK_RESOLUTION) & EVICT_LRU_CLOCK_MAX;
+}
+
+// Return the estimated time object 'o' hasn't been accessed for, in ms. The clock may have
+// wrapped around once since.
+unsigned long long evict_get_idle_ms(const arobj *o)
+{
+    unsigned int clock = this_shard->lru_clock;
+    unsigned long long ticks = (clock >= o->lru) ? clock - o->lru : clock + (EVICT_LRU_CLOCK_MAX - o->lru);
+    return ticks * EVICT_LRU_CLOCK_RESOLUTION;
+}
+
+// Evict keys of the calling shard until used memory is below server.maxmemory, at most
+// EVICT_MAX_KEYS_PER_CALL of them. Called before executing write commands.
+// Return C_ERR if memory is above the limit and nothing can be evicted, C_OK otherwise.
+int evict_perform()
+{
+    if (server.maxmemory == 0 || zmalloc_used_memory() <= server.maxmemory) return C_OK;
+    if (server.maxmemory_policy == EVICT_NOEVICTION) return C_ERR;
+
+    int evicted = 0;
+    while (evicted < EVICT_MAX_KEYS_PER_CALL && zmalloc_used_memory() > server.maxmemory) {
+        database *db;
+        sds key = (server.maxmemory_policy == EVICT_ALLKEYS_LRU) ?
+            _evict_pick_lru(this_shard->evict_pool, &db) : _evict_pick_random(&db);
+        if (key == NULL) break;     // No keys left in this shard
+
+        // Freed right away, so that used memory drops before the next check
+        db_delete(db, key, DB_FREE_SYNC);
+        sds_free(key);
+        evicted ++;
+        this_shard->stat_evictedkeys ++;
+    }
+    return (evicted > 0 || zmalloc_used_memory() <= server.maxmemory) ? C_OK : C_ERR;
+}
+
+// Return the name of eviction 'policy', EVICT_XXX.
+const char *evict_get_policy_name(int policy)
+{
+    switch (policy) {
+        case EVICT_ALLKEYS_LRU: return "allkeys-lru";
+        case EVICT_ALLKEYS_RANDOM: return "allkeys-random";
+    }
+    return "noeviction";
+}
+
+// Sample keys of every non-empty database into 'pool'.
+static void _evict_pool_populate(evict_pool_entry *pool)
+{
+    dict_entry *samples[EVICT_MAX_SAMPLES];
+    int num_samples = (server.maxmemory_samples < EVICT_MAX_SAMPLES) ? server.maxmemory_samples : EVICT_MAX_SAMPLES;
+
+    for (int i = 0; i < server.num_db; i ++) {
+        dict *d = this_shard->db[i].d;
+        if (dict_keys(d) == 0) continue;
+
+        unsigned int n = dict_get_some_keys(d, samples, num_samples);
+        for (unsigned int j = 0; j < n; j ++) {
+            _evict_pool_insert(pool, samples[j]->key, evict_get_idle_ms(dict_get_val(samples[j])), i);
+        }
+    }
+}
+
+// Insert 'key' of database 'dbid' into 'pool' if it's more idle than some key there. Entries are
+// sorted by idle time, the most idle last, and the empty ones are all at the end.
+static void _evict_pool_insert(evict_pool_entry *pool, sds key, unsigned long long idle, int dbid)
+{
+    int k = 0;
+    while (k < EVICT_POOL_SIZE && pool[k].key && pool[k].idle < idle) k ++;
+
+    if (pool[EVICT_POOL_SIZE - 1].key == NULL) {
+        // Room at the end. Shift the more idle entries right
+        memmove(pool + k + 1, pool + k, sizeof(evict_pool_entry) * (EVICT_POOL_SIZE - k - 1));
+    } else {
+        // Full. Drop the least idle entry, unless 'key' is even less idle
+        if (k == 0) return;
+        k --;
+        sds_free(pool[0].key);
+        memmove(pool, pool + 1, sizeof(evict_pool_entry) * k);
+    }
+    pool[k].idle = idle;
+    pool[k].key = sds_dup(key);
+    pool[k].dbid = dbid;
+}
+
+// Take the most idle key out of 'pool' after sampling. Keys deleted since they were sampled are
+// dropped. Return the key with its database in 'db', or NULL if there are no keys.
+static sds _evict_pick_lru(evict_pool_entry *pool, database **db)
+{
+    _evict_pool_populate(pool);
+    for (int k = EVICT_POOL_SIZE - 1; k >= 0; k --) {
+        if (pool[k].key == NULL) continue;
+
+        sds key = pool[k].key;
+        pool[k].key = NULL;
+        *db = this_shard->db + pool[k].dbid;
+        if (db_find(*db, key)) return key;
+        sds_free(key);
+    }
+    return NULL;
+}
+
+// Take a random key of the next non-empty database, round robin. Return the key with its
+// database in 'db', or NULL if there are no keys.
+static sds _evict_pick_random(database **db)
+{
+    for (int i = 0; i < server.num_db; i ++) {
+        *db = this_shard->db + this_shard->evict_db;
+        this_shard->evict_db = (this_shard->evict_db + 1) % server.num_db;
+
+        dict_entry *de = dict_get_fair_random_key((*db)->d);
+        if (de) return sds_dup(de->key);
+    }
+    return NULL;
+}
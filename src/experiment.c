@@ -330,10 +330,12 @@ int experiment_client_main()
             buf[bytes_read] = '\0';
 
             server_log(LL_VERBOSE, "Read() ok. Send() <'%s', %ld>", buf, bytes_read);
-            bytes_sent = send(socket_fd, buf, bytes_read, 0);
+            buf[bytes_read] = '\n'; // server reads commands line by line
+            bytes_sent = send(socket_fd, buf, bytes_read + 1, 0);
+            buf[bytes_read] = '\0';
             if (bytes_sent == -1) {
                 server_log(LL_NOTICE, "Send() failed. Please check your connectionn");
-            } else if (bytes_sent != bytes_read) {
+            } else if (bytes_sent != bytes_read + 1) {
                 server_log(LL_NOTICE, "Send() bad. Incomplete command sent. Please check your connectionn");
             } else {
                 server_log(LL_VERBOSE, "Send() ok <'%s', %ld>", buf, bytes_sent);
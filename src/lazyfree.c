@@ -0,0 +1,120 @@
+/*
+    ArenaDB lazy free. 5.19
+*/
+
+/*
+*   Freeing a big value, or a whole database on 'flushdb', takes time proportional to its size,
+*   which stalls every client of the shard. Instead, it's detached in O(1) and handed off to the
+*   lazyfree thread, which frees it in the background.
+*
+*   Jobs are appended to a FIFO queue guarded by a mutex, and the lazyfree thread sleeps on a
+*   condition variable while the queue is empty. Locking once per job is fine, since only values
+*   worth it are handed off. See lazyfree_get_effort(). Objects and dicts handed off must not be
+*   referenced by any shard anymore. Dict entries and objects freed by the thread go back to
+*   the slabs of their shard, see slab.c
+*/
+
+#include <stdlib.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include "lazyfree.h"
+#include "dict.h"
+#include "obj.h"
+#include "sds.h"
+#include "debug.h"
+#include "zmalloc.h"
+
+static pthread_t lazyfree_thread;
+static pthread_mutex_t lazyfree_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t lazyfree_cond = PTHREAD_COND_INITIALIZER;
+static lazyfree_job *lazyfree_head = NULL, *lazyfree_tail = NULL;
+static atomic_ulong lazyfree_pending = 0;  // jobs queued or being done
+static int lazyfree_started = 0;
+
+static void _lazyfree_push_job(int type, void *ptr);
+static void *_lazyfree_thread_main(void *arg);
+
+// Start the lazyfree thread. Called in server_init(). Does nothing if it's already started.
+void lazyfree_init()
+{
+    if (lazyfree_started) return;
+    if (pthread_create(&lazyfree_thread, NULL, _lazyfree_thread_main, NULL) != 0) {
+        server_panic("Failed to create the lazyfree thread");
+    }
+    lazyfree_started = 1;
+}
+
+// Return the cost of freeing object 'o', about the number of allocations or memory pages
+// released. A string is a single allocation, but unmapping a big one touches all its pages.
+size_t lazyfree_get_effort(const arobj *o)
+{
+    if (o->type == OBJ_TYPE_STRING && o->encoding == OBJ_ENC_SDS) {
+        return 1 + (sds_len(o->ptr) + sds_avail(o->ptr)) / 4096;
+    }
+    return 1;
+}
+
+// Release object 'o' in the background. Shared objects and objects referenced elsewhere
+// just drop a reference right away.
+void lazyfree_free_obj(arobj *o)
+{
+    if (o->ref_count != 1) {
+        obj_dec_ref(o);
+        return;
+    }
+    _lazyfree_push_job(LAZYFREE_JOB_OBJ, o);
+}
+
+// Release dict 'd' with all its entries in the background.
+void lazyfree_free_dict(dict *d)
+{
+    _lazyfree_push_job(LAZYFREE_JOB_DICT, d);
+}
+
+// Return the number of jobs not done yet.
+unsigned long lazyfree_get_pending()
+{
+    return atomic_load(&lazyfree_pending);
+}
+
+// Append a job to the queue and wake up the lazyfree thread
+static void _lazyfree_push_job(int type, void *ptr)
+{
+    lazyfree_job *job = zmalloc(sizeof(lazyfree_job));
+    job->type = type;
+    job->ptr = ptr;
+    job->next = NULL;
+
+    atomic_fetch_add(&lazyfree_pending, 1);
+    pthread_mutex_lock(&lazyfree_mutex);
+    if (lazyfree_tail) {
+        lazyfree_tail->next = job;
+    } else {
+        lazyfree_head = job;
+    }
+    lazyfree_tail = job;
+    pthread_cond_signal(&lazyfree_cond);
+    pthread_mutex_unlock(&lazyfree_mutex);
+}
+
+// Lazyfree thread. Take jobs in order and free them, without holding the lock.
+static void *_lazyfree_thread_main(void *arg)
+{
+    while (1) {
+        pthread_mutex_lock(&lazyfree_mutex);
+        while (lazyfree_head == NULL) pthread_cond_wait(&lazyfree_cond, &lazyfree_mutex);
+        lazyfree_job *job = lazyfree_head;
+        lazyfree_head = job->next;
+        if (lazyfree_head == NULL) lazyfree_tail = NULL;
+        pthread_mutex_unlock(&lazyfree_mutex);
+
+        switch (job->type) {
+            case LAZYFREE_JOB_OBJ: obj_dec_ref(job->ptr); break;
+            case LAZYFREE_JOB_DICT: dict_release(job->ptr); break;
+            default: server_panic("Unknown lazyfree job type %d", job->type); break;
+        }
+        zfree(job);
+        atomic_fetch_sub(&lazyfree_pending, 1);
+    }
+    return NULL;
+}
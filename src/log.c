@@ -42,8 +42,9 @@ void server_log_raw(int level, const char* msg)
         struct timeval tv;
         gettimeofday(&tv, NULL);
 
-        struct tm *tm = localtime(&tv.tv_sec);
-        off = strftime(buf, sizeof(buf), "%d %b %Y %H:%M:%S.", tm);
+        struct tm tm;
+        localtime_r(&tv.tv_sec, &tm);   // Thread-safe, as io threads log too
+        off = strftime(buf, sizeof(buf), "%d %b %Y %H:%M:%S.", &tm);
         snprintf(buf + off, sizeof(buf) - off, "%03d", (int)(tv.tv_usec/1000));
 
         //format: pid:role_char day month hour:minute:second.millisecond char_prompt msg
@@ -9,24 +9,66 @@
 #include <ctype.h>
 #include <time.h>
 #include <errno.h>
+#include <fcntl.h>
 #include <sys/socket.h> // socket()
 #include <sys/types.h>
 #include <netinet/in.h> // socketaddr_in(it contains a sin_addr)
 #include <arpa/inet.h>  // inet_addr()
+#include <netinet/tcp.h>    // TCP_NODELAY
+#include <pthread.h>
+#include <stdatomic.h>
 #include "config.h"
 #include "server.h"
 #include "client.h"
+#include "event.h"
 #include "obj.h"
 #include "sds.h"
 #include "debug.h"
 #include "log.h"
 #include "command.h"
+#include "util.h"
+#include "shard.h"
+#include "zmalloc.h"
 
-// Fd set that select() listens to
-static fd_set read_fds;
+#define STDIN_BUF_SIZE              1024
+#define NET_MAX_ACCEPTS_PER_CALL    1000
+#define NET_MAX_WRITES_PER_EVENT    (64*1024)
+#define NET_IOBUF_LEN               (16*1024)   // Max bytes to read from a client per read event
 
+// Operations io threads do on their clients
+#define IO_THREADS_OP_READ  0
+#define IO_THREADS_OP_WRITE 1
 
+static pthread_t io_threads[CONFIG_MAX_IO_THREADS];
+static pthread_mutex_t io_threads_mutex[CONFIG_MAX_IO_THREADS]; // Locked by the main thread to stop io threads
+static atomic_ulong io_threads_pending[CONFIG_MAX_IO_THREADS];  // Number of clients io thread i has to do
+static client **io_threads_list[CONFIG_MAX_IO_THREADS];         // Clients assigned to io thread i
+static int io_threads_list_len[CONFIG_MAX_IO_THREADS];
+static int io_threads_op;               // IO_THREADS_OP_XXX io threads do now
+static __thread long io_thread_id = 0;  // Id of the calling thread. 0 is the main thread
 
+static void net_accept_handler(ae_event_loop *el, int fd, int state);
+static void net_stdin_handler(ae_event_loop *el, int fd, int state);
+static void net_client_handler(ae_event_loop *el, int fd, int state);
+static void net_io_handler(ae_event_loop *el, int fd, int op, const char *buf, long res, void *client_data);
+static void _net_client_accepted(ae_event_loop *el, int client_fd, const char *ip);
+static void net_client_read(client *c);
+static void net_client_write(client *c);
+static void net_before_sleep(ae_event_loop *el);
+static void _net_handle_clients_with_pending_writes();
+static void _net_handle_clients_with_pending_sends();
+static void _net_handle_clients_with_pending_reads();
+static void _net_client_prepare_to_write(client *c);
+static int _net_postpone_client_read(client *c);
+static void _net_start_io_threads();
+static int _net_stop_io_threads_if_needed();
+static void _net_io_threads_run(client **clients, int num, int op);
+static void net_io_threads_init();
+static int net_set_nonblock(int fd);
+static int net_set_tcp_nodelay(int fd);
+
+
+// Init networking of the calling shard: its listening socket and its event loop.
 void net_init()
 {
     //char *server_ip_str = "0.0.0.0";
@@ -34,24 +76,30 @@ void net_init()
     //server.port = atol(server_port_str);
 
     // 1. Open a Socket
-    server.socket_fd = socket(AF_INET, SOCK_STREAM, 0);
-    if (server.socket_fd == -1) {
+    this_shard->socket_fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (this_shard->socket_fd == -1) {
         server_panic("Server failed to create socket (Error: %s)", strerror(errno));
         return;
-    } else if (server.socket_fd != 3) {
-        server_panic("Server socket_fd %d != 3", server.socket_fd);
+    } else if (this_shard->id == 0 && this_shard->socket_fd != 3) {
+        server_panic("Server socket_fd %d != 3", this_shard->socket_fd);
         return;
     } else {
-        server_log(LL_VERBOSE, "Server socket created with fd: %d", server.socket_fd);
+        server_log(LL_VERBOSE, "Server socket created with fd: %d", this_shard->socket_fd);
     }
 
     // Set option to reused socket address
     int reuse = 1;
-    if (setsockopt(server.socket_fd, SOL_SOCKET, SO_REUSEADDR, (char*)&reuse, sizeof(reuse)) == -1) {
+    if (setsockopt(this_shard->socket_fd, SOL_SOCKET, SO_REUSEADDR, (char*)&reuse, sizeof(reuse)) == -1) {
         server_log(LL_VERBOSE, "Server socket set option 'SO_REUSEADDR' failed.");
     } else {
         server_log(LL_VERBOSE, "Server socket set option 'SO_REUSEADDR' ok.");
     }
+    // Every shard listens on the same port. The kernel spreads connections over them
+    if (server.num_shards > 1 &&
+        setsockopt(this_shard->socket_fd, SOL_SOCKET, SO_REUSEPORT, (char*)&reuse, sizeof(reuse)) == -1) {
+        server_panic("Server socket failed to set option 'SO_REUSEPORT' (Error: %s)", strerror(errno));
+        return;
+    }
 
 
 
@@ -61,7 +109,7 @@ void net_init()
     listen_addr.sin_addr.s_addr = INADDR_ANY;
     listen_addr.sin_port = htons(server.port);
 
-    if (bind(server.socket_fd, (struct sockaddr*)&listen_addr, sizeof(struct sockaddr_in)) == -1) {
+    if (bind(this_shard->socket_fd, (struct sockaddr*)&listen_addr, sizeof(struct sockaddr_in)) == -1) {
         server_panic("Server socket failed to bind (Error: %s)", strerror(errno));
         return;
     } else {
@@ -70,217 +118,953 @@ void net_init()
         server_log(LL_NOTICE,"Server socket bind to address: %s port: %d", server.ip, server.port);
     }
 
+    // The listening socket is non-blocking so that accept() never blocks the event loop
+    if (net_set_nonblock(this_shard->socket_fd) == -1) {
+        server_panic("Server socket failed to set non-blocking (Error: %s)", strerror(errno));
+        return;
+    }
+
     // 3. listen
-    if (listen(server.socket_fd, 3) == -1) {
+    if (listen(this_shard->socket_fd, 511) == -1) {
         server_panic("Server socket failed to listen (Error: %s)", strerror(errno));
         return;
     } else {
         server_log(LL_NOTICE, "Server socket is listening...");
     }
 
-    // 4. Init fds for select()
-    FD_ZERO(&read_fds);
-    FD_ZERO(&server.active_fds);
+    // 4. Create the event loop and register listening socket & stdin to it
+    this_shard->el = ae_create_event_loop(server.max_clients + CONFIG_FDSET_INCR, server.event_backend);
+    if (this_shard->el == NULL) {
+        server_panic("Server failed to create event loop (Error: %s)", strerror(errno));
+        return;
+    }
+    // The event loop accepts, receives and sends itself if it can. Not with io threads, which
+    // do the reads and writes of clients
+    int io_ops = AE_IO_ACCEPT | AE_IO_RECV | AE_IO_SEND;
+    this_shard->io_completion = (ae_get_io_ops(this_shard->el) & io_ops) == io_ops && server.io_threads_num == 1;
+    if (this_shard->id == 0) {
+        server_log(LL_NOTICE, "Server event loop polled by %s%s", ae_get_api_name(this_shard->el),
+            this_shard->io_completion ? ", client I/O completed by the event loop" : "");
+    }
+    int ret = this_shard->io_completion ?
+        ae_create_io_event(this_shard->el, this_shard->socket_fd, AE_IO_ACCEPT, net_io_handler, NULL) :
+        ae_create_file_event(this_shard->el, this_shard->socket_fd, AE_STATE_READABLE, net_accept_handler);
+    if (ret == AE_ERR) {
+        server_panic("Server failed to monitor socket fd (Error: %s)", strerror(errno));
+        return;
+    }
+    // Replies produced in an iteration are written out together right before the next poll
+    ae_set_before_sleep_proc(this_shard->el, net_before_sleep);
 
-    FD_SET(server.socket_fd, &server.active_fds);
-    FD_SET(server.stdin_fd, &server.active_fds);
+    if (this_shard->id != 0) return;
+    // stdin may be a file or /dev/null that epoll refuses to monitor. The server works without it.
+    if (ae_create_file_event(this_shard->el, server.stdin_fd, AE_STATE_READABLE, net_stdin_handler) == AE_ERR) {
+        server_log(LL_VERBOSE, "Server not monitoring 'stdin' (Error: %s)", strerror(errno));
+    }
+    net_io_threads_init();
 }
 
+// Run the event loop of the calling shard until the server is told to exit.
+void net_loop()
+{
+    ae_main(this_shard->el);
+}
 
-int net_loop()
+/*--------------------- PROCESS LOCAL STDIN INPUT ----------------------------*/
+static void net_stdin_handler(ae_event_loop *el, int fd, int state)
 {
-    size_t bytes_read = 0;
-    char fd_buf[2048];  // fd
-    //size_t bytes_sent = 0;
-    int num_avail_fd = 0; // number of available fd after select()
+    server_log(LL_DEBUG, "'stdin' available for reading");
+    server_log(LL_DEBUG, "Read() from 'stdin'");
+
+    ssize_t bytes_read = read(fd, server.stdin_buf, STDIN_BUF_SIZE - 1);
+    if (bytes_read == -1) {
+        server_log(LL_ERROR, "Read() failed (Error %s)", strerror(errno));
+        return;
+    } else if (bytes_read == 0) {
+        server_log(LL_DEBUG, "Read() none. 'stdin' closed, stop monitoring it");
+        ae_delete_file_event(el, fd, AE_STATE_READABLE);
+        return;
+    }
 
-    //sprintf(fd_buf, "%d %d", 10, 20);
-    //server_log(LL_DEBUG, "Select() monitoring fds: %s", fd_buf);
+    // procces the stdin_buf
+    if (server.stdin_buf[bytes_read - 1] == '\n') bytes_read --;// delete last char if it is a new line char, '\n'
+    server.stdin_buf[bytes_read] = '\0'; // null-terminated command string
+    server_log(LL_DEBUG, "Read() ok. Processing command <'%s', %ld>", server.stdin_buf, bytes_read);
 
-    // TODO -i enable iteractive server, this should be an option
-    while(1) {
-        read_fds = server.active_fds;
-        // Print fds that will be monitored by select()
-        for(int fd = 0, len = 0; fd < FD_SETSIZE; fd ++) {
-            if (FD_ISSET(fd, &read_fds)) {
-                len += snprintf(fd_buf + len, sizeof(fd_buf) - len, "%d ", fd);
+    // executet command in the stdin_buf
+    if (strcasecmp(server.stdin_buf, "exit") == 0) {
+        server_log(LL_DEBUG, "Command 'exit'. Server exiting...");
+        // Clients are closed once all shards stop. See shard_run()
+        shard_stop_all();
+    } else {
+        server_log(LL_DEBUG, "Unknown command <%s, %ld>", server.stdin_buf, bytes_read);
+    }
+}
+
+/*-------------------- PROCESS REMOET CLIENT NEW CONNECTION ----------------------*/
+static void net_accept_handler(ae_event_loop *el, int fd, int state)
+{
+    // The listening socket is non-blocking. Accept all pending connections, but not
+    // too many in one call so that other clients don't wait too long.
+    for (int i = 0; i < NET_MAX_ACCEPTS_PER_CALL; i ++) {
+        struct sockaddr_in client_addr;
+        socklen_t addr_size = sizeof(struct sockaddr_in);
+        char ip_buf[17];
+
+        int client_fd = accept(fd, (struct sockaddr*)&client_addr, &addr_size);
+        if (client_fd == -1) {
+            if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+                server_log(LL_VERBOSE, "Accept() failed (Error %s)", strerror(errno));
             }
+            return;
         }
-        server_log(LL_DEBUG, "Select() monitoring fds: %s", fd_buf);
 
-        // Select
-        num_avail_fd = select(FD_SETSIZE, &read_fds, NULL, NULL, 0);  // block wait since timeout is set to 0.
-        if (num_avail_fd <= 0) {              // so result shoud be >= 0 in this case of block waiting
-            server_log(LL_ERROR, "Select() failed (Error %s)", strerror(errno));
-            return 1;
+        strcpy(ip_buf, inet_ntoa(client_addr.sin_addr));
+        _net_client_accepted(el, client_fd, ip_buf);
+    }
+}
+
+// Register the client of connection 'client_fd' just accepted from 'ip', and start reading it.
+static void _net_client_accepted(ae_event_loop *el, int client_fd, const char *ip)
+{
+    // Sockets the event loop does I/O on stay blocking, so that the kernel waits for them
+    // rather than failing the I/O with EAGAIN
+    if (!this_shard->io_completion && net_set_nonblock(client_fd) == -1) {
+        server_log(LL_VERBOSE, "Accept() rejected client from %s. Can't set non-blocking (Error %s)",
+            ip, strerror(errno));
+        close(client_fd);
+        return;
+    }
+    net_set_tcp_nodelay(client_fd);
+
+    client *c = client_register(client_fd);
+    int ret = AE_ERR;
+    if (c) {
+        ret = this_shard->io_completion ?
+            ae_create_io_event(el, client_fd, AE_IO_RECV, net_io_handler, c) :
+            ae_create_file_event(el, client_fd, AE_STATE_READABLE, net_client_handler);
+    }
+    if (ret == AE_ERR) {
+        server_log(LL_VERBOSE, "Accept() rejected client from %s. Max number of clients reached", ip);
+        if (c) client_unregister(client_fd);
+        else close(client_fd);
+        return;
+    }
+    // Replies sent from reply_buf are then fixed buffer writes. Others work without it
+    if (this_shard->io_completion) ae_register_buffer(el, client_fd, c->reply_buf, CLIENT_REPLY_BUF_SIZE);
+    this_shard->stat_numconnections ++;
+    server_log(LL_VERBOSE, "Accept() ok. New client from %s. Client fd: %d added", ip, client_fd);
+}
+
+/*------------------------- PROCESS REMOTE CLIENT COMMANDS & REPLIES ----------------------------*/
+static void net_client_handler(ae_event_loop *el, int fd, int state)
+{
+    client *c = client_lookup(fd);
+
+    if (state & AE_STATE_READABLE) {
+        if (!_net_postpone_client_read(c)) {
+            net_client_read(c);
+            // The client may have been closed while reading
+            if ((c = client_lookup(fd)) == NULL) return;
         }
+    }
+    if (state & AE_STATE_WRITABLE) {
+        net_client_write(c);
+    }
+}
 
-        // TODO Simulate a time consuming processing in server side. Will we loss some client connections while processing?
-        //sleep(10);
+// Read from client 'c' into its query buf. Return the number of bytes read, 0 if there is
+// nothing to read yet, or -1 if the client should be closed. Nothing but 'c' is touched,
+// so io threads can call it.
+static ssize_t _net_client_read_from_socket(client *c)
+{
+    int client_fd = c->fd;
+    size_t qb_len = sds_len(c->query_buf);
+    size_t read_len = NET_IOBUF_LEN;
 
-        /*--------------------- PROCESS LOCAL STDIN INPUT IF NEEDED ----------------------------*/
-        if (FD_ISSET(server.stdin_fd, &read_fds)) {
-            num_avail_fd --;
+    // Don't let the query buf grow beyond its limit
+    if (qb_len + read_len > CLIENT_MAX_QUERY_BUF_LEN) read_len = CLIENT_MAX_QUERY_BUF_LEN - qb_len;
+    if (read_len == 0) {
+        server_log(LL_VERBOSE, "Query buf of client fd: %d exceeds max length. Close it", client_fd);
+        return -1;
+    }
+    c->query_buf = sds_make_room_for(c->query_buf, read_len);
 
-            server_log(LL_DEBUG, "Select() ok. 'stdin' available for reading");
-            server_log(LL_DEBUG, "Read() from 'stdin'");
+    server_log(LL_VERBOSE, "Recv() from client fd: %d", client_fd);
+    ssize_t bytes_read = recv(client_fd, c->query_buf + qb_len, read_len, 0);
+    if (bytes_read == -1) {
+        if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) return 0; // Nothing to read yet
+        server_log(LL_VERBOSE, "Recv() failed (Error %s). Close client fd: %d", strerror(errno), client_fd);
+        return -1;
+    } else if (bytes_read == 0) {
+        server_log(LL_VERBOSE, "Recv() none. Close client fd: %d", client_fd);
+        return -1;
+    }
+    sds_incr_len(c->query_buf, bytes_read);
 
-            bytes_read = read(server.stdin_fd, server.stdin_buf, sizeof(server.stdin_buf));
-            if (bytes_read == -1) {
-                server_log(LL_ERROR, "Read() failed (Error %s)", strerror(errno));
-                return 1;
-            }
+    server_log(LL_VERBOSE, "Recv() ok. %ld bytes, query buf %lu bytes", bytes_read, sds_len(c->query_buf));
+    return bytes_read;
+}
 
-            // procces the stdin_buf
-            if (server.stdin_buf[bytes_read - 1] == '\n') bytes_read --;// delete last char if it is a new line char, '\n'
-            server.stdin_buf[bytes_read] = '\0'; // null-terminated command string
-            server_log(LL_DEBUG, "Read() ok. Processing command <'%s', %ld>", server.stdin_buf, bytes_read);
-
-            // executet command in the stdin_buf
-            if (strcasecmp(server.stdin_buf, "exit") == 0) {
-                server_log(LL_DEBUG, "Command 'exit'. Server exiting...");
-                close(server.socket_fd);
-                for(int client_fd = server.socket_fd + 1; client_fd < FD_SETSIZE; client_fd ++) {
-                    if (FD_ISSET(client_fd, &read_fds)) {
-                        close(client_fd);
-                    }
-                }
-                return 0;
-            } else {
-                server_log(LL_DEBUG, "Unknown command <%s, %ld>", server.stdin_buf, bytes_read);
-            }
+// Read from client 'c' into its query buf and process the commands received.
+static void net_client_read(client *c)
+{
+    int client_fd = c->fd;
+
+    ssize_t bytes_read = _net_client_read_from_socket(c);
+    if (bytes_read == -1) {
+        client_unregister(client_fd);
+        return;
+    } else if (bytes_read == 0) {
+        return;
+    }
+    // Now we process commands in client's query_buf
+    command_process(c);
+
+    // Close now if the command asked so and there is nothing left to reply
+    if ((c->flags & CLIENT_CLOSE_AFTER_REPLY) && !client_has_pending_replies(c)) {
+        client_unregister(client_fd);
+    }
+}
+
+// Point '*p' at the next pending reply bytes of client 'c' to send, the rest of reply_buf or of
+// the head block of the reply list, and return their length. 0 if nothing is pending.
+static size_t _net_client_reply_next(client *c, const char **p)
+{
+    if (c->reply_size > 0) {
+        *p = c->reply_buf + c->sent_len;
+        return c->reply_size - c->sent_len;
+    } else if (c->reply_head != NULL) {
+        *p = c->reply_head->buf + c->sent_len;
+        return c->reply_head->used - c->sent_len;
+    }
+    *p = NULL;
+    return 0;
+}
+
+// Account 'len' bytes of the pending replies of client 'c' as sent.
+static void _net_client_reply_sent(client *c, size_t len)
+{
+    c->sent_len += len;
+    if (c->reply_size > 0) {
+        // Whole reply_buf sent, reset it
+        if (c->sent_len == c->reply_size) {
+            c->reply_size = 0;
+            c->sent_len = 0;
+        }
+    } else {
+        client_reply_block *block = c->reply_head;
+        // Whole head block sent, remove it from the reply list
+        if (c->sent_len == block->used) {
+            c->reply_head = block->next;
+            if (c->reply_head == NULL) c->reply_tail = NULL;
+            c->reply_list_bytes -= block->used;
+            c->sent_len = 0;
+            zfree(block);
+        }
+    }
+}
+
+// Write pending replies of client 'c' to its socket. Write as much as the socket accepts, but
+// at most NET_MAX_WRITES_PER_EVENT bytes so that a client with huge replies doesn't starve
+// others. What's left is written next time. Return -1 if the client should be closed,
+// otherwise 0. Nothing but 'c' is touched, so io threads can call it.
+static int _net_client_write_to_socket(client *c)
+{
+    int client_fd = c->fd;
+    ssize_t bytes_sent = 0, total_sent = 0;
+
+    while (client_has_pending_replies(c)) {
+        const char *p;
+        size_t len = _net_client_reply_next(c, &p);
+        bytes_sent = send(client_fd, p, len, 0);
+        if (bytes_sent <= 0) break;
+        _net_client_reply_sent(c, bytes_sent);
+        total_sent += bytes_sent;
+        if (total_sent > NET_MAX_WRITES_PER_EVENT) break;
+    }
+
+    if (bytes_sent == -1) {
+        if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+            server_log(LL_VERBOSE, "Send() failed (Error %s). Close client fd: %d", strerror(errno), client_fd);
+            return -1;
         }
-        if ( num_avail_fd == 0) continue;  // contine if no other fd available
+    } else if (bytes_sent == 0 && client_has_pending_replies(c)) {
+        server_log(LL_VERBOSE, "Send() none. Close client fd: %d", client_fd);
+        return -1;
+    }
+    server_log(LL_VERBOSE, "Send() ok. %ld bytes to client fd: %d", total_sent, client_fd);
+    return 0;
+}
+
+// Write pending replies to client 'c'. Called when the client socket becomes writable.
+static void net_client_write(client *c)
+{
+    int client_fd = c->fd;
+
+    if (_net_client_write_to_socket(c) == -1) {
+        client_unregister(client_fd);
+        return;
+    }
+    if (!client_has_pending_replies(c)) {
+        // Nothing left to write. Stop monitoring writable state
+        ae_delete_file_event(this_shard->el, client_fd, AE_STATE_WRITABLE);
+        if (c->flags & CLIENT_CLOSE_AFTER_REPLY) client_unregister(client_fd);
+    }
+}
 
+/*------------------------- CLIENT I/O COMPLETED BY THE EVENT LOOP ----------------------------*/
+// When the event loop can do the I/O itself, net_io_handler() replaces net_accept_handler() and
+// net_client_handler(). The loop accepts and receives over and over, and calls it with what's
+// done. Replies are sent by _net_handle_clients_with_pending_sends(). The loop submits all that
+// together with the wait, so a round of requests costs one syscall rather than a read and a
+// write per client. The sockets are blocking, the kernel waits for them to be ready.
+//
+// A client blocked while another shard executes its command may still complete I/O. Data
+// received is kept aside in its recv_buf, since the arguments of the command are views into its
+// query buf. The result of a send is kept in send_res, since the other shard may be appending
+// replies. Both are taken in once the client is unblocked.
 
-        /*-------------------- PROCESS REMOET CLIENT NEW CONNECTION IF NEEDED----------------------*/
-        if (FD_ISSET(server.socket_fd, &read_fds)) {
-            num_avail_fd --;
+// Close client 'c' whose connection is broken. A blocked client is closed once unblocked.
+static void _net_client_close_asap(client *c)
+{
+    if (c->flags & CLIENT_BLOCKED) {
+        c->flags |= CLIENT_CLOSE_ASAP;
+        ae_delete_io_event(this_shard->el, c->fd, AE_IO_RECV);
+    } else {
+        client_unregister(c->fd);
+    }
+}
 
-            struct sockaddr_in client_addr;
-            unsigned int addr_size = sizeof(struct sockaddr);
-            char ip_buf[17];
+// Process 'res' bytes at 'buf' received from client 'c', or end of file if 0, or an error.
+static void _net_client_recv_done(client *c, const char *buf, long res)
+{
+    int client_fd = c->fd;
 
-            server_log(LL_DEBUG, "Select() ok. Server socket ready to accept() new connection");
-            server_log(LL_VERBOSE, "Accept() new client connection");
+    if (res <= 0) {
+        if (res == 0) server_log(LL_VERBOSE, "Recv() none. Close client fd: %d", client_fd);
+        else server_log(LL_VERBOSE, "Recv() failed (Error %s). Close client fd: %d", strerror(-res), client_fd);
+        _net_client_close_asap(c);
+        return;
+    }
+    if (sds_len(c->query_buf) + sds_len(c->recv_buf) + res > CLIENT_MAX_QUERY_BUF_LEN) {
+        server_log(LL_VERBOSE, "Query buf of client fd: %d exceeds max length. Close it", client_fd);
+        _net_client_close_asap(c);
+        return;
+    }
+    if (c->flags & CLIENT_BLOCKED) {
+        c->recv_buf = sds_cat_len(c->recv_buf, buf, res);
+        return;
+    }
+    c->query_buf = sds_cat_len(c->query_buf, buf, res);
+    server_log(LL_VERBOSE, "Recv() ok. %ld bytes, query buf %lu bytes", res, sds_len(c->query_buf));
 
-            int client_fd = accept(server.socket_fd, (struct sockaddr*)&client_addr, &addr_size);
-            if (client_fd == -1) {
-                server_log(LL_VERBOSE, "Accept() failed (Error %s)", strerror(errno));
-                continue;
-            }
+    command_process(c);
+    if ((c->flags & CLIENT_CLOSE_AFTER_REPLY) && !client_has_pending_replies(c)) {
+        client_unregister(client_fd);
+    }
+}
 
+// Account the result 'res' of a send to client 'c'. Return -1 if the client should be closed,
+// otherwise 0.
+static int _net_client_send_result(client *c, long res)
+{
+    if (res < 0) {
+        if (res == -EAGAIN || res == -EINTR) return 0;
+        server_log(LL_VERBOSE, "Send() failed (Error %s). Close client fd: %d", strerror(-res), c->fd);
+        return -1;
+    } else if (res == 0) {
+        server_log(LL_VERBOSE, "Send() none. Close client fd: %d", c->fd);
+        return -1;
+    }
+    _net_client_reply_sent(c, res);
+    server_log(LL_VERBOSE, "Send() ok. %ld bytes to client fd: %d", res, c->fd);
+    return 0;
+}
+
+// Process the result 'res' of a send to client 'c', and queue the rest of its replies, if any.
+static void _net_client_send_done(client *c, long res)
+{
+    int client_fd = c->fd;
+
+    c->flags &= ~CLIENT_SEND_IN_FLIGHT;
+    if (c->flags & CLIENT_BLOCKED) {
+        c->send_res = res;
+        return;
+    }
+    // The client was closed while the send was in flight. See client_unregister()
+    if ((c->flags & CLIENT_CLOSE_ASAP) || _net_client_send_result(c, res) == -1) {
+        client_unregister(client_fd);
+        return;
+    }
+    if (client_has_pending_replies(c)) {
+        _net_client_prepare_to_write(c);
+    } else if (c->flags & CLIENT_CLOSE_AFTER_REPLY) {
+        client_unregister(client_fd);
+    }
+}
+
+// Called when an I/O operation of the event loop completes. 'res' is what the syscall would
+// return, or -errno.
+static void net_io_handler(ae_event_loop *el, int fd, int op, const char *buf, long res, void *client_data)
+{
+    if (op == AE_IO_ACCEPT) {
+        if (res < 0) {
+            server_log(LL_VERBOSE, "Accept() failed (Error %s)", strerror(-res));
+            return;
+        }
+        struct sockaddr_in client_addr;
+        socklen_t addr_size = sizeof(struct sockaddr_in);
+        char ip_buf[17] = "?";
+        if (getpeername(res, (struct sockaddr*)&client_addr, &addr_size) == 0) {
             strcpy(ip_buf, inet_ntoa(client_addr.sin_addr));
-            server_log(LL_VERBOSE, "Accept() ok. New client from %s. Client fd: %d added",ip_buf, client_fd);
-            client_register(client_fd);
-            FD_SET(client_fd, &server.active_fds);
         }
-        if ( num_avail_fd == 0) continue;  // contine if no other fd available
+        _net_client_accepted(el, res, ip_buf);
+    } else if (op == AE_IO_RECV) {
+        _net_client_recv_done(client_data, buf, res);
+    } else {
+        _net_client_send_done(client_data, res);
+    }
+}
 
-        /*------------------------- PROCESS REMOTE CLIENT COMMANDS IF ANY ----------------------------*/
-        server_log(LL_DEBUG, "Select() ok. Now %d client fd%s available for recv()",
-            num_avail_fd, (num_avail_fd > 1) ? "s": "");
+// Queue a send of the pending replies of all clients in the pending write list. They are
+// submitted together by the next poll. A client has one send in flight at a time, of reply_buf
+// or of the head block of its reply list. The rest is queued once it completes.
+static void _net_handle_clients_with_pending_sends()
+{
+    while (this_shard->num_pending_write > 0) {
+        client *c = this_shard->clients_pending_write[-- this_shard->num_pending_write];
+        int client_fd = c->fd;
+        c->flags &= ~CLIENT_PENDING_WRITE;
 
-        for(int client_fd = server.socket_fd + 1; client_fd < FD_SETSIZE; client_fd ++) {
-            if (!FD_ISSET(client_fd, &read_fds))
-                continue;
+        const char *p;
+        size_t len = _net_client_reply_next(c, &p);
+        if (len == 0) continue;
+        if (ae_send(this_shard->el, client_fd, p, len) == AE_ERR) {
+            server_log(LL_VERBOSE, "Failed to send to client fd: %d. Close it", client_fd);
+            client_unregister(client_fd);
+            continue;
+        }
+        c->flags |= CLIENT_SEND_IN_FLIGHT;
+    }
+}
+
+// Called before the event loop polls. Handle the reads postponed for io threads, if any, then
+// write replies of all clients in the pending write list.
+static void net_before_sleep(ae_event_loop *el)
+{
+    _net_handle_clients_with_pending_reads();
+    if (this_shard->io_completion) _net_handle_clients_with_pending_sends();
+    else _net_handle_clients_with_pending_writes();
+}
 
-            server_log(LL_VERBOSE, "Recv() from client fd: %d", client_fd);
-            client *c = client_lookup(client_fd);
-            bytes_read = recv(client_fd, c->recv_buf, CLIENT_BUF_SIZE, 0);
-            if (bytes_read == -1) {
-                server_log(LL_VERBOSE, "Recv() failed (Error %s). Close client fd: %d", strerror(errno), client_fd);
+// Write replies of all clients in the pending write list, so that all replies of pipelined
+// commands processed in this iteration go out in one write, usually without the cost of
+// installing a writable event. Only clients whose socket can't take all replies now get a
+// writable event to write the rest later. The writes are spread over io threads if enabled.
+static void _net_handle_clients_with_pending_writes()
+{
+    int threaded = !_net_stop_io_threads_if_needed();
 
-                FD_CLR(client_fd, &server.active_fds);
-                close(client_fd);
-                continue;
-            } else if (bytes_read == 0) {
-                server_log(LL_VERBOSE, "Recv() none. Close client fd: %d", client_fd);
+    if (threaded) {
+        if (!server.io_threads_active) _net_start_io_threads();
+        for (int i = 0; i < this_shard->num_pending_write; i ++) {
+            this_shard->clients_pending_write[i]->flags &= ~CLIENT_PENDING_WRITE;
+        }
+        _net_io_threads_run(this_shard->clients_pending_write, this_shard->num_pending_write, IO_THREADS_OP_WRITE);
+    }
+
+    while (this_shard->num_pending_write > 0) {
+        client *c = this_shard->clients_pending_write[-- this_shard->num_pending_write];
+        int client_fd = c->fd;
 
-                FD_CLR(client_fd, &server.active_fds);
-                close(client_fd);
+        if (threaded) {
+            if (c->flags & CLIENT_CLOSE_ASAP) {
+                client_unregister(client_fd);
                 continue;
             }
-            // Now we process command in client's recv_buf
-            c->recv_buf[bytes_read] = '\0';
-            c->recv_size = bytes_read;
-            c->reply_size = 0;
+        } else {
+            c->flags &= ~CLIENT_PENDING_WRITE;
+            if (_net_client_write_to_socket(c) == -1) {
+                client_unregister(client_fd);
+                continue;
+            }
+        }
+
+        if (client_has_pending_replies(c)) {
+            if (ae_create_file_event(this_shard->el, client_fd, AE_STATE_WRITABLE, net_client_handler) == AE_ERR) {
+                server_log(LL_VERBOSE, "Failed to monitor writable state of client fd: %d. Close it", client_fd);
+                client_unregister(client_fd);
+            }
+        } else if (c->flags & CLIENT_CLOSE_AFTER_REPLY) {
+            client_unregister(client_fd);
+        }
+    }
+}
 
-            server_log(LL_VERBOSE, "Recv() ok <'%s', %ld>", c->recv_buf, bytes_read);
-            command_process(c);
+// Put client 'c' in the pending write list if it isn't there yet and has no write in progress.
+static void _net_client_prepare_to_write(client *c)
+{
+    // Called by an io thread, or by another shard executing a forwarded command. The client is
+    // queued later by its own shard
+    if (io_thread_id != 0 || c->shard != this_shard) return;
+    if (c->flags & (CLIENT_PENDING_WRITE | CLIENT_SEND_IN_FLIGHT)) return;
+    if (ae_get_file_events(this_shard->el, c->fd) & AE_STATE_WRITABLE) return; // Being written by the writable event already
+    c->flags |= CLIENT_PENDING_WRITE;
+    this_shard->clients_pending_write[this_shard->num_pending_write ++] = c;
+}
 
+// Block client 'c' while its command is executed by another shard. It's neither read nor
+// written, so that the other shard can safely use its arguments and append replies to it.
+void net_client_block(client *c)
+{
+    // Replies of earlier commands are written after it's unblocked
+    if (c->flags & CLIENT_PENDING_WRITE) {
+        client_list_remove(this_shard->clients_pending_write, &this_shard->num_pending_write, c);
+        c->flags &= ~CLIENT_PENDING_WRITE;
+    }
+    c->flags |= CLIENT_BLOCKED;
+    ae_delete_file_event(this_shard->el, c->fd, AE_STATE_READABLE | AE_STATE_WRITABLE);
+}
+
+// Unblock client 'c' once its command is done by another shard. Its replies are queued to
+// write and the commands following in its query buf are processed.
+void net_client_unblock(client *c)
+{
+    int client_fd = c->fd;
+
+    c->flags &= ~CLIENT_BLOCKED;
+    if (this_shard->io_completion) {
+        // Take in I/O completed while blocked
+        long send_res = c->send_res;
+        c->send_res = 0;
+        if ((c->flags & CLIENT_CLOSE_ASAP) || (send_res != 0 && _net_client_send_result(c, send_res) == -1)) {
+            client_unregister(client_fd);
+            return;
         }
+    } else if (ae_create_file_event(this_shard->el, client_fd, AE_STATE_READABLE, net_client_handler) == AE_ERR) {
+        server_log(LL_VERBOSE, "Failed to monitor readable state of client fd: %d. Close it", client_fd);
+        client_unregister(client_fd);
+        return;
+    }
+    if (client_has_pending_replies(c)) _net_client_prepare_to_write(c);
+
+    command_process(c);
+    // Then the data received while blocked. The query buf can't grow before the arguments of
+    // the command done, views into it, are released by command_process()
+    if (!(c->flags & CLIENT_BLOCKED) && sds_len(c->recv_buf) > 0) {
+        c->query_buf = sds_cat_len(c->query_buf, c->recv_buf, sds_len(c->recv_buf));
+        sds_free(c->recv_buf);
+        c->recv_buf = sds_new_empty();
+        command_process(c);
+    }
+    if ((c->flags & CLIENT_CLOSE_AFTER_REPLY) && !client_has_pending_replies(c)) {
+        client_unregister(client_fd);
+    }
+}
+
+/*-------------------------------- THREADED I/O ----------------------------------*/
+// With server.io_threads_num > 1, reading & parsing client queries and writing client replies
+// are spread over io threads, while commands are still executed by the main thread only, so
+// the db needs no locking. The main thread works as io thread 0. It goes like this:
+//  1. A readable client is not read by its event handler, but put in the pending read list.
+//  2. Before the event loop polls again, pending reads are assigned to io threads round-robin.
+//     Each thread reads its clients and parses their first command. The main thread waits for
+//     all of them, then executes the parsed commands and the rest in the query bufs.
+//  3. Clients in the pending write list are assigned to io threads the same way and written.
+// Io threads busy wait for work, so they only run when there are enough clients to write.
+// Otherwise the main thread stops them and does all I/O itself.
+
+// Start io threads. They wait for work after the main thread unlocks their mutexes.
+static void _net_start_io_threads()
+{
+    server_log(LL_VERBOSE, "Starting %d io threads", server.io_threads_num - 1);
+    for (int id = 1; id < server.io_threads_num; id ++) {
+        pthread_mutex_unlock(&io_threads_mutex[id]);
+    }
+    server.io_threads_active = 1;
+}
+
+// Stop io threads. They block on their mutexes once they finish the work at hand.
+static void _net_stop_io_threads()
+{
+    // Reads pending are done before io threads stop
+    _net_handle_clients_with_pending_reads();
+    server_log(LL_VERBOSE, "Stopping %d io threads", server.io_threads_num - 1);
+    for (int id = 1; id < server.io_threads_num; id ++) {
+        pthread_mutex_lock(&io_threads_mutex[id]);
+    }
+    server.io_threads_active = 0;
+}
+
+// Stop io threads if there are too few clients to write for them to pay off. Return 1 if io
+// threads are stopped or disabled, so that the main thread should do the I/O itself.
+static int _net_stop_io_threads_if_needed()
+{
+    if (server.io_threads_num == 1) return 1;
+    if (this_shard->num_pending_write < server.io_threads_num * 2) {
+        if (server.io_threads_active) _net_stop_io_threads();
+        return 1;
     }
     return 0;
 }
 
-// TODO for all append functions. If reply_size reaches CLIENT_BUF_SIZE, we need to flush it and append remaining.
-// Append to client reply buf with print-like format
+// Read from client 'c' and parse the first command in its query buf. Called by io threads.
+// The command is left for the main thread to execute.
+static void _net_client_read_and_parse(client *c)
+{
+    ssize_t bytes_read = _net_client_read_from_socket(c);
+    if (bytes_read == -1) {
+        c->flags |= CLIENT_CLOSE_ASAP;
+    } else if (bytes_read > 0) {
+        if (command_parse_client_args(c) == C_OK) c->flags |= CLIENT_PENDING_COMMAND;
+    }
+}
+
+// Do the I/O of clients assigned to io thread 'id'
+static void _net_io_threads_process_list(int id)
+{
+    for (int i = 0; i < io_threads_list_len[id]; i ++) {
+        client *c = io_threads_list[id][i];
+        if (io_threads_op == IO_THREADS_OP_WRITE) {
+            if (_net_client_write_to_socket(c) == -1) c->flags |= CLIENT_CLOSE_ASAP;
+        } else {
+            _net_client_read_and_parse(c);
+        }
+    }
+    io_threads_list_len[id] = 0;
+}
+
+static void *_net_io_thread_main(void *arg)
+{
+    io_thread_id = (long)arg;
+
+    while (1) {
+        // Busy wait for a while so that work is picked up right away
+        for (int j = 0; j < 1000000; j ++) {
+            if (atomic_load(&io_threads_pending[io_thread_id]) != 0) break;
+        }
+        // Still nothing to do. Give the main thread a chance to stop us
+        if (atomic_load(&io_threads_pending[io_thread_id]) == 0) {
+            pthread_mutex_lock(&io_threads_mutex[io_thread_id]);
+            pthread_mutex_unlock(&io_threads_mutex[io_thread_id]);
+            continue;
+        }
+
+        _net_io_threads_process_list(io_thread_id);
+        atomic_store(&io_threads_pending[io_thread_id], 0);
+    }
+    return NULL;
+}
+
+// Assign 'num' 'clients' to io threads round-robin to do 'op' on them, and wait until done.
+static void _net_io_threads_run(client **clients, int num, int op)
+{
+    for (int i = 0; i < num; i ++) {
+        int id = i % server.io_threads_num;
+        io_threads_list[id][io_threads_list_len[id] ++] = clients[i];
+    }
+    io_threads_op = op;
+    for (int id = 1; id < server.io_threads_num; id ++) {
+        atomic_store(&io_threads_pending[id], io_threads_list_len[id]);
+    }
+
+    // The main thread does its share, then waits for the others
+    _net_io_threads_process_list(0);
+    while (1) {
+        unsigned long pending = 0;
+        for (int id = 1; id < server.io_threads_num; id ++) {
+            pending += atomic_load(&io_threads_pending[id]);
+        }
+        if (pending == 0) break;
+    }
+}
+
+// Put client 'c' in the pending read list if io threads are running. Return 1 if it's left
+// for io threads to read, or 0 if the caller should read it now.
+static int _net_postpone_client_read(client *c)
+{
+    if (!server.io_threads_active || (c->flags & CLIENT_CLOSE_AFTER_REPLY)) return 0;
+    if (!(c->flags & CLIENT_PENDING_READ)) {
+        c->flags |= CLIENT_PENDING_READ;
+        this_shard->clients_pending_read[this_shard->num_pending_read ++] = c;
+    }
+    return 1;
+}
+
+// Have io threads read and parse clients in the pending read list, then execute the commands.
+static void _net_handle_clients_with_pending_reads()
+{
+    if (!server.io_threads_active || this_shard->num_pending_read == 0) return;
+
+    _net_io_threads_run(this_shard->clients_pending_read, this_shard->num_pending_read, IO_THREADS_OP_READ);
+
+    while (this_shard->num_pending_read > 0) {
+        client *c = this_shard->clients_pending_read[-- this_shard->num_pending_read];
+        int client_fd = c->fd;
+        c->flags &= ~CLIENT_PENDING_READ;
+
+        if (c->flags & CLIENT_CLOSE_ASAP) {
+            client_unregister(client_fd);
+            continue;
+        }
+        // Replies appended by the io thread, e.g. a protocol error, are not queued to write yet
+        if (client_has_pending_replies(c)) _net_client_prepare_to_write(c);
+
+        command_process(c);
+        if ((c->flags & CLIENT_CLOSE_AFTER_REPLY) && !client_has_pending_replies(c)) {
+            client_unregister(client_fd);
+        }
+    }
+}
+
+// Init io threads if enabled. They are created stopped, and started once there are enough
+// clients to write.
+static void net_io_threads_init()
+{
+    server.io_threads_active = 0;
+    if (server.io_threads_num == 1) return;
+
+    for (int id = 0; id < server.io_threads_num; id ++) {
+        io_threads_list[id] = zmalloc(sizeof(client*) * this_shard->el->set_size);
+        io_threads_list_len[id] = 0;
+        if (id == 0) continue;  // The main thread
+
+        atomic_store(&io_threads_pending[id], 0);
+        pthread_mutex_init(&io_threads_mutex[id], NULL);
+        pthread_mutex_lock(&io_threads_mutex[id]);
+        if (pthread_create(&io_threads[id], NULL, _net_io_thread_main, (void*)(long)id) != 0) {
+            server_panic("Server failed to create io thread (Error: %s)", strerror(errno));
+            return;
+        }
+    }
+    server_log(LL_NOTICE, "Server io threads: %d", server.io_threads_num);
+}
+
+// Append 'len' bytes at 's' to reply of client 'c'. Use the fixed reply_buf if possible,
+// otherwise the reply list.
+static void _net_client_reply_append(client *c, const char *s, size_t len)
+{
+    _net_client_prepare_to_write(c);
+
+    // Fast path. The reply list must be empty to keep replies in order
+    if (c->reply_head == NULL) {
+        size_t avail = CLIENT_REPLY_BUF_SIZE - c->reply_size;
+        if (len <= avail) {
+            memcpy(c->reply_buf + c->reply_size, s, len);
+            c->reply_size += len;
+            return;
+        }
+    }
+
+    // Fill the free space at the tail block first
+    client_reply_block *tail = c->reply_tail;
+    if (tail && tail->used < tail->size) {
+        size_t copy = tail->size - tail->used;
+        if (copy > len) copy = len;
+        memcpy(tail->buf + tail->used, s, copy);
+        tail->used += copy;
+        c->reply_list_bytes += copy;
+        s += copy;
+        len -= copy;
+    }
+    if (len == 0) return;
+
+    // Then append a new block for the remaining bytes
+    size_t size = (len < CLIENT_REPLY_CHUNK_BYTES) ? CLIENT_REPLY_CHUNK_BYTES : len;
+    client_reply_block *block = zmalloc(sizeof(client_reply_block) + size);
+    block->next = NULL;
+    block->size = size;
+    block->used = len;
+    memcpy(block->buf, s, len);
+    if (tail) tail->next = block;
+    else c->reply_head = block;
+    c->reply_tail = block;
+    c->reply_list_bytes += len;
+}
+
+// Append to client reply with print-like format
 void net_client_reply_append_fmt(client *c, const char *fmt, ...)
 {
-    va_list ap;
+    char buf[1024];
+    va_list ap, cpy;
+
     va_start(ap, fmt);
-    int l = vsnprintf(c->reply_buf + c->reply_size, CLIENT_BUF_SIZE - c->reply_size, fmt, ap);
-    c->reply_size += l;
-    va_end(ap);
+    va_copy(cpy, ap);
+    int l = vsnprintf(buf, sizeof(buf), fmt, cpy);
+    va_end(cpy);
 
+    if (l < sizeof(buf)) {
+        _net_client_reply_append(c, buf, l);
+    } else { // Too long for the static buf. Format it again in an sds string
+        sds s = sds_cat_vprintf(sds_new_empty(), fmt, ap);
+        _net_client_reply_append(c, s, sds_len(s));
+        sds_free(s);
+    }
+    va_end(ap);
 }
 
-// Append to client reply buf with string object.
+// Append to client reply with string object.
 void net_client_reply_append_string_obj(client *c, arobj *o)
 {
     server_assert(o->type == OBJ_TYPE_STRING);
 
-    int len;
     int enc = o->encoding;
 
     if (enc == OBJ_ENC_SDS || enc == OBJ_ENC_EMBSDS) {
         sds s = o->ptr;
-        len = sds_len(s);
-        strncpy(c->reply_buf + c->reply_size, s, len);
+        _net_client_reply_append(c, s, sds_len(s));
     } else if (enc == OBJ_ENC_INT) {
-        len = sprintf(c->reply_buf + c->recv_size, "%ld", (long)o->ptr);
+        char buf[LEN_LL_TO_STR];
+        int len = util_convert_ll_to_str(buf, (long)o->ptr);
+        _net_client_reply_append(c, buf, len);
     }
-
-    c->reply_size += len;
 }
 
-// Append to client reply buf with sds 'val'.
+// Append to client reply with sds 'val'.
 void net_client_reply_append_sds(client *c, sds val)
 {
-    size_t l = sds_len(val);
-    strncpy(c->reply_buf + c->reply_size, val, l);
-    c->reply_size += l;
+    _net_client_reply_append(c, val, sds_len(val));
 }
 
-// Append to client reply buf with c style string.
+// Append to client reply with c style string.
 void net_client_reply_append_cstr(client *c, const char *cstr)
 {
-    size_t l = strlen(cstr);
-    strncpy(c->reply_buf + c->reply_size, cstr, l);
-    c->reply_size += l;
+    _net_client_reply_append(c, cstr, strlen(cstr));
 }
 
-// Write reply to client 'c'.
-void net_client_reply_flush(client *c)
+// Reply helpers. A reply is written in RESP if the client's current request is a RESP multibulk.
+// Otherwise it's written in the human readable inline format, like '(ok)' or '(error) ...'.
+#define _net_client_resp(c) ((c)->req_type == CLIENT_REQ_MULTIBULK)
+
+// Reply OK status.
+void net_client_reply_ok(client *c)
 {
-    int client_fd = c->fd;
-    size_t bytes_sent = send(client_fd, c->reply_buf, c->reply_size, 0);
-    if (bytes_sent == -1) {
-        server_log(LL_VERBOSE, "Send() failed. Close client fd: %d", client_fd);
-        client_unregister(client_fd);
-        FD_CLR(client_fd, &server.active_fds);
-    } else if (bytes_sent == 0) {
-        server_log(LL_VERBOSE, "Send() none. Close client fd: %d", client_fd);
-        client_unregister(client_fd);
-        FD_CLR(client_fd, &server.active_fds);
+    net_client_reply_append_cstr(c, _net_client_resp(c) ? "+OK\r\n" : "(ok)");
+}
+
+// Reply a status string, like PONG. 'status' must not contain '\r' or '\n'.
+void net_client_reply_status(client *c, const char *status)
+{
+    if (_net_client_resp(c)) {
+        _net_client_reply_append(c, "+", 1);
+        net_client_reply_append_cstr(c, status);
+        _net_client_reply_append(c, "\r\n", 2);
+    } else {
+        net_client_reply_append_cstr(c, status);
+    }
+}
+
+// Reply an error message with print-like format.
+void net_client_reply_error(client *c, const char *fmt, ...)
+{
+    va_list ap;
+    va_start(ap, fmt);
+    sds msg = sds_cat_vprintf(sds_new_empty(), fmt, ap);
+    va_end(ap);
+
+    if (_net_client_resp(c)) {
+        // Error replies are single lines in RESP. Arguments in the message may break that
+        size_t len = sds_len(msg);
+        for (size_t i = 0; i < len; i ++) {
+            if (msg[i] == '\r' || msg[i] == '\n') msg[i] = ' ';
+        }
+        _net_client_reply_append(c, "-ERR ", 5);
+        _net_client_reply_append(c, msg, len);
+        _net_client_reply_append(c, "\r\n", 2);
+    } else {
+        _net_client_reply_append(c, "(error) ", 8);
+        net_client_reply_append_sds(c, msg);
+    }
+    sds_free(msg);
+}
+
+// Reply an integer.
+void net_client_reply_integer(client *c, long long val)
+{
+    char buf[LEN_LL_TO_STR + 3];
+    int len = util_convert_ll_to_str(buf + 1, val);
+
+    if (_net_client_resp(c)) {
+        buf[0] = ':';
+        buf[len + 1] = '\r';
+        buf[len + 2] = '\n';
+        _net_client_reply_append(c, buf, len + 3);
     } else {
-        c->recv_size = 0;   // reset reply index.
-        c->reply_buf[c->reply_size] = '\0';
-        server_log(LL_VERBOSE, "Send() ok. <'%s', %ld>", c->reply_buf, bytes_sent);
+        net_client_reply_append_cstr(c, "(integer) ");
+        _net_client_reply_append(c, buf + 1, len);
     }
 }
 
+// Reply a null, e.g. when a key is missing.
+void net_client_reply_null(client *c)
+{
+    net_client_reply_append_cstr(c, _net_client_resp(c) ? "$-1\r\n" : "(nil)");
+}
+
+// Reply a bulk string of 'len' bytes at 'p'. Bulk strings are binary-safe in RESP.
+void net_client_reply_bulk_cbuf(client *c, const char *p, size_t len)
+{
+    if (_net_client_resp(c)) {
+        char buf[LEN_LL_TO_STR + 3];
+        buf[0] = '$';
+        int l = util_convert_ll_to_str(buf + 1, len) + 1;
+        buf[l ++] = '\r';
+        buf[l ++] = '\n';
+        _net_client_reply_append(c, buf, l);
+        _net_client_reply_append(c, p, len);
+        _net_client_reply_append(c, "\r\n", 2);
+    } else {
+        _net_client_reply_append(c, p, len);
+    }
+}
+
+// Reply a bulk string with string object 'o'.
+void net_client_reply_bulk_obj(client *c, arobj *o)
+{
+    server_assert(o->type == OBJ_TYPE_STRING);
+
+    if (o->encoding == OBJ_ENC_SDS || o->encoding == OBJ_ENC_EMBSDS) {
+        net_client_reply_bulk_cbuf(c, o->ptr, sds_len(o->ptr));
+    } else if (o->encoding == OBJ_ENC_INT) {
+        char buf[LEN_LL_TO_STR];
+        int len = util_convert_ll_to_str(buf, (long)o->ptr);
+        net_client_reply_bulk_cbuf(c, buf, len);
+    }
+}
+
+// Reply the header of an array of 'len' elements, which are replied right after it. In the inline
+// format, call net_client_reply_array_next() before each element to put it on its own line.
+void net_client_reply_array_len(client *c, long len)
+{
+    if (_net_client_resp(c)) {
+        net_client_reply_append_fmt(c, "*%ld\r\n", len);
+    } else {
+        net_client_reply_append_fmt(c, "(array) %ld", len);
+    }
+}
+
+// Separate the next array element from the previous reply. Nothing is needed in RESP.
+void net_client_reply_array_next(client *c)
+{
+    if (!_net_client_resp(c)) _net_client_reply_append(c, "\n", 1);
+}
+
+// Set 'fd' to non-blocking mode. Return -1 on error.
+static int net_set_nonblock(int fd)
+{
+    int flags = fcntl(fd, F_GETFL);
+    if (flags == -1) return -1;
+    return fcntl(fd, F_SETFL, flags | O_NONBLOCK);
+}
+
+// Disable Nagle's algorithm on 'fd' so small replies are sent without delay.
+static int net_set_tcp_nodelay(int fd)
+{
+    int yes = 1;
+    return setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &yes, sizeof(yes));
+}
+
 
 /*
 // Command 'time'
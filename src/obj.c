@@ -10,11 +10,13 @@
 #include "sds.h"
 #include "obj.h"
 #include "debug.h"
+#include "slab.h"
 
 static arobj *_obj_create_sds_string(const char *str, size_t len);
 static arobj *_obj_create_embedded_sds_string(const char *str, size_t len);
 static arobj *_obj_make_shared(arobj *o);
 static void _obj_free_string(arobj *o);
+static size_t _obj_alloc_size(const arobj *o);
 
 // Global shared objects in the server.
 struct shared_objs shared;
@@ -52,7 +54,7 @@ static arobj *_obj_make_shared(arobj *o)
 // Create an object with specified 'type', 'encoding' and 'ptr'.
 arobj *obj_create(int type, int encoding, void *ptr)
 {
-    arobj *o = malloc(sizeof(arobj));
+    arobj *o = slab_alloc(sizeof(arobj));
     o->type = type;
     o->encoding = encoding;
     o->lru = 0;
@@ -75,11 +77,11 @@ arobj *obj_create_string(const char *str, size_t len)
 // Create a sds string object from 'str' of length 'len'.
 static arobj *_obj_create_sds_string(const char *str, size_t len)
 {
-    arobj *o = malloc(sizeof(arobj));
+    arobj *o = slab_alloc(sizeof(arobj));
 
     o->type = OBJ_TYPE_STRING;
     o->encoding = OBJ_ENC_SDS;
-    o->lru = 0;             // TODO future work. LRU mechanism for arobj.
+    o->lru = 0;             // stamped by db_add() and lookups. See evict.c
     o->ref_count = 1;
     o->ptr = sds_new_len(str, len);
 
@@ -91,7 +93,7 @@ static arobj *_obj_create_sds_string(const char *str, size_t len)
 // you use embeded str instead of sds str, since it is more compact and may run faster.
 static arobj *_obj_create_embedded_sds_string(const char *str, size_t len)
 {
-    arobj *o = malloc(sizeof(arobj) + sizeof(sds_hdr_8) + len + 1);
+    arobj *o = slab_alloc(sizeof(arobj) + sizeof(sds_hdr_8) + len + 1);
     sds_hdr_8 *sh = (void*)(o + 1);
     // init obj
     o->type = OBJ_TYPE_STRING;
@@ -191,7 +193,7 @@ void obj_dec_ref(arobj *o)
             default: server_panic("Unknown object type"); break;
         }
         o->ref_count = -100;
-        free(o);
+        slab_free(o, _obj_alloc_size(o));
         return;
     }
     // Cases rarely happen! Panic!
@@ -205,4 +207,9 @@ static void _obj_free_string(arobj *o)
     if (o->encoding == OBJ_ENC_SDS) sds_free(o->ptr);
 }
 
-
+// Return size of object 'o' as allocated, including its embedded sds string if any.
+static size_t _obj_alloc_size(const arobj *o)
+{
+    if (o->encoding == OBJ_ENC_EMBSDS) return sizeof(arobj) + sizeof(sds_hdr_8) + sds_len(o->ptr) + 1;
+    return sizeof(arobj);
+}
@@ -21,25 +21,32 @@ static inline size_t sds_hdr_size(char type)
 {
     switch(type & SDS_TYPE_MASK)
     {
-        case SDS_TYPE_6:
-            return sizeof(sds_hdr_6);
+        case SDS_TYPE_5:
+            return sizeof(sds_hdr_5);
         case SDS_TYPE_8:
             return sizeof(sds_hdr_8);
         case SDS_TYPE_16:
             return sizeof(sds_hdr_16);
+        case SDS_TYPE_32:
+            return sizeof(sds_hdr_32);
+        case SDS_TYPE_64:
+            return sizeof(sds_hdr_64);
     }
     return 0; // just suppress warning.
 }
 
-// Return proper sds header flag, SDS_TYPE_6, SDS_TYPE_8, or
-// SDS_TYPE_16, based on the string size
+// Return proper sds header flag, SDS_TYPE_5 ~ SDS_TYPE_64, based on the string size
 static inline char sds_req_type(size_t str_size)
 {
-    if (str_size <= (1 << 6))
-        return SDS_TYPE_6;
-    if (str_size <= (1 << 8))
+    if (str_size < (1 << 5))
+        return SDS_TYPE_5;
+    if (str_size < (1 << 8))
         return SDS_TYPE_8;
-    return SDS_TYPE_16;
+    if (str_size < (1 << 16))
+        return SDS_TYPE_16;
+    if (str_size < (1ull << 32))
+        return SDS_TYPE_32;
+    return SDS_TYPE_64;
 }
 
 //  Set the length of the sds string
@@ -48,9 +55,9 @@ static inline void sds_set_len(sds s, size_t new_len)
     unsigned char flag = s[-1];
     switch(flag & SDS_TYPE_MASK)
     {
-        case SDS_TYPE_6: {
+        case SDS_TYPE_5: {
             unsigned char *fp = (unsigned char*)s - 1;
-            *fp = new_len << SDS_TYPE_BITS | SDS_TYPE_6;
+            *fp = new_len << SDS_TYPE_BITS | SDS_TYPE_5;
             break;
         }
         case SDS_TYPE_8: {
@@ -61,6 +68,14 @@ static inline void sds_set_len(sds s, size_t new_len)
             SDS_HDR(16, s)->len = new_len;
             break;
         }
+        case SDS_TYPE_32: {
+            SDS_HDR(32, s)->len = new_len;
+            break;
+        }
+        case SDS_TYPE_64: {
+            SDS_HDR(64, s)->len = new_len;
+            break;
+        }
     }
 }
 
@@ -70,14 +85,20 @@ static inline size_t sds_get_alloc(sds s)
     unsigned char flag = s[-1];
     switch(flag & SDS_TYPE_MASK)
     {
-        case SDS_TYPE_6:
-            return flag >> SDS_TYPE_BITS; // The alloc for type 6 is its length, not 1 << 6 !!
+        case SDS_TYPE_5:
+            return flag >> SDS_TYPE_BITS; // The alloc for type 5 is its length, not 1 << 5 !!
         case SDS_TYPE_8: {
             return SDS_HDR(8, s)->alloc;
         }
         case SDS_TYPE_16: {
             return SDS_HDR(16, s)->alloc;
         }
+        case SDS_TYPE_32: {
+            return SDS_HDR(32, s)->alloc;
+        }
+        case SDS_TYPE_64: {
+            return SDS_HDR(64, s)->alloc;
+        }
     }
     return 0;
 }
@@ -88,7 +109,7 @@ static inline void sds_set_alloc(sds s, size_t new_alloc)
     unsigned char flag = s[-1];
     switch(flag & SDS_TYPE_MASK)
     {
-        case SDS_TYPE_6: // No alloc field, nothing to do
+        case SDS_TYPE_5: // No alloc field, nothing to do
             break;
         case SDS_TYPE_8: {
             SDS_HDR(8, s)->alloc = new_alloc;
@@ -98,6 +119,14 @@ static inline void sds_set_alloc(sds s, size_t new_alloc)
             SDS_HDR(16, s)->alloc = new_alloc;
             break;
         }
+        case SDS_TYPE_32: {
+            SDS_HDR(32, s)->alloc = new_alloc;
+            break;
+        }
+        case SDS_TYPE_64: {
+            SDS_HDR(64, s)->alloc = new_alloc;
+            break;
+        }
     }
 }
 
@@ -107,41 +136,61 @@ size_t sds_get_total_alloc(const sds s)
     return sds_hdr_size(s[-1]) + sds_get_alloc(s) + 1;
 }
 
-//  Create a new sds string with specified content and length.
-//  If init is NULL, the string is initailized with zero.
-//  If init is SDS_NOINIT, the string is left uninitailized.
-sds sds_new_len(const void *init, size_t init_len)
+// Init the header of sds string 's' of header 'type' with length and alloc 'len'
+static inline void sds_init_hdr(sds s, char type, size_t len)
 {
-    char type = sds_req_type(init_len);
-    int hdr_len = sds_hdr_size(type);
-
-    void *sh = s_malloc(hdr_len + init_len + 1);
-    if (sh == NULL) return NULL;
-
-    sds s = (char*)sh + hdr_len;
-    // init sds header
     switch(type)
     {
-        case SDS_TYPE_6: {      // must add brackets for case, to suppress error
-            SDS_HDR_VAR(6, s)
-            sh->flag = (init_len << SDS_TYPE_BITS) | type;
+        case SDS_TYPE_5: {      // must add brackets for case, to suppress error
+            SDS_HDR_VAR(5, s)
+            sh->flag = (len << SDS_TYPE_BITS) | type;
             break;
         }
         case SDS_TYPE_8: {
             SDS_HDR_VAR(8, s);
-            sh->len = init_len;
-            sh->alloc = init_len;
+            sh->len = len;
+            sh->alloc = len;
             sh->flag = type;
             break;
         }
         case SDS_TYPE_16: {
             SDS_HDR_VAR(16, s);
-            sh->len = init_len;
-            sh->alloc = init_len;
+            sh->len = len;
+            sh->alloc = len;
+            sh->flag = type;
+            break;
+        }
+        case SDS_TYPE_32: {
+            SDS_HDR_VAR(32, s);
+            sh->len = len;
+            sh->alloc = len;
+            sh->flag = type;
+            break;
+        }
+        case SDS_TYPE_64: {
+            SDS_HDR_VAR(64, s);
+            sh->len = len;
+            sh->alloc = len;
             sh->flag = type;
             break;
         }
     }
+}
+
+//  Create a new sds string with specified content and length.
+//  If init is NULL, the string is initailized with zero.
+//  If init is SDS_NOINIT, the string is left uninitailized.
+sds sds_new_len(const void *init, size_t init_len)
+{
+    char type = sds_req_type(init_len);
+    int hdr_len = sds_hdr_size(type);
+
+    void *sh = s_malloc(hdr_len + init_len + 1);
+    if (sh == NULL) return NULL;
+
+    sds s = (char*)sh + hdr_len;
+    // init sds header
+    sds_init_hdr(s, type, init_len);
     // init sds buf
     if (!init) {
         memset(s, 0, init_len + 1);
@@ -152,6 +201,23 @@ sds sds_new_len(const void *init, size_t init_len)
     return s;
 }
 
+//  Turn 'len' bytes at 'p' into an sds string in place, without allocation or copy. The
+//  header is written over the 'room' bytes before 'p', and the null terminator over the byte
+//  right after the content, so they must be writable and no longer needed by the caller.
+//  Return NULL if 'room' is too small for the header.
+//
+//  The string lives in the caller's buffer. It must never be passed to sds_free() or to any
+//  function that may grow it. Use sds_dup() to get a string that can be kept.
+sds sds_new_in_place(char *p, size_t room, size_t len)
+{
+    char type = sds_req_type(len);
+    if (room < sds_hdr_size(type)) return NULL;
+
+    sds_init_hdr(p, type, len);
+    p[len] = '\0';
+    return p;
+}
+
 // Create a new sds string from a null terminated C string
 sds sds_new(const char *init)
 {
@@ -186,15 +252,18 @@ sds sds_make_room_for(sds s, size_t add_len)
     size_t new_len, old_len = sds_len(s);
     void *new_sh, *old_sh = (char*)s - sds_hdr_size(old_type);
 
-    // determine the appropriate new length and associate type
+    // determine the appropriate new length and associate type. The type is picked for the
+    // preallocated length, not the needed one, so that the header is promoted at most once
+    // per reallocation, e.g. to sds_hdr_16 right away once a string outgrows sds_hdr_8.
     new_len = old_len + add_len;
+    if (new_len < old_len) return NULL;    // size_t overflow
     if (new_len < SDS_MAX_PREALLOC) {
         new_len *= 2;
-    } else {
+    } else if (new_len + SDS_MAX_PREALLOC > new_len) {
         new_len += SDS_MAX_PREALLOC;
     }
     new_type = sds_req_type(new_len);
-    if (new_type == SDS_TYPE_6) {
+    if (new_type == SDS_TYPE_5) {
         new_type = SDS_TYPE_8;
     }
 
@@ -202,7 +271,7 @@ sds sds_make_room_for(sds s, size_t add_len)
     size_t hdr_len = sds_hdr_size(new_type);
 
     if (new_type == old_type) {
-        server_assert(new_type != SDS_TYPE_6);
+        server_assert(new_type != SDS_TYPE_5);
         new_sh = s_realloc(old_sh, hdr_len + new_len + 1);
         if (new_sh == NULL) return NULL;
 
@@ -428,7 +497,7 @@ int sds_cmp(const sds s1, const sds s2)
 // Print all debug info for sds string 's'.
 void sds_debug_print(const sds s, int debug_content)
 {
-    char *types[] = {"SDS_TYPE_6 ", "SDS_TYPE_8 ", "SDS_TYPE_16"};
+    char *types[] = {"SDS_TYPE_5 ", "SDS_TYPE_8 ", "SDS_TYPE_16", "SDS_TYPE_32", "SDS_TYPE_64"};
     char *type = types[s[-1] & SDS_TYPE_MASK];
     printf("type:%s  len:%4lu  free:%4lu  alloc:%4lu  total_allc:%4lu  buf[]:%s \n",
         type, sds_len(s), sds_avail(s), sds_get_alloc(s), sds_get_total_alloc(s), (debug_content ? s :  "..."));
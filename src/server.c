@@ -2,6 +2,7 @@
 #include <stdlib.h>
 #include <unistd.h>
 #include <string.h>
+#include <signal.h>
 #include "config.h"
 #include "server.h"
 #include "sds.h"
@@ -13,6 +14,12 @@
 #include "net.h"
 #include "log.h"
 #include "util.h"
+#include "event.h"
+#include "shard.h"
+#include "slab.h"
+#include "lazyfree.h"
+#include "evict.h"
+#include "zmalloc.h"
 
 #ifdef CONFIG_BUILD_TEST
     #include "test.h"
@@ -25,6 +32,13 @@
 
 arena_server server;
 
+// Run the code block every 'ms' milliseconds in server_cron(). Periods shorter than
+// the cron interval run on every call.
+#define run_with_period(ms) if (((ms) <= 1000/server.hz) || !(this_shard->cronloops%((ms)/(1000/server.hz))))
+
+static void server_databases_cron();
+static void server_track_instantaneous_ops();
+
 
 int main(int argc, char *argv[])
 {
@@ -90,20 +104,35 @@ int main(int argc, char *argv[])
                 return 0;
             }
             return dict_benchmark_main(count);
+        } else if (strcasecmp(argv[1], "hash_benchmark") == 0) {
+            if (argc != 2) {
+                printf("Usage: ./ArenaDB hash_benchmark \n");
+                return 0;
+            }
+            return hash_benchmark_main();
+        } else if (strcasecmp(argv[1], "sds_benchmark") == 0) {
+            if (argc != 2) {
+                printf("Usage: ./ArenaDB sds_benchmark \n");
+                return 0;
+            }
+            return sds_benchmark_main();
         }
     }
     #endif // CONFIG_BUILD_BENCHMARK
 
     // Init server configuration
     config_init();
+    if (config_load_params(argc, argv) == -1) {
+        printf("Usage: ./ArenaDB [-p name=value ...]\n");
+        return 1;
+    }
     // Init server itself
     server_log(LL_VERBOSE, "Server is starting...");
     server_init();
     server_log(LL_NOTICE, "Server started");
 
-    net_init();
-    // main loop in net.c
-    net_loop();
+    // Run event loops of all shards. Shard 0 runs in this thread
+    shard_run();
 
     // server exit
     server_log(LL_VERBOSE, "Server exiting normally...");
@@ -114,17 +143,20 @@ int main(int argc, char *argv[])
 void server_init()
 {
     server.pid = getpid();
-    server.stdin_buf = malloc(1024);
+    server.stdin_buf = zmalloc(1024);
     server.stdin_fd = fileno(stdin);
-
-    db_init();
-    client_init();
+    // A client gone while its replies are sent must not kill the server. Sends report EPIPE
+    signal(SIGPIPE, SIG_IGN);
 
     // dict must be first inited
     dict_hash_seed_init();
     command_dict_init();
 
     obj_create_shared();
+    lazyfree_init();
+
+    // Shards have their own databases, clients and event loops
+    shard_init();
 
 }
 
@@ -133,3 +165,82 @@ void server_exit()
 
 }
 
+// Server periodic task. It's a time event in the event loop, called server.hz times per second.
+// Background jobs that should not run inside commands go here, such as incremental rehashing
+// and stats sampling. Every shard runs its own cron on its own databases and stats.
+int server_cron(ae_event_loop *el, long long id, void *client_data)
+{
+    run_with_period(100) {
+        server_track_instantaneous_ops();
+    }
+
+    // Show some info about non-empty databases and connected clients
+    run_with_period(5000) {
+        for (int i = 0; i < server.num_db; i ++) {
+            dict *d = this_shard->db[i].d;
+            if (dict_keys(d) == 0) continue;
+            server_log(LL_VERBOSE, "DB %d: %lu keys in %lu slots HT.", i, dict_keys(d), dict_size(d));
+        }
+        server_log(LL_VERBOSE, "%d clients connected, %lld ops/sec",
+            this_shard->num_clients, server_get_instantaneous_ops());
+        if (lazyfree_get_pending()) server_log(LL_VERBOSE, "%lu lazyfree jobs pending", lazyfree_get_pending());
+        if (this_shard->id == 0) {
+            size_t rss = zmalloc_get_rss();
+            server_log(LL_VERBOSE, "Used memory %zu bytes, rss %zu bytes, fragmentation ratio %.2f",
+                zmalloc_used_memory(), rss, zmalloc_get_fragmentation_ratio(rss));
+        }
+        char buf[512];
+        if (slab_get_stats(buf, sizeof(buf))) server_log(LL_VERBOSE, "%s", buf);
+    }
+
+    this_shard->lru_clock = evict_get_lru_clock();
+    server_databases_cron();
+    // Blocks emptied by frees of other threads, e.g. the lazyfree thread, are returned
+    slab_reclaim();
+
+    this_shard->cronloops ++;
+    return 1000 / server.hz;
+}
+
+// Do some incremental work on databases, so that they don't only make progress on lookups.
+// Shrinking: databases mostly emptied are shrunk, in case it wasn't done on delete.
+// Active rehashing: databases still rehashing share a time budget of CONFIG_ACTIVE_REHASH_CYCLE_US,
+// so an idle database doesn't keep probing two tables, and commands are not delayed much.
+static void server_databases_cron()
+{
+    long long start = util_get_time_in_microsecond(), budget = CONFIG_ACTIVE_REHASH_CYCLE_US;
+
+    for (int i = 0; i < server.num_db; i ++) dict_shrink_if_needed(this_shard->db[i].d);
+
+    for (int i = 0; i < server.num_db && budget > 0; i ++) {
+        dict *d = this_shard->db[this_shard->rehash_db].d;
+        if (dict_is_rehashing(d)) {
+            dict_rehash_microseconds(d, budget);
+            budget = CONFIG_ACTIVE_REHASH_CYCLE_US - (util_get_time_in_microsecond() - start);
+            if (dict_is_rehashing(d)) break;    // Out of budget. Go on with it next time
+        }
+        this_shard->rehash_db = (this_shard->rehash_db + 1) % server.num_db;
+    }
+}
+
+// Add a sample of ops/sec since last sample to the circular sample buffer
+static void server_track_instantaneous_ops()
+{
+    long long now = util_get_time_in_millisecond();
+    long long elapsed = now - this_shard->stat_ops_sec_last_sample_time;
+    long long ops = this_shard->stat_numcommands - this_shard->stat_ops_sec_last_sample_ops;
+
+    this_shard->stat_ops_sec_samples[this_shard->stat_ops_sec_idx] = (elapsed > 0) ? ops * 1000 / elapsed : 0;
+    this_shard->stat_ops_sec_idx = (this_shard->stat_ops_sec_idx + 1) % STATS_METRIC_SAMPLES;
+    this_shard->stat_ops_sec_last_sample_time = now;
+    this_shard->stat_ops_sec_last_sample_ops = this_shard->stat_numcommands;
+}
+
+// Return ops/sec averaged over the recent samples
+long long server_get_instantaneous_ops()
+{
+    long long sum = 0;
+    for (int i = 0; i < STATS_METRIC_SAMPLES; i ++) sum += this_shard->stat_ops_sec_samples[i];
+    return sum / STATS_METRIC_SAMPLES;
+}
+
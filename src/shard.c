@@ -0,0 +1,234 @@
+/*
+    ArenaDB shards. 5.8
+*/
+
+/*
+*   The server is made of server.num_shards shards that share nothing. Each shard runs its own
+*   event loop in its own thread, accepts connections on its own listening socket (all of them
+*   are bound to the same port with SO_REUSEPORT, so the kernel spreads connections over them),
+*   and serves them with its own clients table and its own part of every database. A key belongs
+*   to the shard picked by its hash, see shard_of_key(). A shard never touches data of another
+*   shard, so no lock is needed. With a single shard, the default, the server runs in the main
+*   thread as before.
+*
+*   A command on a key of another shard is forwarded. The client is blocked and a SHARD_MSG_EXEC
+*   message is pushed to the mailbox of the shard owning the key, which executes the command
+*   against its databases and appends the replies to the client. Then it pushes the message back
+*   as SHARD_MSG_DONE, and the shard of the client unblocks it and writes the replies. A blocked
+*   client is neither read nor written by its own shard, so only one thread touches it at a time.
+*
+*   Mailboxes are lock-free stacks. Senders push with CAS, and the receiver takes all messages at
+*   once with an exchange, so there is no ABA problem. A sender that pushes to an empty mailbox
+*   wakes up the receiver's event loop through its eventfd.
+*/
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <stdatomic.h>
+#include <sys/eventfd.h>
+#include "server.h"
+#include "shard.h"
+#include "client.h"
+#include "command.h"
+#include "event.h"
+#include "net.h"
+#include "db.h"
+#include "evict.h"
+#include "debug.h"
+#include "log.h"
+#include "util.h"
+#include "zmalloc.h"
+
+__thread arena_shard *this_shard = NULL;
+// Set when the forwarded command being executed by this shard is forwarded on to another shard
+static __thread int _shard_forwarded_on = 0;
+
+static void *_shard_thread_main(void *arg);
+static void _shard_push_msg(arena_shard *s, shard_msg *msg);
+static void _shard_mailbox_handler(ae_event_loop *el, int fd, int state);
+
+// Init all shards. Each shard gets its databases, its event loop with a listening socket, its
+// clients table and a server_cron() timer. 'this_shard' is left to shard 0, which runs in the
+// main thread.
+void shard_init()
+{
+    server.shards = zmalloc(sizeof(arena_shard) * server.num_shards);
+
+    for (int i = 0; i < server.num_shards; i ++) {
+        arena_shard *s = server.shards + i;
+        this_shard = s;
+
+        s->id = i;
+        s->cronloops = 0;
+        s->rehash_db = 0;
+        s->stat_numcommands = 0;
+        s->stat_numconnections = 0;
+        s->stat_ops_sec_last_sample_time = util_get_time_in_millisecond();
+        s->stat_ops_sec_last_sample_ops = 0;
+        for (int j = 0; j < STATS_METRIC_SAMPLES; j ++) s->stat_ops_sec_samples[j] = 0;
+        s->stat_ops_sec_idx = 0;
+        atomic_store(&s->mailbox, NULL);
+
+        db_init();
+        evict_init();
+        net_init();
+        client_init();
+
+        // Messages from other shards wake up the event loop
+        s->wakeup_fd = eventfd(0, EFD_NONBLOCK);
+        if (s->wakeup_fd == -1 ||
+            ae_create_file_event(s->el, s->wakeup_fd, AE_STATE_READABLE, _shard_mailbox_handler) == AE_ERR) {
+            server_panic("Shard %d failed to create mailbox (Error: %s)", i, strerror(errno));
+            return;
+        }
+        // Run server_cron() server.hz times per second in the event loop
+        ae_create_time_event(s->el, 1, server_cron, NULL, NULL);
+    }
+    this_shard = server.shards;
+    if (server.num_shards > 1) server_log(LL_NOTICE, "Server shards: %d", server.num_shards);
+}
+
+// Run all shards until the server is told to exit. Shard 0 runs in the calling thread, the
+// others in their own threads. Clients are closed after all shards stop.
+void shard_run()
+{
+    for (int i = 1; i < server.num_shards; i ++) {
+        arena_shard *s = server.shards + i;
+        if (pthread_create(&s->thread, NULL, _shard_thread_main, s) != 0) {
+            server_panic("Server failed to create thread for shard %d (Error: %s)", i, strerror(errno));
+            return;
+        }
+    }
+    net_loop();
+    for (int i = 1; i < server.num_shards; i ++) {
+        pthread_join(server.shards[i].thread, NULL);
+    }
+
+    // No shard is running now. Commands forwarded but not done can be dropped safely
+    for (int i = 0; i < server.num_shards; i ++) {
+        arena_shard *s = server.shards + i;
+        this_shard = s;
+        ae_delete_file_event(s->el, s->socket_fd, AE_STATE_READABLE);
+        ae_delete_io_event(s->el, s->socket_fd, AE_IO_ACCEPT);
+        close(s->socket_fd);
+        for (int client_fd = 0; client_fd <= s->el->max_fd; client_fd ++) {
+            if (s->clients[client_fd] == NULL) continue;
+            // Sends in flight are never completed now. They are dropped with the event loop
+            s->clients[client_fd]->flags &= ~CLIENT_SEND_IN_FLIGHT;
+            client_unregister(client_fd);
+        }
+    }
+    this_shard = server.shards;
+}
+
+// Stop all shards. Called by shard 0.
+void shard_stop_all()
+{
+    for (int i = 1; i < server.num_shards; i ++) {
+        shard_msg *msg = zmalloc(sizeof(shard_msg));
+        msg->type = SHARD_MSG_STOP;
+        msg->c = NULL;
+        _shard_push_msg(server.shards + i, msg);
+    }
+    ae_stop(this_shard->el);
+}
+
+// Return id of the shard that 'key' belongs to. High bits of the hash are used, since low
+// bits pick the slot in the dict of the shard.
+int shard_of_key(sds key)
+{
+    uint64_t hash = db_dict_type.hash_func(key);
+    return (hash >> 32) % server.num_shards;
+}
+
+// Forward the command of client 'c' to shard 'target' that owns its key. The client is
+// blocked until the command is done.
+//
+// A shard executing a forwarded command may forward it on to another shard, e.g. for keys of
+// several shards. Then the last shard sends it back to the shard of the client.
+void shard_forward_command(client *c, int target)
+{
+    shard_msg *msg = zmalloc(sizeof(shard_msg));
+    msg->type = SHARD_MSG_EXEC;
+    msg->c = c;
+
+    if (c->flags & CLIENT_BLOCKED) {
+        _shard_forwarded_on = 1;
+    } else {
+        net_client_block(c);
+    }
+    _shard_push_msg(server.shards + target, msg);
+}
+
+static void *_shard_thread_main(void *arg)
+{
+    this_shard = arg;
+    net_loop();
+    return NULL;
+}
+
+// Push 'msg' to the mailbox of shard 's'. Can be called by any thread.
+static void _shard_push_msg(arena_shard *s, shard_msg *msg)
+{
+    shard_msg *head = atomic_load(&s->mailbox);
+    do {
+        msg->next = head;
+    } while (!atomic_compare_exchange_weak(&s->mailbox, &head, msg));
+
+    // The mailbox was empty, so the receiver may be waiting for events. Wake it up
+    if (head == NULL) {
+        uint64_t one = 1;
+        if (write(s->wakeup_fd, &one, sizeof(one)) == -1 && errno != EAGAIN) {
+            server_log(LL_WARNING, "Failed to wake up shard %d (Error: %s)", s->id, strerror(errno));
+        }
+    }
+}
+
+// Process all messages in the mailbox of the shard. Called when its eventfd is readable.
+static void _shard_mailbox_handler(ae_event_loop *el, int fd, int state)
+{
+    uint64_t count;
+    if (read(fd, &count, sizeof(count)) == -1 && errno != EAGAIN) {
+        server_log(LL_WARNING, "Shard %d failed to read its eventfd (Error: %s)", this_shard->id, strerror(errno));
+    }
+
+    // Take all messages at once. They are stacked, so reverse them to process in sent order
+    shard_msg *msg = atomic_exchange(&this_shard->mailbox, NULL), *next, *list = NULL;
+    while (msg) {
+        next = msg->next;
+        msg->next = list;
+        list = msg;
+        msg = next;
+    }
+
+    while (list) {
+        msg = list;
+        list = list->next;
+
+        switch (msg->type) {
+        case SHARD_MSG_EXEC:
+            command_execute_forwarded(msg->c);
+            // Forwarded on. The client must not be touched anymore
+            if (_shard_forwarded_on) {
+                _shard_forwarded_on = 0;
+                zfree(msg);
+                break;
+            }
+            // Send it back to the shard of the client
+            msg->type = SHARD_MSG_DONE;
+            _shard_push_msg(msg->c->shard, msg);
+            break;
+        case SHARD_MSG_DONE:
+            msg->c->db = this_shard->db + msg->c->db->id;   // back to the databases of its shard
+            net_client_unblock(msg->c);
+            zfree(msg);
+            break;
+        case SHARD_MSG_STOP:
+            ae_stop(el);
+            zfree(msg);
+            break;
+        }
+    }
+}
@@ -0,0 +1,272 @@
+/*
+    ArenaDB slab allocator. 5.15
+*/
+
+/*
+*   Small objects allocated for every key, like dict entries and object headers, come from slabs
+*   instead of malloc(). Sizes are rounded up to size classes SLAB_SIZE_STEP bytes apart. Each
+*   thread has its own cache per size class: blocks with free chunks. When none is left, a new
+*   SLAB_BLOCK_SIZE block is carved into chunks in bulk, so allocating and freeing are
+*   mostly a pop and a push, without per chunk malloc() headers and heap fragmentation.
+*
+*   A chunk is freed to the block it's carved from, found by aligning its address down to
+*   SLAB_BLOCK_SIZE. Each block keeps its own free list and count of used chunks, and the cache
+*   links the blocks that have free chunks. Once all chunks of a block are freed, the block is
+*   returned to the system, unless it's the last one with free chunks, so memory follows the live
+*   data after mass deletions instead of staying at its peak. Frees by other threads, like an
+*   object freed by another shard or in the background, are pushed to a lock-free stack of the
+*   cache and taken back a batch at a time, on refill and by slab_reclaim() in server_cron().
+*   Caches are never freed, so blocks outlive their threads safely.
+*
+*   Define CONFIG_NO_SLAB in config.h to fall back to zmalloc(), e.g. for memory checkers.
+*/
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdatomic.h>
+#include "config.h"
+#include "slab.h"
+#include "debug.h"
+#include "zmalloc.h"
+
+// Free chunk. The link is stored in the chunk itself
+typedef struct slab_chunk {
+    struct slab_chunk *next;
+} slab_chunk;
+
+struct slab_block;
+
+// Cache of a size class of a thread
+typedef struct slab_cache {
+    struct slab_block *partial;         // blocks with free chunks
+    slab_chunk *_Atomic remote_free;    // chunks freed by other threads
+    slab_chunk *remote_taken;           // chunks taken from 'remote_free', not freed to their blocks yet
+    size_t chunk_size;
+    // accounting
+    unsigned long num_blocks;
+    unsigned long num_chunks;
+    unsigned long num_used;
+} slab_cache;
+
+// Header at the start of each block
+typedef struct slab_block {
+    slab_cache *cache;
+    slab_chunk *free_list;
+    struct slab_block *prev, *next;     // in partial list of the cache if free_list isn't empty
+    unsigned int num_chunks;
+    unsigned int num_used;
+} slab_block;
+
+// Chunks start after the block header, keeping 16 bytes alignment
+#define SLAB_BLOCK_HDR_SIZE     ((sizeof(slab_block) + 15) & ~(size_t)15)
+// Max chunks freed by other threads taken back at a time, so that a mass free in the background
+// doesn't stall the owner. About 1ms of work for slab_reclaim(), like CONFIG_ACTIVE_REHASH_CYCLE_US
+#define SLAB_RECLAIM_MAX        32768
+#define SLAB_REFILL_RECLAIM_MAX 1024
+#define _slab_block_of(p)       ((slab_block *)((uintptr_t)(p) & ~(uintptr_t)(SLAB_BLOCK_SIZE - 1)))
+
+static __thread slab_cache *slab_caches = NULL;    // SLAB_NUM_CLASSES caches of the thread
+
+static slab_cache *_slab_get_caches();
+static void _slab_refill(slab_cache *cache);
+static unsigned long _slab_take_remote(slab_cache *cache, unsigned long max);
+static void _slab_free_local(slab_cache *cache, slab_block *block, slab_chunk *chunk);
+static void _slab_unlink_block(slab_cache *cache, slab_block *block);
+
+// Allocate 'size' bytes. Never fails.
+void *slab_alloc(size_t size)
+{
+#ifdef CONFIG_NO_SLAB
+    return zmalloc(size);
+#else
+    if (size > SLAB_MAX_SIZE || size == 0) return zmalloc(size);
+
+    slab_cache *cache = &_slab_get_caches()[(size - 1) / SLAB_SIZE_STEP];
+    if (cache->partial == NULL) _slab_refill(cache);
+
+    slab_block *block = cache->partial;
+    slab_chunk *chunk = block->free_list;
+    block->free_list = chunk->next;
+    block->num_used ++;
+    cache->num_used ++;
+    if (block->free_list == NULL) _slab_unlink_block(cache, block);
+    return chunk;
+#endif
+}
+
+// Free 'p' of 'size' bytes, allocated by slab_alloc() of any thread with the same 'size'.
+void slab_free(void *p, size_t size)
+{
+#ifdef CONFIG_NO_SLAB
+    zfree(p);
+#else
+    if (size > SLAB_MAX_SIZE || size == 0) {
+        zfree(p);
+        return;
+    }
+
+    slab_chunk *chunk = p;
+    slab_block *block = _slab_block_of(p);
+    slab_cache *cache = block->cache;
+    server_assert(cache->chunk_size == (size - 1) / SLAB_SIZE_STEP * SLAB_SIZE_STEP + SLAB_SIZE_STEP);
+
+    if (slab_caches != NULL && cache >= slab_caches && cache < slab_caches + SLAB_NUM_CLASSES) {
+        _slab_free_local(cache, block, chunk);
+        return;
+    }
+    // Owned by another thread
+    slab_chunk *head = atomic_load(&cache->remote_free);
+    do {
+        chunk->next = head;
+    } while (!atomic_compare_exchange_weak(&cache->remote_free, &head, chunk));
+#endif
+}
+
+// Take back up to SLAB_RECLAIM_MAX chunks of the calling thread freed by other threads, so that
+// blocks emptied by them are returned to the system without waiting for a refill. Called by
+// server_cron(). Return the number of chunks taken back.
+unsigned long slab_reclaim()
+{
+#ifdef CONFIG_NO_SLAB
+    return 0;
+#else
+    slab_cache *caches = _slab_get_caches();
+    unsigned long budget = SLAB_RECLAIM_MAX;
+    for (int i = 0; i < SLAB_NUM_CLASSES && budget > 0; i ++) {
+        budget -= _slab_take_remote(caches + i, budget);
+    }
+    return SLAB_RECLAIM_MAX - budget;
+#endif
+}
+
+// Get stats of size class 'class_idx' of the calling thread. Chunks freed by other threads
+// still count as used until they are taken back.
+void slab_get_class_stats(int class_idx, slab_class_stats *stats)
+{
+    slab_cache *cache = &_slab_get_caches()[class_idx];
+    stats->chunk_size = cache->chunk_size;
+    stats->num_blocks = cache->num_blocks;
+    stats->num_chunks = cache->num_chunks;
+    stats->num_used = cache->num_used;
+}
+
+// Print occupancy of non-empty size classes of the calling thread to 'buf'. Return length printed.
+size_t slab_get_stats(char *buf, size_t buf_size)
+{
+    size_t l = 0;
+    if (buf_size) buf[0] = '\0';
+
+    for (int i = 0; i < SLAB_NUM_CLASSES && l < buf_size; i ++) {
+        slab_class_stats stats;
+        slab_get_class_stats(i, &stats);
+        if (stats.num_blocks == 0) continue;
+        l += snprintf(buf + l, buf_size - l,
+            "Slab class %zu bytes: %lu blocks, %lu/%lu chunks used (%.02f%%) \n",
+            stats.chunk_size, stats.num_blocks, stats.num_used, stats.num_chunks,
+            (float)stats.num_used / stats.num_chunks * 100);
+    }
+    return (l < buf_size) ? l : buf_size - 1;
+}
+
+// Return caches of the calling thread, created on first use.
+static slab_cache *_slab_get_caches()
+{
+    if (slab_caches) return slab_caches;
+
+    slab_caches = zmalloc(sizeof(slab_cache) * SLAB_NUM_CLASSES);
+    for (int i = 0; i < SLAB_NUM_CLASSES; i ++) {
+        slab_cache *cache = slab_caches + i;
+        cache->partial = NULL;
+        atomic_store(&cache->remote_free, NULL);
+        cache->remote_taken = NULL;
+        cache->chunk_size = (i + 1) * SLAB_SIZE_STEP;
+        cache->num_blocks = 0;
+        cache->num_chunks = 0;
+        cache->num_used = 0;
+    }
+    return slab_caches;
+}
+
+// Give 'cache' a block with free chunks. Take back chunks freed by other threads if any,
+// otherwise carve a new block.
+static void _slab_refill(slab_cache *cache)
+{
+    _slab_take_remote(cache, SLAB_REFILL_RECLAIM_MAX);
+    if (cache->partial) return;
+
+    slab_block *block = zaligned_alloc(SLAB_BLOCK_SIZE, SLAB_BLOCK_SIZE);
+    if (block == NULL) server_panic("Slab failed to allocate a block");
+    block->cache = cache;
+
+    char *start = (char *)block + SLAB_BLOCK_HDR_SIZE;
+    unsigned int n = (SLAB_BLOCK_SIZE - SLAB_BLOCK_HDR_SIZE) / cache->chunk_size;
+    // Link chunks in address order
+    slab_chunk *next = NULL;
+    for (long i = n - 1; i >= 0; i --) {
+        slab_chunk *chunk = (slab_chunk *)(start + i * cache->chunk_size);
+        chunk->next = next;
+        next = chunk;
+    }
+    block->free_list = next;
+    block->num_chunks = n;
+    block->num_used = 0;
+    block->prev = NULL;
+    block->next = NULL;
+    cache->partial = block;
+    cache->num_blocks ++;
+    cache->num_chunks += n;
+}
+
+// Free up to 'max' chunks of 'cache' freed by other threads. Return the number freed.
+static unsigned long _slab_take_remote(slab_cache *cache, unsigned long max)
+{
+    if (cache->remote_taken == NULL) {
+        if (atomic_load_explicit(&cache->remote_free, memory_order_relaxed) == NULL) return 0;
+        cache->remote_taken = atomic_exchange(&cache->remote_free, NULL);
+    }
+    unsigned long n = 0;
+    slab_chunk *chunk = cache->remote_taken;
+    while (chunk && n < max) {
+        slab_chunk *next = chunk->next;
+        _slab_free_local(cache, _slab_block_of(chunk), chunk);
+        chunk = next;
+        n ++;
+    }
+    cache->remote_taken = chunk;
+    return n;
+}
+
+// Free 'chunk' of 'block' owned by the calling thread. Return the block to the system once
+// it's empty, keeping the last block with free chunks to not thrash at a block boundary.
+static void _slab_free_local(slab_cache *cache, slab_block *block, slab_chunk *chunk)
+{
+    if (block->free_list == NULL) {
+        // Full until now. Link it first, so the next allocations fill it up again
+        block->prev = NULL;
+        block->next = cache->partial;
+        if (cache->partial) cache->partial->prev = block;
+        cache->partial = block;
+    }
+    chunk->next = block->free_list;
+    block->free_list = chunk;
+    block->num_used --;
+    cache->num_used --;
+
+    if (block->num_used == 0 && (block->prev || block->next)) {
+        _slab_unlink_block(cache, block);
+        cache->num_blocks --;
+        cache->num_chunks -= block->num_chunks;
+        zfree(block);
+    }
+}
+
+// Remove 'block' from the partial list of 'cache'.
+static void _slab_unlink_block(slab_cache *cache, slab_block *block)
+{
+    if (block->prev) block->prev->next = block->next;
+    else cache->partial = block->next;
+    if (block->next) block->next->prev = block->prev;
+    block->prev = NULL;
+    block->next = NULL;
+}
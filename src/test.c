@@ -6,15 +6,30 @@
 
 #ifdef  CONFIG_BUILD_TEST
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <assert.h>
+#include <pthread.h>
+#include <unistd.h>
 #include "sds.h"
 #include "dict.h"
+#include "db.h"
+#include "obj.h"
+#include "slab.h"
+#include "lazyfree.h"
+#include "zmalloc.h"
+#include "server.h"
+#include "evict.h"
+#include "command.h"
+#include "util.h"
 #include "test.h"
 
 static int __failed_tests = 0;
 static int __test_num = 0;
 
+static void *_test_slab_remote_free(void *chunks);
+static void _test_scan_callback(void *privdata, const dict_entry *de);
+
 // Test helper defines
 #define test_cond(descr, _c) do{ \
     __test_num ++; printf("%d - %s: ", __test_num, descr); \
@@ -84,16 +99,467 @@ int dict_test_main()
     // test dict_free_iterator()
     test_cond("dict_free_iterator(iter)", dict_free_iterator(iter) == DICT_OK);
 
+    int ok = 1;
+    // test dict_rehash_milliseconds()
+    dict *rd = dict_create(&sample_dict_type);
+    for (long i = 0; i < 1000; i ++) dict_add_entry(rd, sds_from_longlong(i), (void*)i);
+    dict_resize_to(rd, 100000);
+    test_cond("dict_rehash_milliseconds()", dict_is_rehashing(rd) &&
+        dict_rehash_milliseconds(rd, 1000) > 0 && !dict_is_rehashing(rd) && dict_keys(rd) == 1000);
+    dict_release(rd);
+
+    // test 'store_hash'. Keys are matched by stored hashes and moved with them when rehashing
+    dict_type hashed_type = sample_dict_type;
+    hashed_type.store_hash = 1;
+    dict *hd = dict_create(&hashed_type);
+    for (long i = 0; i < 1000; i ++) dict_add_entry(hd, sds_from_longlong(i), (void*)i);
+    while (dict_rehash(hd, 100));
+    ok = 1;
+    for (long i = 0; i < 1000; i ++) {
+        sds key = sds_from_longlong(i);
+        de = dict_find(hd, key);
+        if (de == NULL || dict_get_signed_integer_val(de) != i) ok = 0;
+        sds_free(key);
+    }
+    sds missing_key = sds_new("missing");
+    test_cond("store_hash dict_find()", ok && dict_find(hd, missing_key) == NULL &&
+        dict_delete(hd, missing_key) == DICT_ERR);
+    sds_free(missing_key);
+    dict_release(hd);
+
+    // test hash functions
+    test_cond("crc32c() check value", crc32c(0, (const uint8_t*)"123456789", 9) == 0xE3069283);
+    uint8_t key_a[16] = "0123456789abcdef", key_b[16] = "0123456789abcdeF";
+    ok = 1;
+    for (size_t len = 0; len <= 100; len ++) {
+        const uint8_t *in = (const uint8_t*)"The quick brown fox jumps over the lazy dog, "
+            "The quick brown fox jumps over the lazy dog, The quick brown fox.";
+        if (wyhash(in, len, key_a) == wyhash(in, len, key_b) ||
+            crc32c_hash(in, len, key_a) == crc32c_hash(in, len, key_b)) ok = 0;
+        if (len && (wyhash(in, len, key_a) == wyhash(in + 1, len, key_a) ||
+            crc32c_hash(in, len, key_a) == crc32c_hash(in + 1, len, key_a))) ok = 0;
+    }
+    test_cond("wyhash() and crc32c_hash() depend on key and input", ok);
+
+    ok = 1;
+    for (int hash = DICT_HASH_SIPHASH; hash <= DICT_HASH_CRC32C; hash ++) {
+        dict_type hash_type = sample_dict_type;
+        hash_type.hash_func = dict_sample_hash_func(hash);
+        dict *dh = dict_create(&hash_type);
+        for (long i = 0; i < 1000; i ++) dict_add_entry(dh, sds_from_longlong(i), (void*)i);
+        for (long i = 0; i < 1000; i ++) {
+            sds key = sds_from_longlong(i);
+            de = dict_find(dh, key);
+            if (de == NULL || dict_get_signed_integer_val(de) != i) ok = 0;
+            sds_free(key);
+        }
+        dict_release(dh);
+    }
+    test_cond("dict_sample_hash_func()", ok);
+
+    // test DICT_ENGINE_SWISS. Enough keys to resize several times and leave tombstones
+    dict_type swiss_type = sample_dict_type;
+    swiss_type.engine = DICT_ENGINE_SWISS;
+    dict *sd = dict_create(&swiss_type);
+    ok = 1;
+    for (long i = 0; i < 10000; i ++) {
+        if (dict_add_entry(sd, sds_from_longlong(i), (void*)i) != DICT_OK) ok = 0;
+    }
+    sds dup_key = sds_from_longlong(123);
+    if (dict_add_entry(sd, dup_key, NULL) != DICT_ERR) ok = 0;
+    sds_free(dup_key);
+    test_cond("swiss dict_add_entry()", ok && dict_keys(sd) == 10000);
+
+    for (long i = 0; i < 10000; i += 2) {
+        sds key = sds_from_longlong(i);
+        if (dict_delete(sd, key) != DICT_OK) ok = 0;
+        sds_free(key);
+    }
+    test_cond("swiss dict_delete()", ok && dict_keys(sd) == 5000);
+
+    for (long i = 0; i < 10000; i ++) {
+        sds key = sds_from_longlong(i);
+        de = dict_find(sd, key);
+        if ((i % 2 == 0) != (de == NULL) || (de && dict_get_signed_integer_val(de) != i)) ok = 0;
+        sds_free(key);
+    }
+    test_cond("swiss dict_find()", ok);
+
+    sds key_1 = sds_from_longlong(1);
+    de = dict_unlink(sd, key_1);
+    test_cond("swiss dict_unlink()", de != NULL && dict_get_signed_integer_val(de) == 1 &&
+        dict_find(sd, key_1) == NULL && dict_free_unlinked_entry(sd, de) == DICT_OK);
+    sds_free(key_1);
+
+    // Deleted keys come back in tombstones
+    for (long i = 0; i < 10000; i += 2) dict_add_entry(sd, sds_from_longlong(i), (void*)i);
+    iter = dict_get_safe_iterator(sd);
+    num_entry = 0;
+    while((de = dict_next(iter)) != NULL) num_entry ++;
+    dict_free_iterator(iter);
+    test_cond("swiss dict_next(iter)", num_entry == 9999 && dict_keys(sd) == 9999);
+    dict_release(sd);
+
+    // Keys present during the whole scan are returned, though the dict grows in the middle
+    for (int engine = DICT_ENGINE_CHAINED; engine <= DICT_ENGINE_SWISS; engine ++) {
+        static int seen[5000];
+        dict_type scan_type = sample_dict_type;
+        scan_type.engine = engine;
+        d = dict_create(&scan_type);
+        for (long i = 0; i < 1000; i ++) dict_add_entry(d, sds_from_longlong(i), (void*)i);
+        memset(seen, 0, sizeof(seen));
+
+        unsigned long cursor = 0;
+        int steps = 0;
+        do {
+            cursor = dict_scan(d, cursor, _test_scan_callback, seen);
+            if (++ steps == 10) {
+                for (long i = 1000; i < 5000; i ++) dict_add_entry(d, sds_from_longlong(i), (void*)i);
+            }
+        } while (cursor);
+        ok = 1;
+        for (int i = 0; i < 1000; i ++) ok = ok && seen[i] >= 1;
+        test_cond(engine == DICT_ENGINE_SWISS ? "swiss dict_scan()" : "dict_scan()", ok);
+
+        // Look up existing and missing keys in batches, while the dict is rehashing
+        sds batch_keys[40];
+        dict_entry *found[40];
+        dict_resize_to(d, 50000);
+        for (long i = 0; i < 40; i ++) batch_keys[i] = sds_from_longlong(i * 200 - 1000);
+        size_t num_found = dict_find_batch(d, (void **)batch_keys, 40, found);
+        ok = dict_is_rehashing(d) && num_found == 25;
+        for (long i = 0; i < 40; i ++) {
+            ok = ok && found[i] == dict_find(d, batch_keys[i]);
+            sds_free(batch_keys[i]);
+        }
+        test_cond(engine == DICT_ENGINE_SWISS ? "swiss dict_find_batch()" : "dict_find_batch()", ok);
+
+        // Variants specialized for the hash and compare of the type work as the generic API.
+        // Lookups rehash, which moves swiss entries, so found entries are compared by key
+        for (long i = 0; i < 40; i ++) batch_keys[i] = sds_from_longlong(i * 200 - 1000);
+        ok = dict_sds_siphash_find_batch(d, (void **)batch_keys, 40, found) == 25;
+        for (long i = 0; i < 40; i ++) {
+            int missing = (i < 5 || i >= 30);
+            ok = ok && (found[i] == NULL) == missing;
+            de = dict_sds_siphash_find(d, batch_keys[i]);
+            ok = ok && (de == NULL) == missing && (de == NULL || sds_cmp(de->key, batch_keys[i]) == 0);
+        }
+        ok = ok && dict_sds_siphash_add_entry(d, batch_keys[0], (void*)-1) == DICT_OK;
+        ok = ok && dict_sds_siphash_add_entry(d, batch_keys[0], (void*)-1) == DICT_ERR;
+        ok = ok && dict_get_signed_integer_val(dict_find(d, batch_keys[0])) == -1;
+        de = dict_sds_siphash_unlink(d, batch_keys[0]);
+        ok = ok && de && dict_get_signed_integer_val(de) == -1 && dict_find(d, batch_keys[0]) == NULL;
+        dict_free_unlinked_entry(d, de);
+        ok = ok && dict_sds_siphash_delete(d, batch_keys[5]) == DICT_OK && dict_find(d, batch_keys[5]) == NULL;
+        ok = ok && dict_sds_siphash_delete(d, batch_keys[5]) == DICT_ERR;
+        for (long i = 1; i < 40; i ++) sds_free(batch_keys[i]);
+        test_cond(engine == DICT_ENGINE_SWISS ? "swiss specialized dict API" : "specialized dict API", ok);
+
+        // Samples are entries of the dict, in both tables while rehashing. Fewer may be returned
+        // if the walk runs into empty slots of the new table. Lookups rehash, which moves swiss
+        // entries, so sampled keys are kept before looking them up
+        dict_entry *samples[100];
+        void *sample_keys[100];
+        unsigned int num_samples = dict_get_some_keys(d, samples, 100);
+        ok = num_samples > 0 && num_samples <= 100;
+        for (unsigned int i = 0; i < num_samples; i ++) sample_keys[i] = samples[i]->key;
+        for (unsigned int i = 0; i < num_samples; i ++) {
+            de = dict_find(d, sample_keys[i]);
+            ok = ok && de && de->key == sample_keys[i];
+        }
+        for (int i = 0; i < 1000; i ++) {
+            de = dict_get_random_key(d);
+            void *key = de ? de->key : NULL;
+            de = dict_find(d, key);
+            ok = ok && de && de->key == key;
+        }
+        test_cond(engine == DICT_ENGINE_SWISS ? "swiss dict_get_some_keys()" : "dict_get_some_keys()", ok);
+        dict_release(d);
+    }
+
+    // Tables shrink to fit the keys left after mass deletion, unless resizing is disabled
+    for (int engine = DICT_ENGINE_CHAINED; engine <= DICT_ENGINE_SWISS; engine ++) {
+        dict_type shrink_type = sample_dict_type;
+        shrink_type.engine = engine;
+        d = dict_create(&shrink_type);
+        for (long i = 0; i < 100000; i ++) dict_add_entry(d, sds_from_longlong(i), (void*)i);
+        while (dict_rehash(d, 100));
+        unsigned long full_size = dict_size(d);
+
+        dict_disable_resize();
+        for (long i = 0; i < 50000; i ++) {
+            sds key = sds_from_longlong(i);
+            dict_delete(d, key);
+            sds_free(key);
+        }
+        ok = !dict_is_rehashing(d) && dict_size(d) == full_size;
+        dict_enable_resize();
+        for (long i = 50000; i < 99000; i ++) {
+            sds key = sds_from_longlong(i);
+            dict_delete(d, key);
+            sds_free(key);
+        }
+        // Deletes may end while shrinking. The server checks again periodically
+        while (dict_rehash(d, 100));
+        dict_shrink_if_needed(d);
+        while (dict_rehash(d, 100));
+        ok = ok && dict_keys(d) == 1000 && dict_size(d) <= 2048;
+        for (long i = 99000; i < 100000; i ++) {
+            sds key = sds_from_longlong(i);
+            ok = ok && dict_find(d, key) != NULL;
+            sds_free(key);
+        }
+        test_cond(engine == DICT_ENGINE_SWISS ? "swiss dict_shrink_if_needed()" : "dict_shrink_if_needed()", ok);
+        dict_release(d);
+    }
+
+    // Keys up to 'embed_key_len' are copied into their entries, with sds_hdr_5 or sds_hdr_8, and
+    // freed with them. Entries of each slab class are all given back once the dict is released
+    for (int store_hash = 0; store_hash <= 1; store_hash ++) {
+        slab_class_stats stats_before[SLAB_NUM_CLASSES], stats;
+        char pad[150];
+        dict_type embed_type = sample_dict_type;
+        embed_type.store_hash = store_hash;
+        embed_type.embed_key_len = 100;
+        memset(pad, 'x', sizeof(pad));
+        for (int i = 0; i < SLAB_NUM_CLASSES; i ++) slab_get_class_stats(i, &stats_before[i]);
+
+        d = dict_create(&embed_type);
+        for (long i = 0; i < 10000; i ++) {
+            sds key = sds_cat_len(sds_from_longlong(i), pad, i % 150);
+            dict_add_entry(d, key, (void*)i);
+        }
+        ok = dict_keys(d) == 10000;
+        for (long i = 0; i < 10000; i ++) {
+            sds key = sds_cat_len(sds_from_longlong(i), pad, i % 150);
+            de = (i % 3 == 0) ? dict_unlink(d, key) : dict_find(d, key);
+            ok = ok && de && sds_cmp(de->key, key) == 0 && dict_get_signed_integer_val(de) == i;
+            ok = ok && (dict_add_entry(d, key, (void*)i) == DICT_ERR) == (i % 3 != 0);
+            if (i % 3 == 0) dict_free_unlinked_entry(d, de);
+            if (i % 3 == 1) ok = ok && dict_delete(d, key) == DICT_OK;
+            if (i % 3 != 0) sds_free(key);
+        }
+        // Entries are moved by the rehashing that adds started
+        ok = ok && dict_keys(d) == 6667;
+        for (long i = 0; i < 10000; i ++) {
+            sds key = sds_cat_len(sds_from_longlong(i), pad, i % 150);
+            de = dict_find(d, key);
+            ok = ok && (de != NULL) == (i % 3 != 1) && (de == NULL || sds_cmp(de->key, key) == 0);
+            sds_free(key);
+        }
+        dict_release(d);
+        for (int i = 0; i < SLAB_NUM_CLASSES; i ++) {
+            slab_get_class_stats(i, &stats);
+            ok = ok && stats.num_used == stats_before[i].num_used;
+        }
+        test_cond(store_hash ? "dict with embedded keys and stored hashes" : "dict with embedded keys", ok);
+    }
+
+    // Keys set by dict_add_or_replace_entry() or after dict_accommodate_key() are never embedded,
+    // whatever their length and wherever the allocator puts them, so they are freed with the dict
+    {
+        dict_type embed_type = sample_dict_type;
+        embed_type.embed_key_len = 100;
+        size_t used_before = zmalloc_used_memory();
+        d = dict_create(&embed_type);
+        ok = 1;
+        for (long i = 0; i < 120; i ++) {
+            const char *prefix = (i % 3 == 0) ? "a:" : ((i % 3 == 1) ? "b:" : "c:");
+            sds key = sds_cat_len(sds_new(prefix), "0123456789012345678901234567890123456789", i / 3);
+            if (i % 3 == 0) {
+                ok = ok && dict_add_or_replace_entry(d, key, (void*)i) == 1;
+                ok = ok && (de = dict_find(d, key)) && de->key == key;
+            } else if (i % 3 == 1) {
+                ok = ok && (de = dict_accommodate_key(d, key, NULL));
+                if (de) dict_set_key(d, de, key);
+                ok = ok && de && dict_find(d, key) == de && de->key == key;
+            } else {
+                // The handed over key is freed, as the entry has its own copy
+                sds copy = sds_dup(key);
+                ok = ok && dict_add_entry(d, key, (void*)i) == DICT_OK;
+                ok = ok && (de = dict_find(d, copy)) && sds_cmp(de->key, copy) == 0;
+                sds_free(copy);
+            }
+        }
+        ok = ok && dict_keys(d) == 120;
+        dict_release(d);
+        test_cond("dict with embedded keys frees keys not embedded", ok && zmalloc_used_memory() == used_before);
+    }
+
+    // Random keys are spread over all keys. Chains make dict_get_random_key() biased toward keys
+    // in short chains, which dict_get_fair_random_key() reduces. Measured by chi-square per degree
+    // of freedom, which is about 1 for a uniform sampling
+    for (int engine = DICT_ENGINE_CHAINED; engine <= DICT_ENGINE_SWISS; engine ++) {
+        static long counts[2][1000];
+        double chi2[2] = {0, 0}, expected = 200;
+        dict_type random_type = sample_dict_type;
+        random_type.engine = engine;
+        d = dict_create(&random_type);
+        // Long chains, 4 keys per slot on average
+        if (engine == DICT_ENGINE_CHAINED) {
+            dict_resize_to(d, 256);
+            dict_disable_resize();
+        }
+        for (long i = 0; i < 1000; i ++) dict_add_entry(d, sds_from_longlong(i), (void*)i);
+        dict_enable_resize();
+
+        memset(counts, 0, sizeof(counts));
+        for (int i = 0; i < 1000 * expected; i ++) {
+            counts[0][dict_get_signed_integer_val(dict_get_random_key(d))] ++;
+            counts[1][dict_get_signed_integer_val(dict_get_fair_random_key(d))] ++;
+        }
+        ok = 1;
+        for (int m = 0; m < 2; m ++) {
+            for (int i = 0; i < 1000; i ++) {
+                ok = ok && counts[m][i] > 0;
+                chi2[m] += (counts[m][i] - expected) * (counts[m][i] - expected) / expected;
+            }
+            chi2[m] /= 999;
+        }
+        if (engine == DICT_ENGINE_CHAINED) {
+            test_cond("dict_get_fair_random_key() less biased", ok && chi2[1] < chi2[0] / 2);
+        } else {
+            test_cond("swiss dict_get_random_key() uniform", ok && chi2[0] < 1.5 && chi2[1] < 1.5);
+        }
+        dict_release(d);
+    }
+
+    // Slab chunks are reused, and freeing from another thread gives them back to the owner
+    slab_class_stats stats_before, stats;
+    slab_get_class_stats(2, &stats_before);
+    void *chunks[1000];
+    for (int i = 0; i < 1000; i ++) chunks[i] = slab_alloc(24);
+    slab_get_class_stats(2, &stats);
+    ok = stats.chunk_size == 24 && stats.num_used == stats_before.num_used + 1000;
+    void *p = chunks[999];
+    slab_free(p, 24);
+    ok = ok && slab_alloc(24) == p;
+    test_cond("slab_alloc() and slab_free()", ok);
+
+    pthread_t thread;
+    pthread_create(&thread, NULL, _test_slab_remote_free, chunks);
+    pthread_join(thread, NULL);
+    // Remote frees are taken back when the local free list runs out, before a new block is carved
+    slab_get_class_stats(2, &stats);
+    ok = stats.num_used == stats_before.num_used + 1000;
+    unsigned long num_blocks = stats.num_blocks, n = stats.num_chunks - stats.num_used + 1000;
+    void **more = zmalloc(sizeof(void*) * n);
+    for (unsigned long i = 0; i < n; i ++) more[i] = slab_alloc(24);
+    slab_get_class_stats(2, &stats);
+    ok = ok && stats.num_blocks == num_blocks && stats.num_used == stats.num_chunks;
+    for (unsigned long i = 0; i < n; i ++) slab_free(more[i], 24);
+    zfree(more);
+    slab_get_class_stats(2, &stats);
+    test_cond("slab_free() by another thread", ok && stats.num_used == stats_before.num_used);
+
+    // Blocks are returned once all their chunks are freed
+    slab_get_class_stats(5, &stats_before);
+    n = 10 * SLAB_BLOCK_SIZE / 48;
+    more = zmalloc(sizeof(void*) * n);
+    for (unsigned long i = 0; i < n; i ++) more[i] = slab_alloc(48);
+    slab_get_class_stats(5, &stats);
+    ok = stats.num_blocks >= stats_before.num_blocks + 10;
+    for (unsigned long i = 0; i < n; i ++) slab_free(more[i], 48);
+    zfree(more);
+    slab_get_class_stats(5, &stats);
+    test_cond("slab_free() returns empty blocks", ok && stats.num_blocks <= stats_before.num_blocks + 1);
+
+    // zmalloc() counts the usable size of blocks allocated and not freed, of sds strings too
+    size_t used_before = zmalloc_used_memory();
+    p = zmalloc(1000);
+    ok = zmalloc_used_memory() >= used_before + 1000;
+    p = zrealloc(p, 100000);
+    sds big_str = sds_new_len(NULL, 1024 * 1024);
+    ok = ok && zmalloc_used_memory() >= used_before + 100000 + 1024 * 1024;
+    zfree(p);
+    sds_free(big_str);
+    test_cond("zmalloc_used_memory()", ok && zmalloc_used_memory() == used_before && zmalloc_get_rss() > 0);
+
+    // The lazyfree thread frees entries and objects back to the slabs of this thread
+    lazyfree_init();
+    slab_get_class_stats(3, &stats_before);
+    d = dict_create(&db_dict_type);
+    for (int i = 0; i < 100000; i ++) {
+        sds key = sds_from_longlong(i);
+        dict_add_entry(d, key, obj_create_string(key, sds_len(key)));
+    }
+    lazyfree_free_dict(d);
+    arobj *big = obj_create(OBJ_TYPE_STRING, OBJ_ENC_SDS, sds_new_len(NULL, 1024 * 1024));
+    ok = lazyfree_get_effort(big) == 1 + 1024 * 1024 / 4096;
+    lazyfree_free_obj(big);
+    while (lazyfree_get_pending()) usleep(1000);
+    while (slab_reclaim());
+    slab_get_class_stats(3, &stats);
+    test_cond("lazyfree_free_dict() and lazyfree_free_obj()", ok && stats.num_used == stats_before.num_used
+        && stats.num_blocks <= stats_before.num_blocks + 1);
+
+    // Approximated LRU evicts keys not accessed lately first, and just enough of them
+    arena_shard shard = {0};
+    this_shard = &shard;
+    server.num_db = 1;
+    server.maxmemory_samples = 5;
+    db_init();
+    evict_init();
+    database *db = this_shard->db;
+    shard.lru_clock = 100;
+    char val[256] = {0};
+    for (int i = 0; i < 2000; i ++) {
+        db_add(db, sds_from_longlong(i), obj_create_string(val, sizeof(val)));
+    }
+    shard.lru_clock = 200;
+    for (int i = 0; i < 1000; i ++) {
+        sds key = sds_from_longlong(i);
+        db_find(db, key);
+        sds_free(key);
+    }
+    sds first = sds_from_longlong(0), last = sds_from_longlong(1999);
+    ok = evict_get_idle_ms(dict_get_val(dict_find(db->d, first))) == 0
+        && evict_get_idle_ms(dict_get_val(dict_find(db->d, last))) == 100 * EVICT_LRU_CLOCK_RESOLUTION;
+    sds_free(first);
+    sds_free(last);
+    server.maxmemory = zmalloc_used_memory() - 500 * sizeof(val);
+    server.maxmemory_policy = EVICT_ALLKEYS_LRU;
+    while (zmalloc_used_memory() > server.maxmemory) {
+        if (evict_perform() != C_OK) break;
+    }
+    int touched = 0;
+    for (int i = 0; i < 1000; i ++) {
+        sds key = sds_from_longlong(i);
+        if (db_find(db, key)) touched ++;
+        sds_free(key);
+    }
+    test_cond("evict_perform() with allkeys-lru", ok && touched >= 990 && shard.stat_evictedkeys > 0
+        && shard.stat_evictedkeys <= 500 && dict_keys(db->d) == 2000 - (unsigned long)shard.stat_evictedkeys);
+    server.maxmemory = 0;
+    dict_release(db->d);
+    zfree(db);
+    for (int i = 0; i < EVICT_POOL_SIZE; i ++) sds_free(shard.evict_pool[i].key);
+    zfree(shard.evict_pool);
+    this_shard = NULL;
+
     test_report();
     return 0;
 };
 
+static void *_test_slab_remote_free(void *chunks)
+{
+    for (int i = 0; i < 1000; i ++) slab_free(((void**)chunks)[i], 24);
+    return NULL;
+}
+
+static void _test_scan_callback(void *privdata, const dict_entry *de)
+{
+    ((int*)privdata)[dict_get_signed_integer_val(de)] ++;
+}
+
 /*-----------------------------------SDS TEST-----------------------------------------------*/
 int sds_test_main()
 {
-    assert(sizeof(sds_hdr_6) == 1);
+    assert(sizeof(sds_hdr_5) == 1);
     assert(sizeof(sds_hdr_8) == 3);
     assert(sizeof(sds_hdr_16) == 5);
+    assert(sizeof(sds_hdr_32) == 9);
+    assert(sizeof(sds_hdr_64) == 17);
 
 
     sds x = sds_new("foo"), y;
@@ -237,6 +703,45 @@ int sds_test_main()
 
         sds_free(x);
     }
+
+    {
+        // Appends promote the header from sds_hdr_5 up to sds_hdr_32, keeping the content
+        char chunk[1000];
+        int ok = 1, last_type = SDS_TYPE_5;
+        for (int i = 0; i < sizeof(chunk); i ++) chunk[i] = 'a' + i % 26;
+        x = sds_new("");
+        for (int i = 0; i < 200; i ++) {
+            x = sds_cat_len(x, chunk, 1 + i * 5 % sizeof(chunk));
+            int type = x[-1] & SDS_TYPE_MASK;
+            ok = ok && x != NULL && type >= last_type && sds_avail(x) <= sds_len(x);
+            last_type = type;
+        }
+        size_t len = 0;
+        for (int i = 0; i < 200; i ++) {
+            size_t n = 1 + i * 5 % sizeof(chunk);
+            ok = ok && memcmp(x + len, chunk, n) == 0;
+            len += n;
+        }
+        test_cond("sds_cat_len() beyond 64K", ok && sds_len(x) == len && len > UINT16_MAX &&
+            last_type == SDS_TYPE_32 && x[len] == '\0');
+        sds_free(x);
+
+        x = sds_new_len(NULL, 100000);
+        sds_range(x, 99990, -1);
+        test_cond("sds_new_len() and sds_range() beyond 64K", sds_len(x) == 10 && (x[-1] & SDS_TYPE_MASK) == SDS_TYPE_32);
+        sds_free(x);
+    }
+
+    #define _test_match(p, s) util_string_match(p, strlen(p), s, strlen(s), 0)
+    test_cond("util_string_match()",
+        _test_match("*", "") && _test_match("user:*", "user:1000") && !_test_match("user:*", "usr:1") &&
+        _test_match("h?llo", "hello") && !_test_match("h?llo", "hllo") &&
+        _test_match("h[ae]llo", "hallo") && !_test_match("h[^e]llo", "hello") &&
+        _test_match("key[0-9]", "key7") && !_test_match("key[0-9]", "keyx") &&
+        _test_match("a\\*b", "a*b") && !_test_match("a\\*b", "axb") &&
+        _test_match("*a*b*c", "xxaxxbxxc") && !_test_match("*a*b*c", "xxaxxcxxb") &&
+        util_string_match("KEY*", 4, "key1", 4, 1));
+    #undef _test_match
     test_report();
 
     return 0;
@@ -10,6 +10,7 @@
 #include <sys/time.h>
 #include <string.h>
 #include <ctype.h>
+#include <limits.h>
 #include <unistd.h>
 #include "client.h"
 #include "debug.h"
@@ -60,6 +61,14 @@ long long util_get_time_in_millisecond()
     return ((long long)tv.tv_sec * 1000) + (tv.tv_usec / 1000);
 }
 
+// Return time elasped in microsecond since Unix 1970.1.1 0:0:0
+long long util_get_time_in_microsecond()
+{
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return ((long long)tv.tv_sec * 1000000) + tv.tv_usec;
+}
+
 // Convert a signed long long value to string at 'buf'. Returned int is its length.
 // Note that the size of 'buf' must >= LEN_LL_TO_STR
 int util_convert_ll_to_str(char *buf, long long val)
@@ -92,7 +101,123 @@ int util_convert_ll_to_str(char *buf, long long val)
     return len;
 }
 
+// Convert the string at 'buf' of 'len' bytes to a long long stored at 'val'.
+// Return 1 if the whole string is a valid decimal integer in range, otherwise 0.
+int util_convert_str_to_ll(const char *buf, size_t len, long long *val)
+{
+    const char *p = buf, *end = buf + len;
+    unsigned long long v = 0;
+    int negative = 0;
+
+    if (len == 0 || len >= LEN_LL_TO_STR) return 0;
+    if (*p == '-') {
+        negative = 1;
+        p ++;
+        if (p == end) return 0;
+    }
+    // Leading zeros are not allowed, except for "0" itself
+    if (*p == '0' && end - p > 1) return 0;
 
+    for (; p < end; p ++) {
+        if (*p < '0' || *p > '9') return 0;
+        if (v > (ULLONG_MAX - (*p - '0')) / 10) return 0;   // overflow
+        v = v * 10 + (*p - '0');
+    }
 
+    if (negative) {
+        if (v > (unsigned long long)LLONG_MAX + 1) return 0;
+        *val = (v == 0) ? 0 : -(long long)(v - 1) - 1;
+    } else {
+        if (v > LLONG_MAX) return 0;
+        *val = v;
+    }
+    return 1;
+}
 
+// Match char 'c' against the pattern token at '*pos' of 'pattern', and move '*pos' past the token.
+// A token is '?', a class like "[a-z0-9]" or "[^abc]", an escaped char like "\*", or a plain char.
+static int _util_match_char(const char *pattern, size_t plen, size_t *pos, char c, int nocase)
+{
+    size_t p = *pos;
+    int match = 0;
+    unsigned char uc = nocase ? tolower((unsigned char)c) : (unsigned char)c;
+    #define _util_char(x) (nocase ? tolower((unsigned char)(x)) : (unsigned char)(x))
+
+    switch (pattern[p]) {
+    case '?':
+        match = 1;
+        p ++;
+        break;
+    case '[': {
+        int negate = 0;
+        p ++;
+        if (p < plen && pattern[p] == '^') {
+            negate = 1;
+            p ++;
+        }
+        while (p < plen && pattern[p] != ']') {
+            if (pattern[p] == '\\' && p + 1 < plen) {
+                if (_util_char(pattern[p + 1]) == uc) match = 1;
+                p += 2;
+            } else if (p + 2 < plen && pattern[p + 1] == '-' && pattern[p + 2] != ']') {
+                unsigned char start = _util_char(pattern[p]), end = _util_char(pattern[p + 2]);
+                if (start > end) {
+                    unsigned char t = start;
+                    start = end;
+                    end = t;
+                }
+                if (uc >= start && uc <= end) match = 1;
+                p += 3;
+            } else {
+                if (_util_char(pattern[p]) == uc) match = 1;
+                p ++;
+            }
+        }
+        if (p < plen) p ++;  // skip ']'
+        if (negate) match = !match;
+        break;
+    }
+    case '\\':
+        if (p + 1 < plen) p ++;
+        /* fall through */
+    default:
+        match = (_util_char(pattern[p]) == uc);
+        p ++;
+        break;
+    }
+    #undef _util_char
+    *pos = p;
+    return match;
+}
 
+// Return 1 if 'str' of 'slen' bytes matches glob-style 'pattern' of 'plen' bytes, otherwise 0.
+// Besides the tokens of _util_match_char(), '*' matches any number of chars. On a mismatch only
+// the last '*' is retried with one more char, so the time is O(plen * slen) at worst.
+int util_string_match(const char *pattern, size_t plen, const char *str, size_t slen, int nocase)
+{
+    size_t p = 0, s = 0, star_p = 0, star_s = 0;
+    int has_star = 0;
+
+    while (s < slen) {
+        if (p < plen) {
+            if (pattern[p] == '*') {
+                has_star = 1;
+                star_p = ++ p;
+                star_s = s;
+                continue;
+            }
+            size_t next_p = p;
+            if (_util_match_char(pattern, plen, &next_p, str[s], nocase)) {
+                p = next_p;
+                s ++;
+                continue;
+            }
+        }
+        // Mismatch. Let the last '*' take one more char
+        if (!has_star) return 0;
+        p = star_p;
+        s = ++ star_s;
+    }
+    while (p < plen && pattern[p] == '*') p ++;
+    return p == plen;
+}
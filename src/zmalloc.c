@@ -0,0 +1,144 @@
+/*
+    ArenaDB allocator. 5.24
+*/
+
+/*
+*   Every allocation of the server goes through zmalloc(), zcalloc(), zrealloc(), zaligned_alloc()
+*   and zfree(), so that the memory in use is known precisely. Each of them adds or subtracts the
+*   usable size of the block to 'used_memory', an atomic counter shared by all threads.
+*
+*   The allocator is chosen at build time, libc malloc() by default. 'make MALLOC=jemalloc' or
+*   'make MALLOC=mimalloc' links the library installed on the system instead. Allocations never
+*   fail: the server panics when out of memory.
+*/
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <stdatomic.h>
+#include "zmalloc.h"
+#include "debug.h"
+
+#if defined(USE_MIMALLOC)
+#include <mimalloc.h>
+#define ZMALLOC_LIB                 "mimalloc"
+#define _zmalloc_malloc(size)       mi_malloc(size)
+#define _zmalloc_calloc(num, size)  mi_calloc(num, size)
+#define _zmalloc_realloc(p, size)   mi_realloc(p, size)
+#define _zmalloc_aligned(a, size)   mi_malloc_aligned(size, a)
+#define _zmalloc_free(p)            mi_free(p)
+#define _zmalloc_size(p)            mi_usable_size(p)
+#elif defined(USE_JEMALLOC)
+#include <jemalloc/jemalloc.h>
+#define ZMALLOC_LIB                 "jemalloc"
+#define _zmalloc_malloc(size)       malloc(size)
+#define _zmalloc_calloc(num, size)  calloc(num, size)
+#define _zmalloc_realloc(p, size)   realloc(p, size)
+#define _zmalloc_aligned(a, size)   aligned_alloc(a, size)
+#define _zmalloc_free(p)            free(p)
+#define _zmalloc_size(p)            malloc_usable_size(p)
+#else
+#include <malloc.h>
+#define ZMALLOC_LIB                 "libc"
+#define _zmalloc_malloc(size)       malloc(size)
+#define _zmalloc_calloc(num, size)  calloc(num, size)
+#define _zmalloc_realloc(p, size)   realloc(p, size)
+#define _zmalloc_aligned(a, size)   aligned_alloc(a, size)
+#define _zmalloc_free(p)            free(p)
+#define _zmalloc_size(p)            malloc_usable_size(p)
+#endif
+
+// Bytes allocated and not freed, by usable size. Relaxed, since it's a statistic only
+static atomic_size_t used_memory = 0;
+
+#define _zmalloc_stat_alloc(p) atomic_fetch_add_explicit(&used_memory, _zmalloc_size(p), memory_order_relaxed)
+#define _zmalloc_stat_free(p)  atomic_fetch_sub_explicit(&used_memory, _zmalloc_size(p), memory_order_relaxed)
+
+static void _zmalloc_oom(size_t size);
+
+// Allocate 'size' bytes. Never fails.
+void *zmalloc(size_t size)
+{
+    void *p = _zmalloc_malloc(size);
+    if (p == NULL) _zmalloc_oom(size);
+    _zmalloc_stat_alloc(p);
+    return p;
+}
+
+// Allocate 'num' zeroed elements of 'size' bytes. Never fails.
+void *zcalloc(size_t num, size_t size)
+{
+    void *p = _zmalloc_calloc(num, size);
+    if (p == NULL) _zmalloc_oom(num * size);
+    _zmalloc_stat_alloc(p);
+    return p;
+}
+
+// Resize 'p' to 'size' bytes. Allocate if 'p' is NULL. Never fails.
+void *zrealloc(void *p, size_t size)
+{
+    if (p == NULL) return zmalloc(size);
+
+    size_t old_size = _zmalloc_size(p);
+    void *new_p = _zmalloc_realloc(p, size);
+    if (new_p == NULL) _zmalloc_oom(size);
+    atomic_fetch_sub_explicit(&used_memory, old_size, memory_order_relaxed);
+    _zmalloc_stat_alloc(new_p);
+    return new_p;
+}
+
+// Allocate 'size' bytes aligned to 'alignment', a power of 2. Never fails.
+void *zaligned_alloc(size_t alignment, size_t size)
+{
+    void *p = _zmalloc_aligned(alignment, size);
+    if (p == NULL) _zmalloc_oom(size);
+    _zmalloc_stat_alloc(p);
+    return p;
+}
+
+// Free 'p' allocated by any of the functions above. No operation if 'p' is NULL.
+void zfree(void *p)
+{
+    if (p == NULL) return;
+    _zmalloc_stat_free(p);
+    _zmalloc_free(p);
+}
+
+// Return the bytes allocated by all threads and not freed yet.
+size_t zmalloc_used_memory()
+{
+    return atomic_load_explicit(&used_memory, memory_order_relaxed);
+}
+
+// Return the resident set size of the process in bytes, read from /proc/self/statm, or 0 if
+// it can't be read.
+size_t zmalloc_get_rss()
+{
+    unsigned long size, resident;
+    FILE *fp = fopen("/proc/self/statm", "r");
+    if (fp == NULL) return 0;
+
+    int n = fscanf(fp, "%lu %lu", &size, &resident);
+    fclose(fp);
+    return (n == 2) ? resident * sysconf(_SC_PAGESIZE) : 0;
+}
+
+// Return how much more memory the process holds than it uses, as the ratio of 'rss' to the
+// used memory. Above 1 due to fragmentation and allocator overhead, below 1 if swapped out.
+double zmalloc_get_fragmentation_ratio(size_t rss)
+{
+    size_t used = zmalloc_used_memory();
+    return used ? (double)rss / used : 0;
+}
+
+// Return the name of the allocator the server is built with.
+const char *zmalloc_lib()
+{
+    return ZMALLOC_LIB;
+}
+
+// Out of memory. There is no sensible way to go on.
+static void _zmalloc_oom(size_t size)
+{
+    server_panic("Out of memory allocating %zu bytes", size);
+}